@@ -0,0 +1,254 @@
+// Micro-benchmark of the likelihood engines, built without R (see the
+// Makefile in this directory).  Synthetic herds are simulated as for
+// simulate_basic(), and each engine's calculate() is timed over a grid of
+// herd sizes, numbers of time points and parameter values.  Results are
+// written as CSV with the median and 95th percentile time per call and
+// the throughput in animal-timepoints per second.  The engine chosen at
+// runtime is also timed through the C interface (himm_api.h).
+//
+// Usage:  himm_bench [--quick] [--reps N] [--threads N] [--out file.csv]
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "SimpleForward.h"
+#include "HimmTemplate.h"
+#include "ForwardTemplate.h"
+#include "himm_api.h"
+
+struct BenchPars
+{
+  const char* name;
+  double p1;
+  double beta_const;
+  double beta_freq;
+  double gamma;
+  double se;
+  double sp;
+};
+
+// Same model as simulate_basic(), as an nP x nT column-major buffer
+std::vector<int> simulate_herd(const int nP, const int nT, const BenchPars& pars, std::mt19937_64& rng)
+{
+  std::uniform_real_distribution<double> unif(0.0, 1.0);
+
+  std::vector<int> obs(static_cast<size_t>(nP)*nT);
+  std::vector<int> state(nP);
+  for(int i=0L; i<nP; ++i)
+  {
+    state[i] = unif(rng) < pars.p1;
+  }
+
+  for(int t=0L; t<nT; ++t)
+  {
+    if(t > 0L)
+    {
+      double prev = 0.0;
+      for(int i=0L; i<nP; ++i)
+      {
+        prev += state[i];
+      }
+      const double beta = 1.0 - (1.0 - pars.beta_freq * prev / nP) * (1.0 - pars.beta_const);
+      for(int i=0L; i<nP; ++i)
+      {
+        state[i] = unif(rng) < (state[i] ? 1.0 - pars.gamma : beta);
+      }
+    }
+    for(int i=0L; i<nP; ++i)
+    {
+      obs[i + static_cast<size_t>(t)*nP] = unif(rng) < (state[i] ? pars.se : 1.0 - pars.sp);
+    }
+  }
+
+  return obs;
+}
+
+struct Timing
+{
+  double median;
+  double p95;
+  double logdens;
+};
+
+// Times calculate, which returns the log density, after setup
+template<class C, class F>
+Timing time_calculate(const int reps, C calculate, F setup)
+{
+  setup();
+  calculate();
+
+  std::vector<double> seconds(reps);
+  for(int r=0L; r<reps; ++r)
+  {
+    const auto start = std::chrono::steady_clock::now();
+    calculate();
+    const auto stop = std::chrono::steady_clock::now();
+    seconds[r] = std::chrono::duration<double>(stop - start).count();
+  }
+  std::sort(seconds.begin(), seconds.end());
+
+  Timing rv;
+  rv.median = reps % 2L ? seconds[reps/2L] : 0.5 * (seconds[reps/2L - 1L] + seconds[reps/2L]);
+  rv.p95 = seconds[std::min<size_t>(reps - 1L, static_cast<size_t>(std::ceil(0.95 * reps)) - 1L)];
+  rv.logdens = calculate();
+  return rv;
+}
+
+template<class F>
+Timing time_calls(const int reps, Himm& engine, F setup)
+{
+  return time_calculate(reps, [&]()
+  {
+    engine.calculate();
+    return engine.logDensity();
+  }, setup);
+}
+
+int main(int argc, char** argv)
+{
+  bool quick = false;
+  int reps = 11L;
+  int threads = 1L;
+  std::string out = "bench_engines.csv";
+
+  for(int a=1L; a<argc; ++a)
+  {
+    if(std::strcmp(argv[a], "--quick") == 0) quick = true;
+    else if(std::strcmp(argv[a], "--reps") == 0 && a+1L < argc) reps = std::atoi(argv[++a]);
+    else if(std::strcmp(argv[a], "--threads") == 0 && a+1L < argc) threads = std::atoi(argv[++a]);
+    else if(std::strcmp(argv[a], "--out") == 0 && a+1L < argc) out = argv[++a];
+    else
+    {
+      std::fprintf(stderr, "Usage: %s [--quick] [--reps N] [--threads N] [--out file.csv]\n", argv[0L]);
+      return 1L;
+    }
+  }
+  if(reps < 1L || threads < 1L)
+  {
+    std::fprintf(stderr, "reps and threads must be at least 1\n");
+    return 1L;
+  }
+  set_default_threads(threads);
+
+  const std::vector<int> nPs = quick ? std::vector<int>{ 100L, 10000L } :
+    std::vector<int>{ 100L, 1000L, 10000L, 100000L, 1000000L };
+  const std::vector<int> nTs = quick ? std::vector<int>{ 5L, 50L } :
+    std::vector<int>{ 5L, 20L, 50L, 200L };
+  const std::vector<BenchPars> parsets = {
+    { "low", 0.05, 0.01, 0.0, 0.2, 0.8, 0.99 },
+    { "high", 0.3, 0.1, 0.0, 0.05, 0.6, 0.9 }
+  };
+
+  std::ofstream csv(out);
+  if(!csv)
+  {
+    std::fprintf(stderr, "Unable to open %s\n", out.c_str());
+    return 1L;
+  }
+  csv << "engine,variant,pars,nP,nT,n_patterns,threads,reps,median_s,p95_s,animal_timepoints_per_s,log_density\n";
+
+  auto report = [&](const char* engine, const char* variant, const BenchPars& pars,
+                    const int nP, const int nT, const int npat, const Timing& tm)
+  {
+    char line[512L];
+    std::snprintf(line, sizeof(line), "%s,%s,%s,%i,%i,%i,%i,%i,%.6e,%.6e,%.6e,%.10f\n",
+                  engine, variant, pars.name, nP, nT, npat, threads, reps, tm.median, tm.p95,
+                  static_cast<double>(nP) * nT / tm.median, tm.logdens);
+    csv << line;
+    std::fputs(line, stdout);
+  };
+
+  std::mt19937_64 rng(2022L);
+  for(const BenchPars& pars : parsets)
+  {
+    for(const int nT : nTs)
+    {
+      for(const int nP : nPs)
+      {
+        const std::vector<int> obs = simulate_herd(nP, nT, pars, rng);
+        const std::vector<double> prv1 = { pars.p1 };
+        const std::vector<double> beta_const = { pars.beta_const };
+        const std::vector<double> beta_freq = { pars.beta_freq };
+        const std::vector<double> gamm = { pars.gamma };
+        const std::vector<double> test_pars = { pars.se, pars.sp };
+
+        {
+          SimpleForward engine(nP, nT);
+          engine.addDataBuffer(obs.data());
+          const std::pair<const char*, std::pair<bool, bool>> variants[] = {
+            { "scalar", { false, false } }, { "simd", { true, false } }, { "scaled", { false, true } }
+          };
+          for(const auto& variant : variants)
+          {
+            const Timing tm = time_calls(reps, engine, [&]()
+            {
+              engine.setSimd(variant.second.first);
+              engine.setScaled(variant.second.second);
+              engine.setRates(prv1, beta_const, beta_freq, gamm);
+              engine.setTestPars(test_pars);
+            });
+            report("SimpleForward", variant.first, pars, nP, nT, engine.getNumPatterns(), tm);
+          }
+        }
+
+        {
+          ForwardTemplate<2L> engine(nP, nT, 2L);
+          engine.addDataBuffer(obs.data());
+          const Timing tm = time_calls(reps, engine, [&]()
+          {
+            const std::vector<double> pi1 = { 1.0 - pars.p1, pars.p1 };
+            const std::vector<double> trans = { 1.0 - pars.beta_const, pars.gamma, pars.beta_const, 1.0 - pars.gamma };
+            const std::vector<double> pos = { 1.0 - pars.sp, pars.se };
+            engine.setRates(pi1, trans, { 0.0 }, { 0.0 });
+            engine.setTestPars(pos);
+          });
+          report("ForwardTemplate", "K2", pars, nP, nT, engine.getNumPatterns(), tm);
+        }
+
+        // The full enumeration engine is only compiled for nT = 5:
+        if(nT == 5L)
+        {
+          HimmTemplate<0L, 5L, 32L> engine(nP, nT);
+          engine.addDataBuffer(obs.data());
+          const Timing tm = time_calls(reps, engine, [&]()
+          {
+            engine.setRates(prv1, beta_const, beta_freq, gamm);
+            engine.setTestPars(test_pars);
+          });
+          report("HimmTemplate", "Nx5", pars, nP, nT, engine.getNumPatterns(), tm);
+        }
+
+        {
+          himm_engine* engine;
+          if(himm_create(HIMM_TEMPLATE, obs.data(), nP, nT, &engine) != HIMM_OK)
+          {
+            std::fprintf(stderr, "%s\n", himm_last_error());
+            return 1L;
+          }
+          const double scalar_rates[4L] = { pars.p1, pars.beta_const, pars.beta_freq, pars.gamma };
+          const Timing tm = time_calculate(reps, [&]()
+          {
+            double logdens = NAN;
+            himm_calculate(engine, &logdens);
+            return logdens;
+          }, [&]()
+          {
+            himm_set_rates(engine, scalar_rates, 1L, scalar_rates + 1L, 1L, scalar_rates + 2L, 1L, scalar_rates + 3L, 1L);
+            himm_set_test_pars(engine, test_pars.data(), test_pars.size());
+          });
+          report("himm_api", nT <= 8L ? "HimmTemplate" : "SimpleForward", pars, nP, nT, himm_num_patterns(engine), tm);
+          himm_destroy(engine);
+        }
+      }
+    }
+  }
+
+  return 0L;
+}
@@ -8,7 +8,7 @@
 //#include <R.h>
 
 #include "DHimm.h"
-#include "Himm.h"
+#include "himm_api.h"
 #include "pointer_storage.h"
 
 using std::vector;
@@ -24,9 +24,9 @@ using std::max;
     - gamma (recovery rate)
     - sensitivity
     - specificity
-  Limitations (to be solved with vector version):
-    - No risk factors at farm/animal level (vectorise betas and gamma)
-    - Observation layer assumes dichotomous test (vectorise obs layer parameters to arbitrary length)
+  Limitations:
+    - No risk factors at farm/animal level (see dhimmvec for per-animal betas and gamma)
+    - Observation layer assumes a single dichotomous test (SimpleForward$setTestPars takes up to 4 per time point)
 */
 
 #define PROB(par) (*par[0])
@@ -41,7 +41,8 @@ DHimm::DHimm()
 
 bool DHimm::checkParameterValue (vector<double const *> const &parameters) const
 {
-  // Note: the C++ object is re-used between models, so pointer index may vary
+  // Note: the C++ object is re-used between models, so nothing about the
+  // pointer index is stored here
 
   // TODO checks based on parameter values alone:
 
@@ -52,56 +53,28 @@ double DHimm::logDensity(double x, PDFType type,
 			 vector<double const *> const &parameters,
 			 double const *lbound, double const *ubound) const
 {
-  // Set the pointer on first run:
-  const int xint = static_cast<int>(x);
-  if(m_pointer_index == 0L)
+  // The response value is the pointer index, which is looked up on every
+  // call as the same distribution object is shared between models:
+  himm_engine* engine = himm_from_index(static_cast<int>(x));
+  if(!engine)
   {
-    m_pointer_index = xint;
-    printf("SETTING POINTER INDEX to %i\n", xint);
+    printf("INVALID POINTER INDEX %i\n", static_cast<int>(x));
+    return JAGS_NAN;
   }
 
-  // Check the pointer hasn't changed:
-  if(xint != m_pointer_index)
+  // Copy the parameters to the stack and calculate the log density:
+  double pars[HIMM_NPARS];
+  for(int i=0L; i<HIMM_NPARS; ++i)
   {
-    printf("CHANGED POINTER INDEX FROM %i To %i\n", m_pointer_index, xint);
-    m_pointer_index = xint;
-    // return JAGS_NAN;
+    pars[i] = *parameters[i];
   }
-  // Check the pointer storage:
-  const bool valid = verify_index(m_pointer_index);
-  if(!valid)
+  double dens = JAGS_NAN;
+  if(himm_evaluate(engine, pars, &dens) != HIMM_OK)
   {
-    printf("INVALID POINTER INDEX %i\n", m_pointer_index);
+    printf("ERROR IN dhimm: %s\n", himm_last_error());
     return JAGS_NAN;
-    // throw("Invalid pointer index (response value)");
-  }
-  // Get the pointer:
-  Himm* himm = get_pointer(m_pointer_index);
-  // Unless we have already reported who we are, do that:
-  if(!m_reported)
-  {
-    himm->show();
-    m_reported = true;
   }
 
-  // Set up parameter vectors:
-  const std::vector<double> prv1 = { *parameters[0L] };
-  const std::vector<double> beta_const = { *parameters[1L] };
-  const std::vector<double> beta_freq = { *parameters[2L] };
-  const std::vector<double> gamm = { *parameters[3L] };
-  const std::vector<double> test_pars = { *parameters[4L], *parameters[5L] };
-
-  // Set rate parameters:
-  himm->setRates(prv1, beta_const, beta_freq, gamm);
-  // Set diagnostic test parameters:
-  himm->setTestPars(test_pars);
-
-  // Calculate log density etc:
-  himm->calculate();
-
-  // Get log density:
-  const double dens = himm->logDensity();
-
   return dens;
   //return d == 0 ? JAGS_NEGINF : log(d);
 }
@@ -14,9 +14,6 @@ namespace himm {
  * </pre>
  */
 class DHimm : public ScalarDist {
-private:
-  mutable bool m_reported = false;
-  mutable int m_pointer_index = 0L;
 public:
     DHimm();
     double logDensity(double x, PDFType type,
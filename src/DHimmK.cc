@@ -0,0 +1,136 @@
+#include <util/nainf.h>
+
+#include <cmath>
+
+#include "DHimmK.h"
+#include "himm_api.h"
+
+using std::vector;
+
+/*
+  General K-state version of dhimm, with parameters:
+    - initial state probabilities (length K)
+    - transition matrix (K x K, rows sum to 1)
+    - probability of a positive test in each state (length K)
+*/
+
+#define PI1(par) (par[0])
+#define TRANS(par) (par[1])
+#define TESTCHAR(par) (par[2])
+#define NSTATES(dims) (dims[0][0])
+
+// Tolerance for pi1 and each row of the transition matrix summing to 1:
+static const double sum_tolerance = 1e-6;
+
+namespace jags {
+namespace himm {
+
+DHimmK::DHimmK()
+    : ArrayDist("dhimmk", 3L)
+{}
+
+bool DHimmK::checkParameterDim(vector<vector<unsigned int> > const &dims) const
+{
+  if(dims[0].size() != 1L) return false;
+  const unsigned int K = NSTATES(dims);
+  if(dims[1].size() != 2L || dims[1][0] != K || dims[1][1] != K) return false;
+  if(dims[2].size() != 1L || dims[2][0] != K) return false;
+  return true;
+}
+
+bool DHimmK::checkParameterValue(vector<double const *> const &parameters,
+                                 vector<vector<unsigned int> > const &dims) const
+{
+  const unsigned int K = NSTATES(dims);
+  for(unsigned int i = 0; i < K; ++i)
+  {
+    if(PI1(parameters)[i] < 0.0 || PI1(parameters)[i] > 1.0) return false;
+    if(TESTCHAR(parameters)[i] < 0.0 || TESTCHAR(parameters)[i] > 1.0) return false;
+  }
+  for(unsigned int i = 0; i < K*K; ++i)
+  {
+    if(TRANS(parameters)[i] < 0.0 || TRANS(parameters)[i] > 1.0) return false;
+  }
+
+  double total = 0.0;
+  for(unsigned int i = 0; i < K; ++i)
+  {
+    total += PI1(parameters)[i];
+  }
+  if(std::fabs(total - 1.0) > sum_tolerance) return false;
+
+  // B is column-major, so row i is B[i + j*K]:
+  for(unsigned int i = 0; i < K; ++i)
+  {
+    double row = 0.0;
+    for(unsigned int j = 0; j < K; ++j)
+    {
+      row += TRANS(parameters)[i + j*K];
+    }
+    if(std::fabs(row - 1.0) > sum_tolerance) return false;
+  }
+  return true;
+}
+
+double DHimmK::logDensity(double const *x, PDFType type,
+                          vector<double const *> const &parameters,
+                          vector<vector<unsigned int> > const &dims) const
+{
+  // The response value is the pointer index:
+  const int index = static_cast<int>(*x);
+  himm_engine* engine = himm_from_index(index);
+  if(!engine)
+  {
+    printf("INVALID POINTER INDEX %i\n", index);
+    return JAGS_NAN;
+  }
+  // The index must be that of a K-state engine with as many states:
+  if(himm_num_states(engine) != static_cast<int>(NSTATES(dims)))
+  {
+    printf("ERROR IN dhimmk: pointer index %i is not a K-state engine with K = %u\n", index, NSTATES(dims));
+    return JAGS_NAN;
+  }
+
+  double dens;
+  if(himm_evaluate_k(engine, PI1(parameters), TRANS(parameters), TESTCHAR(parameters),
+                     NSTATES(dims), &dens) != HIMM_OK)
+  {
+    printf("ERROR IN dhimmk: %s\n", himm_last_error());
+    return JAGS_NAN;
+  }
+
+  return dens;
+}
+
+void DHimmK::randomSample(double *x,
+                          vector<double const *> const &parameters,
+                          vector<vector<unsigned int> > const &dims,
+                          RNG *rng) const
+{
+  *x = JAGS_NAN;
+}
+
+void DHimmK::support(double *lower, double *upper,
+                     vector<double const *> const &parameters,
+                     vector<vector<unsigned int> > const &dims) const
+{
+  *lower = 1.0;
+  *upper = JAGS_POSINF;
+}
+
+bool DHimmK::isSupportFixed(vector<bool> const &fixmask) const
+{
+  return true;
+}
+
+vector<unsigned int> DHimmK::dim(vector<vector<unsigned int> > const &dims) const
+{
+  return vector<unsigned int>(1, 1);
+}
+
+bool DHimmK::isDiscreteValued(vector<bool> const &mask) const
+{
+  return true;
+}
+
+}}
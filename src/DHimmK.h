@@ -0,0 +1,43 @@
+#ifndef DHIMM_K_H_
+#define DHIMM_K_H_
+
+#include <distribution/ArrayDist.h>
+
+namespace jags {
+namespace himm {
+
+/**
+ * @short K-state hidden Markov model likelihood
+ * <pre>
+ * Index ~ dhimmk(pi1[1:K], B[1:K,1:K], test_char[1:K])
+ * </pre>
+ * The response is the pointer index of a ForwardTemplate object holding
+ * the data.  pi1 is the initial state distribution, B[i,j] the probability
+ * of moving from state i to state j, and test_char[k] the probability of
+ * a positive test in state k.  pi1 and each row of B must sum to 1 (within
+ * 1e-6), and the index must be that of an engine with K states.
+ */
+class DHimmK : public ArrayDist {
+public:
+    DHimmK();
+    double logDensity(double const *x, PDFType type,
+		      std::vector<double const *> const &parameters,
+		      std::vector<std::vector<unsigned int> > const &dims) const;
+    void randomSample(double *x,
+		      std::vector<double const *> const &parameters,
+		      std::vector<std::vector<unsigned int> > const &dims,
+		      RNG *rng) const;
+    void support(double *lower, double *upper,
+		 std::vector<double const *> const &parameters,
+		 std::vector<std::vector<unsigned int> > const &dims) const;
+    bool isSupportFixed(std::vector<bool> const &fixmask) const;
+    bool checkParameterDim(std::vector<std::vector<unsigned int> > const &dims) const;
+    bool checkParameterValue(std::vector<double const *> const &parameters,
+			     std::vector<std::vector<unsigned int> > const &dims) const;
+    std::vector<unsigned int> dim(std::vector<std::vector<unsigned int> > const &dims) const;
+    bool isDiscreteValued(std::vector<bool> const &mask) const;
+};
+
+}}
+
+#endif /* DHIMM_K_H_ */
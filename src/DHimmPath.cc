@@ -0,0 +1,140 @@
+#include <util/nainf.h>
+#include <rng/RNG.h>
+#include <util/dim.h>
+
+#include "DHimmPath.h"
+#include "himm_api.h"
+
+using std::vector;
+
+/*
+  Draws of the latent infection states by forward filtering, backward
+  sampling in the Himm object, using the JAGS RNG.  The filtered
+  probabilities are kept by the object until the parameters change.
+
+  This is for forward sampling only:  the draw is from the posterior given
+  the data held by the object, which is not a density of the parameters,
+  so logDensity is an error.  JAGS sizes a node from the dimensions of its
+  parameters alone, so the last parameter gives the shape of the node, and
+  is checked against himm_dims.
+*/
+
+#define INDEX(par) (*par[0])
+#define P1(par) (par[1])
+#define BETACONST(par) (par[2])
+#define BETAFREQ(par) (par[3])
+#define GAMMA(par) (par[4])
+#define SE(par) (par[5])
+#define SP(par) (par[6])
+#define SHAPE(dims) (dims[7])
+
+// Whether the shape of the node is the nP x nT of the engine
+static bool matches_engine(himm_engine* engine, vector<unsigned int> const &shape)
+{
+  int nP, nT;
+  if(himm_dims(engine, &nP, &nT) != HIMM_OK) return false;
+  return shape[0] == static_cast<unsigned int>(nP) && shape[1] == static_cast<unsigned int>(nT);
+}
+
+namespace jags {
+namespace himm {
+
+DHimmPath::DHimmPath()
+    : ArrayDist("dhimmpath", 8L)
+{}
+
+bool DHimmPath::checkParameterDim(vector<vector<unsigned int> > const &dims) const
+{
+  if(product(dims[0]) != 1L || product(dims[3]) != 1L) return false;
+  if(product(dims[5]) != 1L || product(dims[6]) != 1L) return false;
+  return SHAPE(dims).size() == 2L;
+}
+
+bool DHimmPath::checkParameterValue(vector<double const *> const &parameters,
+                                    vector<vector<unsigned int> > const &dims) const
+{
+  for(int p : { 1, 2, 3, 4, 5, 6 })
+  {
+    for(unsigned int i = 0; i < product(dims[p]); ++i)
+    {
+      if(parameters[p][i] < 0.0 || parameters[p][i] > 1.0) return false;
+    }
+  }
+
+  // The index is fixed data, so the engine can be checked here:
+  himm_engine* engine = himm_from_index(static_cast<int>(INDEX(parameters)));
+  return engine && matches_engine(engine, SHAPE(dims));
+}
+
+double DHimmPath::logDensity(double const *x, PDFType type,
+                             vector<double const *> const &parameters,
+                             vector<vector<unsigned int> > const &dims) const
+{
+  // Only randomSample is supported, for a node that is not observed and
+  // has no observed descendants:
+  printf("ERROR IN dhimmpath: the latent states can only be sampled, so must not be observed or have observed descendants\n");
+  return JAGS_NAN;
+}
+
+void DHimmPath::randomSample(double *x,
+                             vector<double const *> const &parameters,
+                             vector<vector<unsigned int> > const &dims,
+                             RNG *rng) const
+{
+  const unsigned int n = product(SHAPE(dims));
+  for(unsigned int i = 0; i < n; ++i)
+  {
+    x[i] = JAGS_NAN;
+  }
+
+  const int index = static_cast<int>(INDEX(parameters));
+  himm_engine* engine = himm_from_index(index);
+  if(!engine)
+  {
+    printf("INVALID POINTER INDEX %i\n", index);
+    return;
+  }
+  if(!matches_engine(engine, SHAPE(dims)))
+  {
+    printf("ERROR IN dhimmpath: Z must be nP x nT as for pointer index %i\n", index);
+    return;
+  }
+
+  const himm_rates rates = { P1(parameters), product(dims[1]), BETACONST(parameters), product(dims[2]),
+                             *BETAFREQ(parameters), GAMMA(parameters), product(dims[4]),
+                             *SE(parameters), *SP(parameters) };
+  auto uniform = [](void* state) { return static_cast<RNG*>(state)->uniform(); };
+  if(himm_sample_paths(engine, &rates, uniform, rng, SHAPE(dims)[0], SHAPE(dims)[1], x) != HIMM_OK)
+  {
+    printf("ERROR IN dhimmpath: %s\n", himm_last_error());
+  }
+}
+
+void DHimmPath::support(double *lower, double *upper,
+                        vector<double const *> const &parameters,
+                        vector<vector<unsigned int> > const &dims) const
+{
+  const unsigned int n = product(SHAPE(dims));
+  for(unsigned int i = 0; i < n; ++i)
+  {
+    lower[i] = 0.0;
+    upper[i] = 1.0;
+  }
+}
+
+bool DHimmPath::isSupportFixed(vector<bool> const &fixmask) const
+{
+  return true;
+}
+
+vector<unsigned int> DHimmPath::dim(vector<vector<unsigned int> > const &dims) const
+{
+  return SHAPE(dims);
+}
+
+bool DHimmPath::isDiscreteValued(vector<bool> const &mask) const
+{
+  return true;
+}
+
+}}
@@ -0,0 +1,47 @@
+#ifndef DHIMM_PATH_H_
+#define DHIMM_PATH_H_
+
+#include <distribution/ArrayDist.h>
+
+namespace jags {
+namespace himm {
+
+/**
+ * @short Posterior latent infection states for dhimm/dhimmvec
+ * <pre>
+ * Z[1:nP,1:nT] ~ dhimmpath(Index, p1, beta_const, beta_freq, gamma, se, sp, Shape[1:nP,1:nT])
+ * </pre>
+ * Takes the parameters of dhimmvec (so p1, beta_const and gamma may be
+ * per animal), and draws the infection state of each animal at each time
+ * point given the data held by the Himm object, by forward filtering and
+ * backward sampling.  This is for forward sampling only:  Z must not be
+ * observed or have observed descendants, so that it is drawn directly by
+ * randomSample, and its log density is an error.  JAGS takes the size of
+ * Z from the dimensions of the parameters, so Shape is any nP x nT array
+ * (e.g. the data) whose values are not used, and must match the nP and nT
+ * of the object.
+ */
+class DHimmPath : public ArrayDist {
+public:
+    DHimmPath();
+    double logDensity(double const *x, PDFType type,
+		      std::vector<double const *> const &parameters,
+		      std::vector<std::vector<unsigned int> > const &dims) const;
+    void randomSample(double *x,
+		      std::vector<double const *> const &parameters,
+		      std::vector<std::vector<unsigned int> > const &dims,
+		      RNG *rng) const;
+    void support(double *lower, double *upper,
+		 std::vector<double const *> const &parameters,
+		 std::vector<std::vector<unsigned int> > const &dims) const;
+    bool isSupportFixed(std::vector<bool> const &fixmask) const;
+    bool checkParameterDim(std::vector<std::vector<unsigned int> > const &dims) const;
+    bool checkParameterValue(std::vector<double const *> const &parameters,
+			     std::vector<std::vector<unsigned int> > const &dims) const;
+    std::vector<unsigned int> dim(std::vector<std::vector<unsigned int> > const &dims) const;
+    bool isDiscreteValued(std::vector<bool> const &mask) const;
+};
+
+}}
+
+#endif /* DHIMM_PATH_H_ */
@@ -1,150 +1,115 @@
-#include <util/dim.h>
 #include <util/nainf.h>
 
 #include <cmath>
 
-#include <JRmath.h>
-
 #include "DHimmVec.h"
-
+#include "himm_api.h"
 
 using std::vector;
 
-#define MU(par) (par[0])
-#define TAU(par) (par[1])
-#define PROB(par) (par[2])
-#define NCAT(lengths) (lengths[0])
+/*
+  Version of dhimm with per-animal p1, beta_const and gamma (e.g. from a
+  linear predictor on parity or lactation stage).  Animals with identical
+  rates and identical histories are evaluated once, so the cost depends on
+  the number of distinct combinations rather than the number of animals.
+  With a HerdForward object the vectors may instead have one value per
+  herd, so that a single node covers every herd.
+*/
+
+#define P1(par) (par[0])
+#define BETACONST(par) (par[1])
+#define BETAFREQ(par) (par[2])
+#define GAMMA(par) (par[3])
+#define SE(par) (par[4])
+#define SP(par) (par[5])
 
 namespace jags {
 namespace himm {
 
-    DNormMix::DNormMix()
-	: VectorDist("dnormmix", 3)
-    {}
-
-    bool 
-    DNormMix::checkParameterLength(vector<unsigned int> const &lengths) const
-    {
-      /*
-	if (lengths[0] == 1)
-	    return false; // Must be a mixture
-   
-	// Parameter lengths must match 
-	return (lengths[0] == lengths[1]) && (lengths[0] == lengths[2]);
-      */
-      
-      return true;
-    }
-
-    bool 
-    DNormMix::checkParameterValue(vector<double const *> const &par,
-				  vector<unsigned int> const &lengths) const
-    {
-      /*
-	for (unsigned int i = 0; i < NCAT(lengths); ++i) {
-	    if (TAU(par)[i] <= 0)
-		return false;
-	    if (PROB(par)[i] <= 0) 
-		return false;
-	}
-      
-      */
-	    return true;
-    }
-
-    double DNormMix::logDensity(double const *x, unsigned int length, 
-				PDFType type,
-				vector<double const *> const &par,
-				vector<unsigned int> const &lengths,
-				double const *lower, double const *upper) 
-	const
-    {
-      /*
-	double density = 0.0;
-	double psum = 0.0;
-	for (unsigned int i = 0; i < NCAT(lengths); ++i) {
-    / *
-	    density += PROB(par)[i] * dnorm(*x, MU(par)[i], 
-					    1/sqrt(TAU(par)[i]), 0);
-	    psum += PROB(par)[i];
-    * /
-	}
-	return log(density) - log(psum);
-      */
-      return 0.0;
-    }
-
-    void 
-    DNormMix::randomSample(double *x, unsigned int length,
-			   vector<double const *> const &par, 
-			   vector<unsigned int> const &lengths, 
-			   double const *lower, double const *upper, RNG *rng) 
-	const
-    {
-      /*
-	unsigned long Ncat = NCAT(lengths);
-
-	// Rescale probability parameter
-	double sump = 0;
-	for (unsigned int i = 0; i < Ncat; ++i) {
-	  sump += PROB(par)[i];
-	}
-	double p_rand = runif(0, 1, rng) * sump;
-	sump = 0;
-
-	// Select mixture component (r)
-	unsigned int r = Ncat - 1;
-	for (unsigned int i = 0; i < Ncat - 1; ++i) {
-	    sump += PROB(par)[i];
-	    if (sump > p_rand) {
-		r = i;
-		break;
-	    }
-	}
-
-	// Now sample from conditional distribution of component r
-	double ans = 0.0; //rnorm(MU(par)[r], 1/sqrt(TAU(par)[r]), rng);
-	*x = ans;
-      */
-    }
-
-    void DNormMix::typicalValue(double *x, unsigned int length,
-				vector<double const *> const &par,
-				vector<unsigned int> const &lengths,
-				double const *lower, double const *upper) const
-    {
-      /*
-	double const *mu = MU(par);
-	unsigned int Ncat = lengths[0];
-
-	unsigned int j = 0;
-	for (unsigned int i = 1; i < Ncat; ++i) {
-	    if (PROB(par)[i] > PROB(par)[j]) {
-		j = i;
-	    }
-	} 
-    
-	*x = mu[j];
-      */
-    }
-
-    bool DNormMix::isSupportFixed(vector<bool> const &fixmask) const
-    {
-	return true;
-    }
-
-    void 
-    DNormMix::support(double *lower, double *upper, unsigned int length,
-		      vector<double const *> const &parameters,
-		      vector<unsigned int> const &lengths) const
-    {
-	*lower = JAGS_NEGINF;
-	*upper = JAGS_POSINF;
-    }
-
-    unsigned int DNormMix::length(vector<unsigned int> const &parlengths) const
+DHimmVec::DHimmVec()
+    : VectorDist("dhimmvec", 6L)
+{}
+
+bool DHimmVec::checkParameterLength(vector<unsigned int> const &lengths) const
+{
+  // The per-animal parameters are checked against nP by the Himm object:
+  return lengths[0] >= 1L && lengths[1] >= 1L && lengths[3] >= 1L &&
+    lengths[2] == 1L && lengths[4] == 1L && lengths[5] == 1L;
+}
+
+bool DHimmVec::checkParameterValue(vector<double const *> const &parameters,
+                                   vector<unsigned int> const &lengths) const
+{
+  for(int p : { 0, 1, 3 })
+  {
+    for(unsigned int i = 0; i < lengths[p]; ++i)
     {
-	return 1;
+      if(parameters[p][i] < 0.0 || parameters[p][i] > 1.0) return false;
     }
+  }
+  for(int p : { 2, 4, 5 })
+  {
+    if(*parameters[p] < 0.0 || *parameters[p] > 1.0) return false;
+  }
+  return true;
+}
+
+double DHimmVec::logDensity(double const *x, PDFType type,
+                            vector<double const *> const &parameters,
+                            vector<unsigned int> const &lengths) const
+{
+  // The response value is the pointer index:
+  const int index = static_cast<int>(*x);
+  himm_engine* engine = himm_from_index(index);
+  if(!engine)
+  {
+    printf("INVALID POINTER INDEX %i\n", index);
+    return JAGS_NAN;
+  }
+
+  // The per-animal values are read in place from the JAGS arrays:
+  const himm_rates rates = { P1(parameters), lengths[0], BETACONST(parameters), lengths[1],
+                             *BETAFREQ(parameters), GAMMA(parameters), lengths[3],
+                             *SE(parameters), *SP(parameters) };
+  double dens;
+  if(himm_evaluate_rates(engine, &rates, &dens) != HIMM_OK)
+  {
+    printf("ERROR IN dhimmvec: %s\n", himm_last_error());
+    return JAGS_NAN;
+  }
+
+  return dens;
+}
+
+void DHimmVec::randomSample(double *x,
+                            vector<double const *> const &parameters,
+                            vector<unsigned int> const &lengths,
+                            RNG *rng) const
+{
+  *x = JAGS_NAN;
+}
+
+void DHimmVec::support(double *lower, double *upper,
+                       vector<double const *> const &parameters,
+                       vector<unsigned int> const &lengths) const
+{
+  *lower = 1.0;
+  *upper = JAGS_POSINF;
+}
+
+bool DHimmVec::isSupportFixed(vector<bool> const &fixmask) const
+{
+  return true;
+}
+
+unsigned int DHimmVec::length(vector<unsigned int> const &lengths) const
+{
+  return 1;
+}
+
+bool DHimmVec::isDiscreteValued(vector<bool> const &mask) const
+{
+  return true;
+}
 
 }}
@@ -7,50 +7,35 @@ namespace jags {
 namespace himm {
 
 /**
- * @short Mixture of normal distribution
+ * @short dhimm with per-animal rates
  * <pre>
- * x ~ dnorm(mu, tau, pi)
+ * Index ~ dhimmvec(p1[1:nP], beta_const[1:nP], beta_freq, gamma[1:nP], se, sp)
  * </pre>
- * The parameters mu, tau, pi are conforming vectors or arrays. Each
- * element corresponds to a component of the mixture. If all parameters
- * are vectors then component i is normal with mean mu[i], tau[i] and 
- * probability of selection pi[i]/sum(pi).
- *
- * Note that the parameter pi is redundant: the likelihood depends
- * only on pi/sum(pi).
+ * As dhimm, except that p1, beta_const and gamma may each be either a
+ * vector with one value per animal (in the row order of the data) or a
+ * single value shared by all animals.  beta_freq, se and sp are scalars.
  */
-    class DNormMix : public VectorDist {
-    public:
-	DNormMix();
-	
-	double logDensity(double const *x, unsigned int length, PDFType type,
-			  std::vector<double const *> const &parameters,
-			  std::vector<unsigned int> const &lengths,
-			  double const *lower, double const *upper) const;
-	void randomSample(double *x, unsigned int length,
-			  std::vector<double const *> const &parameters,
-			  std::vector<unsigned int> const &lengths,
-			  double const *lower, double const *upper, RNG *rng) 
-	    const;
-	void typicalValue(double *x, unsigned int length,
-			  std::vector<double const *> const &parameters,
-			  std::vector<unsigned int> const &lengths,
-			  double const *lower, double const *upper) const;
-	void support(double *lower, double *upper, unsigned int length,
-		     std::vector<double const *> const &parameters,
-		     std::vector<unsigned int> const &lengths) const;
-	bool isSupportFixed(std::vector<bool> const &fixmask) const;
-	bool checkParameterLength(std::vector<unsigned int> const &lengths)
-	    const;
-	bool checkParameterValue(std::vector<double const *> const &parameters,
-				 std::vector<unsigned int> const &lengths) 
-	    const;
-	void typicalValue(double *x, std::vector<double const *> const &par,
-			  std::vector<unsigned int> const &lengths)  const;
-	unsigned int length(std::vector<unsigned int> const &parlengths) const;
-    };
+class DHimmVec : public VectorDist {
+public:
+    DHimmVec();
+    double logDensity(double const *x, PDFType type,
+		      std::vector<double const *> const &parameters,
+		      std::vector<unsigned int> const &lengths) const;
+    void randomSample(double *x,
+		      std::vector<double const *> const &parameters,
+		      std::vector<unsigned int> const &lengths,
+		      RNG *rng) const;
+    void support(double *lower, double *upper,
+		 std::vector<double const *> const &parameters,
+		 std::vector<unsigned int> const &lengths) const;
+    bool isSupportFixed(std::vector<bool> const &fixmask) const;
+    bool checkParameterLength(std::vector<unsigned int> const &lengths) const;
+    bool checkParameterValue(std::vector<double const *> const &parameters,
+			     std::vector<unsigned int> const &lengths) const;
+    unsigned int length(std::vector<unsigned int> const &lengths) const;
+    bool isDiscreteValued(std::vector<bool> const &mask) const;
+};
 
 }}
 
-
 #endif /* DHIMM_VEC_H_ */
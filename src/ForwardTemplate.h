@@ -1,238 +1,445 @@
-#include <Rcpp.h>
 #include <array>
+#include <cstdio>
+#include <stdexcept>
+#include <type_traits>
+#include <utility>
 
 #include "Himm.h"
+#include "forward_kernels.h"
+#include "pattern_storage.h"
+
+/*
+  General K-state forward engine:
+    - K latent states with initial distribution pi1
+    - K x K transition matrix B, with B[i,j] = p(z_t = j | z_{t-1} = i),
+      stored column-major as in R and JAGS
+    - per-state probability of a positive test
+  With T_K > 0 the number of states is fixed at compile time and the loops
+  over states are fully unrolled; T_K == 0 takes K at runtime instead.
+
+  Via the Himm interface, setRates takes pi1 as prv1 and B as beta_const
+  (beta_freq must be zero and gamm is not used), and setTestPars takes
+  the K positive test probabilities.  setRateArrays and setTestParArray
+  read these in place, and nothing is recalculated by update unless they
+  have changed.
+*/
+
+template<class F, int... I>
+inline void unroll_states(F& f, std::integer_sequence<int, I...>)
+{
+  (f(I), ...);
+}
+
+template<int T_K, class F>
+inline void for_each_state(const int K, F f)
+{
+  if constexpr (T_K > 0)
+  {
+    unroll_states(f, std::make_integer_sequence<int, T_K>{});
+  }
+  else
+  {
+    for(int k=0L; k<K; ++k)
+    {
+      f(k);
+    }
+  }
+}
 
-template<int T_nD, int T_nP, int T_nT, int T_2pT>
+template<int T_K>
 class ForwardTemplate : public Himm
 {
   private:
-    std::array<double, T_2pT> m_comb_probs;
-    std::vector<double> m_ind_probs;
-    std::vector<std::array<int, T_nT>> m_data;
-    std::array<std::array<int, T_nT>, T_2pT> m_zs;
-
-    double m_p1 = 0.1;
-    double m_beta_const = 0.1;
-    double m_beta_freq = 0.1;
-    double m_gamma = 0.1;
-
-    double m_se = 0.99;
-    double m_sp = 0.99;
-
-    const int m_nP;
+    typedef typename std::conditional<(T_K > 0L), std::array<double, (T_K > 0L ? T_K : 1L)>,
+                                      std::vector<double>>::type StateVector;
+
+    // Unique observation histories (time-major) with their missing tests,
+    // their multiplicity, and the pattern used by each animal:
+    std::vector<bool> m_data;
+    std::vector<bool> m_missing;
+    std::vector<double> m_counts;
+    std::vector<int> m_pattern_index;
+    size_t m_nPat = 1L;
+    // Log-likelihood of each unique history from the last calculation:
+    std::vector<double> m_pattern_ll;
+    // As for SimpleForward, full storage unless checkpoints are asked for:
+    bool m_smooth_checkpoints = false;
+
+    // Parameters on the scale used by the kernel:
+    std::vector<double> m_logpi;
+    std::vector<double> m_trans;
+    std::vector<double> m_logpos;
+    std::vector<double> m_logneg;
+    // Log emission of a missing test (zero for every state):
+    std::vector<double> m_lognone;
+
+    const int m_K;
+    const size_t m_nP;
+    const size_t m_nT;
     double m_logdens = 0.0;
 
-  public:
-    ForwardTemplate(const int nP, const int nT) :
-      m_nP(nP)
+    StateVector makeStates() const
+    {
+      StateVector rv{};
+      if constexpr (T_K == 0L)
+      {
+        rv.resize(m_K);
+      }
+      return rv;
+    }
+
+    // Forward pass over patterns [from, to), writing each log-likelihood to
+    // ll:  the transition step is done in linear space relative to the
+    // current maximum, so each time point costs K exp and K log evaluations
+    double forwardBlock(const size_t from, const size_t to, double* ll) const
     {
-      // TODO: allow arbitrary nT with vector rather than array at some point
-      if(nT != T_nT) Rcpp::stop("Non-matching nT and T_nT");
-      if(std::pow(2L, nT) != T_2pT) Rcpp::stop("Non-matching 2^nT and T_nT");
+      StateVector logalpha = makeStates();
+      StateVector alpha = makeStates();
 
-      for(int i=0; i<T_2pT; ++i)
+      double total = 0.0;
+      for(size_t p=from; p<to; ++p)
       {
-        m_zs[i] = binarise(i);
+        const double* em0 = logEmission(0L, p);
+        for_each_state<T_K>(m_K, [&](const int j)
+        {
+          logalpha[j] = m_logpi[j] + em0[j];
+        });
+
+        for(size_t t=1L; t<m_nT; ++t)
+        {
+          double mx = logalpha[0L];
+          for_each_state<T_K>(m_K, [&](const int i)
+          {
+            mx = std::max(mx, logalpha[i]);
+          });
+          for_each_state<T_K>(m_K, [&](const int i)
+          {
+            alpha[i] = std::exp(logalpha[i] - mx);
+          });
+
+          const double* em = logEmission(t, p);
+          for_each_state<T_K>(m_K, [&](const int j)
+          {
+            double acc = 0.0;
+            for_each_state<T_K>(m_K, [&](const int i)
+            {
+              acc += alpha[i] * m_trans[i + j*m_K];
+            });
+            logalpha[j] = mx + std::log(acc) + em[j];
+          });
+        }
+
+        double mx = logalpha[0L];
+        for_each_state<T_K>(m_K, [&](const int i)
+        {
+          mx = std::max(mx, logalpha[i]);
+        });
+        double acc = 0.0;
+        for_each_state<T_K>(m_K, [&](const int i)
+        {
+          acc += std::exp(logalpha[i] - mx);
+        });
+
+        ll[p] = mx + std::log(acc);
+        total += m_counts[p] * ll[p];
       }
 
-      m_data.resize(nP);
+      return total;
+    }
+
+    // Sets a parameter, with the last calculation no longer current if it
+    // has changed
+    void change(double& par, const double value)
+    {
+      if(par == value) return;
+      par = value;
+      m_current = false;
+    }
+
+    // Log p(y | state) for the test of pattern p at time point t
+    const double* logEmission(const size_t t, const size_t p) const
+    {
+      const size_t k = t*m_nPat + p;
+      if(m_missing[k]) return m_lognone.data();
+      return m_data[k] ? m_logpos.data() : m_logneg.data();
     }
 
-    std::array<int, T_nT> binarise(int num)
+  public:
+    ForwardTemplate(const int nP, const int nT, const int K) :
+      m_K(T_K > 0L ? T_K : K), m_nP(nP), m_nT(nT)
     {
-      std::array<int, T_nT> rv;
-      for(size_t i=0; i<rv.size(); ++i)
+      if(T_K > 0L && K != T_K) throw std::runtime_error("Non-matching K and T_K");
+      if(K < 1L) throw std::runtime_error("K must be at least 1");
+      if(nT < 1L) throw std::runtime_error("nT must be at least 1");
+
+      // Until data is added every animal has the all-negative history:
+      m_data.resize(m_nPat*m_nT);
+      m_missing.resize(m_nPat*m_nT);
+      m_lognone.assign(m_K, 0.0);
+      m_counts.resize(m_nPat, static_cast<double>(m_nP));
+      m_pattern_index.resize(m_nP, 0L);
+      m_pattern_ll.resize(m_nPat, NAN);
+
+      // Default to every state being equally likely, with no transitions
+      // and a perfect test for all but the first state:
+      const std::vector<double> pi1(m_K, 1.0/m_K);
+      std::vector<double> trans(m_K*m_K, 0.0);
+      std::vector<double> pos(m_K, 1.0);
+      for(int k=0L; k<m_K; ++k)
       {
-        rv[i] = 0L;
+        trans[k + k*m_K] = 1.0;
       }
+      pos[0L] = 0.0;
+      setRates(pi1, trans, { 0.0 }, { 0.0 });
+      setTestPars(pos);
+    }
 
-      int pos = T_nT-1L;
-      while(num != 0L)
+    // Test results as an nP x nT column-major buffer, as for an R matrix,
+    // with himm_na_result for a missing test
+    void addDataBuffer(const int* data)
+    {
+      // Each test as 0, 1, or 2 if missing (NA), which has no emission:
+      std::vector<std::vector<char>> rows(m_nP);
+      for(size_t i=0L; i<m_nP; ++i)
       {
-        rv[pos] = num % 2L;
-        num /= 2L;
-        pos--;
+        rows[i].resize(m_nT);
+        for(size_t t=0L; t<m_nT; ++t)
+        {
+          const int y = data[i + t*m_nP];
+          if(y != 0L && y != 1L && y != himm_na_result) throw std::runtime_error("Test results must be 0, 1 or NA");
+          rows[i][t] = y == himm_na_result ? 2L : y;
+        }
       }
 
-      return rv;
-    }
+      std::vector<std::vector<char>> patterns;
+      compress_patterns(rows, patterns, m_counts, m_pattern_index);
+      m_nPat = patterns.size();
 
-    Rcpp::IntegerMatrix getZs() const
-    {
-      Rcpp::IntegerMatrix rv(T_2pT, T_nT);
-      for(size_t i=0L; i<T_2pT; ++i)
+      m_data.assign(m_nPat*m_nT, false);
+      m_missing.assign(m_nPat*m_nT, false);
+      for(size_t p=0L; p<m_nPat; ++p)
       {
-        for(size_t j=0L; j<T_nT; ++j)
+        for(size_t t=0L; t<m_nT; ++t)
         {
-          rv(i,j) = m_zs[i][j];
+          m_data[m_nPat*t + p] = patterns[p][t] == 1L;
+          m_missing[m_nPat*t + p] = patterns[p][t] == 2L;
         }
       }
-      return rv;
+      m_pattern_ll.assign(m_nPat, NAN);
+      clearCache();
     }
 
-    double dbern(const int y, const double prob)
+    void setRates(const std::vector<double>& prv1, const std::vector<double>& beta_const,
+                  const std::vector<double>& beta_freq, const std::vector<double>& gamm)
     {
-      return y==0L ? log(1.0-prob) : log(prob);
+      for(size_t i=0L; i<beta_freq.size(); ++i)
+      {
+        if(beta_freq[i] != 0.0) throw std::runtime_error("Invalid non-zero beta_freq");
+      }
+      setRateArrays(prv1.data(), prv1.size(), beta_const.data(), beta_const.size(), 0.0, gamm.data(), gamm.size());
     }
 
-    double obsFun(const int zi, const int yi)
+    void setRateArrays(const double* prv1, const size_t n_prv1, const double* beta_const,
+                       const size_t n_beta_const, const double beta_freq,
+                       const double* /* gamm */, const size_t /* n_gamm */)
     {
-      const std::array<int, T_nT>& ys = m_data[yi];
-      const std::array<int, T_nT>& zs = m_zs[zi];
+      if(n_prv1 != static_cast<size_t>(m_K)) throw std::runtime_error("Initial probabilities must have length K");
+      if(n_beta_const != static_cast<size_t>(m_K*m_K)) throw std::runtime_error("Transition matrix must have K x K elements");
+      if(beta_freq != 0.0) throw std::runtime_error("Invalid non-zero beta_freq");
 
-      double ll = 0.0;
-      for(int i=0; i<T_nT; ++i)
+      m_logpi.resize(m_K);
+      m_trans.resize(m_K*m_K);
+      for(int k=0L; k<m_K; ++k)
       {
-        ll += dbern(ys[i], zs[i]*m_se + (1L-zs[i])*(1.0-m_sp));
+        change(m_logpi[k], std::log(prv1[k]));
+      }
+      for(int k=0L; k<m_K*m_K; ++k)
+      {
+        change(m_trans[k], beta_const[k]);
       }
-
-      return exp(ll);
     }
 
-    double calculateZi(int zi)
+    void setTestPars(const std::vector<double>& test_pars)
     {
-      if(zi < 0L || zi >= T_2pT) Rcpp::stop("zi out of range");
-      const std::array<int, T_nT>& zs = m_zs[zi];
-      // std::array<double, T_nT> pa;
+      setTestParArray(test_pars.data(), test_pars.size());
+    }
 
-      // pa[0L] = m_p1;
-      double za = (zs[0L]==0L) ? (1.0-m_p1) : m_p1;
-      double tp = za;
+    void setTestParArray(const double* test_pars, const size_t n)
+    {
+      if(n != static_cast<size_t>(m_K)) throw std::runtime_error("Test positivity must have length K");
 
-      for(int t=1L; t<T_nT; ++t)
+      m_logpos.resize(m_K);
+      m_logneg.resize(m_K);
+      for(int k=0L; k<m_K; ++k)
       {
-        // zp = zs[t-1L] * (1.0 - (std::pow(1.0-m_beta_freq, pa[t-1L])) + (1L-zs[t-1L])*(1.0-m_gamma);
-        const double zp = (zs[t-1L]==0L) ? m_beta_const : (1.0-m_gamma);
-        // pa[t] = zp;
-
-        za = (zs[t]==0L) ? (1.0-zp) : zp;
-        tp *= za;
+        change(m_logpos[k], std::log(test_pars[k]));
+        change(m_logneg[k], std::log1p(-test_pars[k]));
       }
-
-      return tp;
     }
 
-    void show()
+    void calculate()
     {
-      //Rcpp::Rcout << "hello from Himm nr " << pointer_index << std::endl;
-      printf("hello from Himm\n");
-
+      // Each unique history is evaluated once and weighted by its count:
+      m_logdens = parallel_block_sum(m_nPat, m_nT*m_K*m_K, activeThreads(), [&](const size_t from, const size_t to)
+      {
+        return forwardBlock(from, to, m_pattern_ll.data());
+      });
+      m_current = true;
     }
 
-    int getIndex()
+    bool getSmoothCheckpoints() const
     {
-      return pointer_index;
+      return m_smooth_checkpoints;
     }
 
-    double logDensity()
+    void setSmoothCheckpoints(const bool smooth_checkpoints)
     {
-      return m_logdens;
+      m_smooth_checkpoints = smooth_checkpoints;
     }
 
-    double test(const double p1)
+    // Posterior probability of each state for each animal at each time
+    // point given all of its data, as an nP x nT x K array, by
+    // forward-backward smoothing of each unique pattern (see smooth_sequence)
+    size_t smoothValues() const
     {
-      m_se = 0.9;
-      m_sp = 0.99;
-      m_beta_const = 0.05;
-      m_gamma = 0.08;
-      m_p1 = p1;
+      return m_K;
+    }
 
-      calculate();
+    void smooth(double* rv)
+    {
+      std::vector<double> init(m_K);
+      std::vector<double> pos(m_K);
+      std::vector<double> neg(m_K);
+      for(int k=0L; k<m_K; ++k)
+      {
+        init[k] = std::exp(m_logpi[k]);
+        pos[k] = std::exp(m_logpos[k]);
+        neg[k] = std::exp(m_logneg[k]);
+      }
 
-      return logDensity();
+      const size_t interval = m_smooth_checkpoints ? smooth_checkpoint_interval(m_nT) : 1L;
+      std::vector<double> marginal(m_nPat*m_nT*m_K);
+      parallel_blocks(m_nPat, 3L*m_nT*m_K*m_K, activeThreads(), [&](const size_t /* block */, const size_t from, const size_t to)
+      {
+        std::vector<double> work;
+        StateVector tmp = makeStates();
+        for(size_t p=from; p<to; ++p)
+        {
+          auto emit = [&](const size_t t, double* x)
+          {
+            if(m_missing[t*m_nPat + p]) return;
+            const double* em = m_data[t*m_nPat + p] ? pos.data() : neg.data();
+            for_each_state<T_K>(m_K, [&](const int k)
+            {
+              x[k] *= em[k];
+            });
+          };
+          auto first = [&](double* alpha)
+          {
+            for_each_state<T_K>(m_K, [&](const int k)
+            {
+              alpha[k] = init[k];
+            });
+            emit(0L, alpha);
+          };
+          auto step = [&](const size_t t, double* alpha)
+          {
+            for_each_state<T_K>(m_K, [&](const int j)
+            {
+              double acc = 0.0;
+              for_each_state<T_K>(m_K, [&](const int i)
+              {
+                acc += alpha[i] * m_trans[i + j*m_K];
+              });
+              tmp[j] = acc;
+            });
+            for_each_state<T_K>(m_K, [&](const int k)
+            {
+              alpha[k] = tmp[k];
+            });
+            emit(t, alpha);
+          };
+          auto back = [&](const size_t t, double* beta)
+          {
+            emit(t, beta);
+            for_each_state<T_K>(m_K, [&](const int i)
+            {
+              double acc = 0.0;
+              for_each_state<T_K>(m_K, [&](const int j)
+              {
+                acc += m_trans[i + j*m_K] * beta[j];
+              });
+              tmp[i] = acc;
+            });
+            for_each_state<T_K>(m_K, [&](const int k)
+            {
+              beta[k] = tmp[k];
+            });
+          };
+          smooth_sequence(m_nT, m_K, interval, work, marginal.data() + p*m_nT*m_K, first, step, back);
+        }
+      });
 
+      for(size_t i=0L; i<m_nP; ++i)
+      {
+        const double* pm = marginal.data() + m_pattern_index[i]*m_nT*m_K;
+        for(size_t t=0L; t<m_nT; ++t)
+        {
+          for(int k=0L; k<m_K; ++k)
+          {
+            rv[i + t*m_nP + k*m_nP*m_nT] = pm[t*m_K + k];
+          }
+        }
+      }
     }
 
-    void setRates(const std::vector<double> prv1, const std::vector<double> beta_const,
-                  const std::vector<double> beta_freq, const std::vector<double> gamm)
+    // The six dhimm parameters do not apply to the K-state model:
+    double calculateWithGradient(std::array<double, 6L>& /* gradient */)
     {
-      // Ignore beta_freq for now
-      m_p1 = prv1[0L];
-      m_beta_const = beta_const[0L];
-      m_beta_freq = beta_freq[0L];
-      m_gamma = gamm[0L];
+      gradient_unsupported("the K-state model");
     }
 
-    void setTestPars(const std::vector<double> test_pars)
+    void show()
     {
-      m_se = test_pars[0L];
-      m_sp = test_pars[1L];
+      printf("hello from ForwardTemplate with K=%i\n", m_K);
     }
 
-    double obsprev(int tp)
+    int getK() const
     {
-      double tot=0.0;
-      for(int i=0L; i<m_nP; ++i)
-      {
-        tot += m_data[i][tp-1L];
-      }
-
-      return tot/m_nP;
+      return m_K;
     }
 
-    Rcpp::NumericVector getZis()
+    int getNumStates() const
     {
-      std::array<double, T_2pT> zis;
-      for(int z=0L; z<T_2pT; ++z)
-      {
-        zis[z] = calculateZi(z);
-      }
-
-      Rcpp::NumericVector rv = Rcpp::wrap(zis);
-
-      return rv;
+      return m_K;
     }
 
-    Rcpp::NumericMatrix getObsProbs()
+    int getNumPatterns() const
     {
-      Rcpp::NumericMatrix rv(T_2pT, m_nP);
-
-      for(int i=0L; i<m_nP; ++i)
-      {
-        for(int z=0L; z<T_2pT; ++z)
-        {
-          rv(z,i) = obsFun(z,i);
-        }
-      }
+      return m_nPat;
+    }
 
-      return rv;
+    size_t getNumAnimals() const
+    {
+      return m_nP;
     }
 
-    void calculate()
+    size_t getNumTimepoints() const
     {
-      std::array<double, T_2pT> zis;
-      for(int z=0L; z<T_2pT; ++z)
-      {
-        zis[z] = calculateZi(z);
-      }
+      return m_nT;
+    }
 
-      double total=0.0;
-      for(int i=0L; i<m_nP; ++i)
+    void animalLogLik(double* out) const
+    {
+      for(size_t i=0L; i<m_nP; ++i)
       {
-        double itotal = 0.0;
-        for(int z=0L; z<T_2pT; ++z)
-        {
-          itotal += (zis[z] * obsFun(z, i));
-        }
-        total += log(itotal);
+        out[i] = m_pattern_ll[m_pattern_index[i]];
       }
-
-      m_logdens = total;
     }
 
-    void addData(Rcpp::IntegerMatrix data)
+    double logDensity()
     {
-      if(data.ncol()!=T_nT) Rcpp::stop("Wrong col dim");
-      if(data.nrow()!=m_nP) Rcpp::stop("Wrong row dim");
-
-      for(int i=0L; i<m_nP; ++i)
-      {
-        for(int t=0L; t<T_nT; ++t)
-        {
-          m_data[i][t] = data(i,t);
-        }
-      }
+      return m_logdens;
     }
 
     ~ForwardTemplate()
@@ -0,0 +1,435 @@
+#include <algorithm>
+#include <array>
+#include <memory>
+#include <numeric>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "Himm.h"
+#include "SimpleForward.h"
+#include "thread_pool.h"
+
+/*
+  Many herds in a single object, each herd with its own SimpleForward (and
+  so its own mean-field prevalence for frequency-dependent transmission).
+  Animals are stored herd by herd:  herd h holds animals [offset[h],
+  offset[h+1]) of the nP x nT data, so that per-animal values are passed
+  on to each herd in place.
+
+  setRates takes p1, beta_const, beta_freq and gamm each with one value
+  (shared by all herds), one value per herd, or (except beta_freq) one
+  value per animal, and beta_const and gamm may also be seasonal (at most
+  nT values, passed on to every herd as they are).  Lengths that could be
+  read either way are rejected:  one value per herd for beta_const or gamm
+  when there are at most nT herds, and a seasonal length equal to the size
+  of a herd.  Only the herds whose parameters or data have changed are
+  recalculated, with the herds shared between threads largest first and
+  the log density summed over herds in a fixed order.  Everything that
+  could fail is checked on the calling thread before any herd changes.
+*/
+class HerdForward : public Himm
+{
+  private:
+    std::vector<std::unique_ptr<SimpleForward>> m_herds;
+    std::vector<size_t> m_offset;
+    // Herds by decreasing number of patterns, for scheduling:
+    std::vector<size_t> m_order;
+    std::vector<size_t> m_work;
+    std::vector<double> m_herd_ll;
+    // Whether every herd has the same (scalar) parameters, in which case
+    // the gradient is the sum over herds:
+    bool m_shared_rates = true;
+
+    const size_t m_nP;
+    // Grows with appendTimepoint:
+    size_t m_nT;
+    double m_logdens = 0.0;
+
+    size_t herdSize(const size_t h) const
+    {
+      return m_offset[h+1L] - m_offset[h];
+    }
+
+    // The values of a rate for herd h, from one per herd or one per animal
+    // (and otherwise all of them):
+    std::pair<const double*, size_t> herdValues(const double* values, const size_t n, const size_t h) const
+    {
+      if(n == m_herds.size()) return std::make_pair(values + h, size_t(1L));
+      if(n == m_nP) return std::make_pair(values + m_offset[h], herdSize(h));
+      return std::make_pair(values, n);
+    }
+
+    // Throws unless a rate of length n is one value, one per herd, one per
+    // animal or (if seasonal is allowed) an unambiguous seasonal sequence
+    void checkRateLength(const size_t n, const bool seasonal, const std::string& name) const
+    {
+      if(n == 1L || n == m_nP) return;
+      if(n == m_herds.size())
+      {
+        if(seasonal && n <= m_nT)
+        {
+          throw std::runtime_error(name + " has one value per herd, which is ambiguous with seasonal rates when there are at most nT herds (give one value per animal)");
+        }
+        return;
+      }
+      if(!seasonal || n == 0L || n > m_nT)
+      {
+        throw std::runtime_error(name + (seasonal ? " must have length 1, the number of herds, nP, or at most nT" :
+                                                    " must have length 1, the number of herds or nP"));
+      }
+      for(size_t h=0L; h<m_herds.size(); ++h)
+      {
+        if(herdSize(h) == n) throw std::runtime_error(name + " is seasonal with the length of a herd, which would be read as one value per animal of that herd");
+      }
+    }
+
+    // Throws unless every herd can be calculated with its data and test
+    // parameters
+    void checkHerds() const
+    {
+      for(const auto& herd : m_herds)
+      {
+        herd->checkNumTests();
+      }
+    }
+
+    void setHerdRates(const double* prv1, const size_t n_prv1, const double* beta_const,
+                      const size_t n_beta_const, const double* beta_freq, const size_t n_beta_freq,
+                      const double* gamm, const size_t n_gamm)
+    {
+      if(n_beta_freq != 1L && n_beta_freq != m_herds.size()) throw std::runtime_error("beta_freq must have length 1 or the number of herds");
+      for(size_t h=0L; h<n_beta_freq; ++h)
+      {
+        if(beta_freq[h] < 0.0 || beta_freq[h] > 1.0) throw std::runtime_error("Invalid beta_freq");
+      }
+      checkRateLength(n_prv1, false, "prv1");
+      checkRateLength(n_beta_const, true, "beta_const");
+      checkRateLength(n_gamm, true, "gamm");
+
+      for(size_t h=0L; h<m_herds.size(); ++h)
+      {
+        const auto p1 = herdValues(prv1, n_prv1, h);
+        const auto bc = herdValues(beta_const, n_beta_const, h);
+        const auto bg = herdValues(gamm, n_gamm, h);
+        m_herds[h]->setRateArrays(p1.first, p1.second, bc.first, bc.second,
+                                  beta_freq[n_beta_freq == 1L ? 0L : h], bg.first, bg.second);
+      }
+      m_shared_rates = n_prv1 == 1L && n_beta_const == 1L && n_beta_freq == 1L && n_gamm == 1L;
+      m_current = false;
+    }
+
+    // Orders the herds by decreasing work, which only changes with the
+    // patterns (i.e. new data or rate groups)
+    void scheduleHerds()
+    {
+      bool changed = false;
+      for(size_t h=0L; h<m_herds.size(); ++h)
+      {
+        const size_t work = m_herds[h]->getNumPatterns();
+        changed = changed || work != m_work[h];
+        m_work[h] = work;
+      }
+      if(!changed) return;
+
+      std::stable_sort(m_order.begin(), m_order.end(), [&](const size_t a, const size_t b)
+      {
+        return m_work[a] > m_work[b];
+      });
+    }
+
+    int herdThreads() const
+    {
+      size_t work = 0L;
+      for(const size_t w : m_work)
+      {
+        work += w * m_nT;
+      }
+      return work >= parallel_threshold ? activeThreads() : 1L;
+    }
+
+  public:
+    HerdForward(const std::vector<int>& herd_sizes, const int nT) :
+      m_nP(std::accumulate(herd_sizes.begin(), herd_sizes.end(), size_t(0L))), m_nT(nT)
+    {
+      if(herd_sizes.empty()) throw std::runtime_error("There must be at least one herd");
+
+      m_offset.assign(1L, 0L);
+      for(const int size : herd_sizes)
+      {
+        if(size < 1L) throw std::runtime_error("Every herd must have at least one animal");
+        m_offset.push_back(m_offset.back() + size);
+        // Herds run in parallel with each other, so each is serial:
+        m_herds.emplace_back(new SimpleForward(size, nT));
+        m_herds.back()->setThreads(1L);
+      }
+
+      m_order.resize(m_herds.size());
+      for(size_t h=0L; h<m_order.size(); ++h)
+      {
+        m_order[h] = h;
+      }
+      m_work.assign(m_herds.size(), 0L);
+      m_herd_ll.assign(m_herds.size(), NAN);
+    }
+
+    // Test results as an nP x nT column-major buffer, with the animals of
+    // each herd in consecutive rows
+    void addDataBuffer(const int* data)
+    {
+      std::vector<int> buffer;
+      for(size_t h=0L; h<m_herds.size(); ++h)
+      {
+        const size_t nH = herdSize(h);
+        buffer.resize(nH * m_nT);
+        for(size_t t=0L; t<m_nT; ++t)
+        {
+          std::copy(data + t*m_nP + m_offset[h], data + t*m_nP + m_offset[h+1L], buffer.begin() + t*nH);
+        }
+        m_herds[h]->addDataBuffer(buffer.data());
+      }
+      clearCache();
+    }
+
+    // Test records in long format, with animals numbered (from 1) over all
+    // herds as for addDataBuffer
+    void addRecordBuffer(const int* animal, const int* time, const int* result, const size_t nR)
+    {
+      std::vector<size_t> herd(nR);
+      std::vector<int> count(m_herds.size(), 0L);
+      for(size_t k=0L; k<nR; ++k)
+      {
+        if(animal[k] < 1L || animal[k] > static_cast<int>(m_nP)) throw std::runtime_error("animal out of range");
+        herd[k] = std::upper_bound(m_offset.begin(), m_offset.end(), static_cast<size_t>(animal[k] - 1L)) - m_offset.begin() - 1L;
+        count[herd[k]]++;
+      }
+
+      std::vector<int> herd_animal, herd_time, herd_result;
+      for(size_t h=0L; h<m_herds.size(); ++h)
+      {
+        herd_animal.resize(count[h]);
+        herd_time.resize(count[h]);
+        herd_result.resize(count[h]);
+        size_t j = 0L;
+        for(size_t k=0L; k<nR; ++k)
+        {
+          if(herd[k] != h) continue;
+          herd_animal[j] = animal[k] - m_offset[h];
+          herd_time[j] = time[k];
+          herd_result[j] = result[k];
+          ++j;
+        }
+        m_herds[h]->addRecordBuffer(herd_animal.data(), herd_time.data(), herd_result.data(), count[h]);
+      }
+      clearCache();
+    }
+
+    // Adds a time point with the result of each animal (NA if not tested),
+    // with each herd updated from its last state where possible (see
+    // SimpleForward::appendTimepointBuffer).  The whole time point is
+    // checked first, so a bad result leaves every herd as it was.
+    void appendTimepointBuffer(const int* results)
+    {
+      for(size_t h=0L; h<m_herds.size(); ++h)
+      {
+        m_herds[h]->checkTimepoint(results + m_offset[h]);
+      }
+
+      scheduleHerds();
+      parallel_items(m_order.size(), herdThreads(), [&](const size_t k)
+      {
+        const size_t h = m_order[k];
+        m_herds[h]->appendTimepointBuffer(results + m_offset[h]);
+        m_herd_ll[h] = m_herds[h]->logDensity();
+      });
+      m_nT++;
+
+      clearCache();
+      m_logdens = 0.0;
+      for(const double ll : m_herd_ll)
+      {
+        m_logdens += ll;
+      }
+      m_current = true;
+    }
+
+    void setRates(const std::vector<double>& prv1, const std::vector<double>& beta_const,
+                  const std::vector<double>& beta_freq, const std::vector<double>& gamm)
+    {
+      setHerdRates(prv1.data(), prv1.size(), beta_const.data(), beta_const.size(),
+                   beta_freq.data(), beta_freq.size(), gamm.data(), gamm.size());
+    }
+
+    // From dhimmvec, with beta_freq shared by all herds:
+    void setRateArrays(const double* prv1, const size_t n_prv1, const double* beta_const,
+                       const size_t n_beta_const, const double beta_freq,
+                       const double* gamm, const size_t n_gamm)
+    {
+      setHerdRates(prv1, n_prv1, beta_const, n_beta_const, &beta_freq, 1L, gamm, n_gamm);
+    }
+
+    void setTestPars(const std::vector<double>& test_pars)
+    {
+      setTestParArray(test_pars.data(), test_pars.size());
+    }
+
+    void setTestParArray(const double* test_pars, const size_t n)
+    {
+      for(auto& herd : m_herds)
+      {
+        herd->setTestParArray(test_pars, n);
+      }
+      m_current = false;
+    }
+
+    void setDhimmPars(const double* pars)
+    {
+      for(auto& herd : m_herds)
+      {
+        herd->setDhimmPars(pars);
+      }
+      m_shared_rates = true;
+      m_current = false;
+    }
+
+    // Each herd evaluates the whole batch (see
+    // SimpleForward::evaluateBatch), with the herds summed in order
+    void evaluateBatch(const double* pars, const size_t n, double* logdens)
+    {
+      for(const auto& herd : m_herds)
+      {
+        herd->checkDhimmPars(pars, n);
+      }
+
+      scheduleHerds();
+      std::vector<double> herd_logdens(m_herds.size()*n);
+      parallel_items(m_order.size(), herdThreads(), [&](const size_t k)
+      {
+        const size_t h = m_order[k];
+        m_herds[h]->evaluateBatch(pars, n, herd_logdens.data() + h*n);
+      });
+
+      std::fill(logdens, logdens + n, 0.0);
+      for(size_t h=0L; h<m_herds.size(); ++h)
+      {
+        for(size_t m=0L; m<n; ++m)
+        {
+          logdens[m] += herd_logdens[h*n + m];
+        }
+      }
+      m_shared_rates = true;
+      m_current = false;
+    }
+
+    void calculate()
+    {
+      checkHerds();
+      scheduleHerds();
+      parallel_items(m_order.size(), herdThreads(), [&](const size_t k)
+      {
+        const size_t h = m_order[k];
+        m_herds[h]->update();
+        m_herd_ll[h] = m_herds[h]->logDensity();
+      });
+
+      m_logdens = 0.0;
+      for(const double ll : m_herd_ll)
+      {
+        m_logdens += ll;
+      }
+      m_current = true;
+    }
+
+    double calculateWithGradient(std::array<double, 6L>& gradient)
+    {
+      if(!m_shared_rates) gradient_unsupported("per-herd or per-animal rates");
+      for(const auto& herd : m_herds)
+      {
+        herd->checkGradient();
+      }
+
+      scheduleHerds();
+      std::vector<std::array<double, 6L>> herd_gradient(m_herds.size());
+      parallel_items(m_order.size(), herdThreads(), [&](const size_t k)
+      {
+        const size_t h = m_order[k];
+        m_herd_ll[h] = m_herds[h]->calculateWithGradient(herd_gradient[h]);
+      });
+
+      m_logdens = 0.0;
+      gradient.fill(0.0);
+      for(size_t h=0L; h<m_herds.size(); ++h)
+      {
+        m_logdens += m_herd_ll[h];
+        for(size_t k=0L; k<gradient.size(); ++k)
+        {
+          gradient[k] += herd_gradient[h][k];
+        }
+      }
+      m_current = true;
+      return m_logdens;
+    }
+
+    // Draws each herd in turn, so the animals take the uniform variates in
+    // the same order as for a single herd
+    void samplePaths(PackedObservations& paths, const std::function<double()>& uniform)
+    {
+      paths.resize(m_nP, m_nT);
+      PackedObservations herd_paths;
+      for(size_t h=0L; h<m_herds.size(); ++h)
+      {
+        m_herds[h]->samplePaths(herd_paths, uniform);
+        for(size_t t=0L; t<m_nT; ++t)
+        {
+          for(size_t i=0L; i<herdSize(h); ++i)
+          {
+            paths.set(t, m_offset[h] + i, herd_paths.get(t, i));
+          }
+        }
+      }
+    }
+
+    double logDensity()
+    {
+      return m_logdens;
+    }
+
+    std::vector<double> getHerdLogLik() const
+    {
+      return m_herd_ll;
+    }
+
+    size_t getNumAnimals() const
+    {
+      return m_nP;
+    }
+
+    size_t getNumTimepoints() const
+    {
+      return m_nT;
+    }
+
+    void animalLogLik(double* out) const
+    {
+      for(size_t h=0L; h<m_herds.size(); ++h)
+      {
+        m_herds[h]->animalLogLik(out + m_offset[h]);
+      }
+    }
+
+    int getNumPatterns() const
+    {
+      int total = 0L;
+      for(const auto& herd : m_herds)
+      {
+        total += herd->getNumPatterns();
+      }
+      return total;
+    }
+
+    int getNumHerds() const
+    {
+      return m_herds.size();
+    }
+};
@@ -1,17 +1,96 @@
 #ifndef HIMM_H_
 #define HIMM_H_
 
+#include <array>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <limits>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "pattern_storage.h"
 #include "pointer_storage.h"
+#include "thread_pool.h"
 // Virtual base class for Himm
 
+// Number of parameter sets remembered by evaluate:
+const size_t himm_cache_size = 8L;
+
+// A missing test result in data buffers (the same value as NA for an R
+// integer):
+const int himm_na_result = std::numeric_limits<int>::min();
+
+// Thrown by calculateWithGradient for a model it cannot differentiate
+[[noreturn]] inline void gradient_unsupported(const char* feature)
+{
+  throw std::runtime_error(std::string("calculateWithGradient does not support ") + feature);
+}
+
+// Value of a seasonal rate for the step into each of the nT time points,
+// from values repeated with period n (so n = nT gives one per step, and
+// e.g. n = 12 monthly values starting from the month of the first time
+// point).  There is no step into the first time point, so out[0] is unused.
+inline void seasonal_steps(const double* values, const size_t n, const size_t nT, double* out)
+{
+  for(size_t t=0L; t<nT; ++t)
+  {
+    out[t] = values[t % n];
+  }
+}
+
 class Himm
 {
+private:
+  // Log densities from evaluate keyed on the bit pattern of the parameters,
+  // with the least recently used entry replaced once full:
+  struct CacheEntry
+  {
+    std::array<std::uint64_t, 6L> key;
+    double logdens;
+    std::uint64_t used;
+  };
+  std::array<CacheEntry, himm_cache_size> m_cache;
+  size_t m_cache_entries = 0L;
+  std::uint64_t m_cache_clock = 0L;
+  std::uint64_t m_cache_hits = 0L;
+  std::uint64_t m_cache_misses = 0L;
+  // Set when evaluate returns a cached log density, after which the engine
+  // has those parameters but not necessarily results for them (see refresh):
+  bool m_stale = false;
+
+  // From calculateGradient, in the order of calculateWithGradient:
+  std::array<double, 6L> m_gradient;
+
 protected:
   int pointer_index;
+  // Number of threads used by calculate (0 means the module-level default):
+  int m_threads = 0L;
+
+  // Set by engines when the results of the last calculate still hold for
+  // the current parameters (engines that never set it always recalculate):
+  bool m_current = false;
+
+  int activeThreads() const
+  {
+    return m_threads > 0L ? m_threads : get_default_threads();
+  }
+
+  // Must be called by anything that changes the log density for a given
+  // set of parameters (e.g. new data).  The hit and miss counts are kept:
+  void clearCache()
+  {
+    m_current = false;
+    m_cache_entries = 0L;
+  }
+
 public:
   Himm()
   {
     pointer_index = add_pointer(this);
+    m_gradient.fill(NAN);
   }
 
   virtual double logDensity() = 0;
@@ -20,20 +99,225 @@ public:
   {
   }
 
-  /*
-  int getIndex()
+  int getIndex() const
   {
     return pointer_index;
   }
-  */
-  
-  virtual void setRates(const std::vector<double> prv1, const std::vector<double> beta_const,
-                        const std::vector<double> beta_freq, const std::vector<double> gamm) = 0;
-  
-  virtual void setTestPars(const std::vector<double> test_pars) = 0;
+
+  virtual void setRates(const std::vector<double>& prv1, const std::vector<double>& beta_const,
+                        const std::vector<double>& beta_freq, const std::vector<double>& gamm) = 0;
+
+  // As setRates, from arrays that may hold one value per animal:  engines
+  // supporting per-animal rates override this to use them without copying
+  virtual void setRateArrays(const double* prv1, const size_t n_prv1, const double* beta_const,
+                             const size_t n_beta_const, const double beta_freq,
+                             const double* gamm, const size_t n_gamm)
+  {
+    setRates(std::vector<double>(prv1, prv1 + n_prv1), std::vector<double>(beta_const, beta_const + n_beta_const),
+             { beta_freq }, std::vector<double>(gamm, gamm + n_gamm));
+  }
+
+  virtual void setTestPars(const std::vector<double>& test_pars) = 0;
+
+  // As setTestPars, from an array of n values:  engines override this to
+  // avoid allocating
+  virtual void setTestParArray(const double* test_pars, const size_t n)
+  {
+    setTestPars(std::vector<double>(test_pars, test_pars + n));
+  }
+
+  // Test results as an nP x nT column-major buffer (as for an R matrix),
+  // with himm_na_result for a missing test
+  virtual void addDataBuffer(const int* /* data */)
+  {
+    throw std::runtime_error("Adding data from a buffer is not supported by this engine");
+  }
+
+  // Test records in long format (1-based animal and time point), with the
+  // time points of an animal without a record treated as missing
+  virtual void addRecordBuffer(const int* animal, const int* time, const int* result, const size_t n)
+  {
+    const size_t nP = getNumAnimals();
+    const size_t nT = getNumTimepoints();
+    std::vector<int> data(nP*nT, himm_na_result);
+    for(size_t k=0L; k<n; ++k)
+    {
+      if(animal[k] < 1L || static_cast<size_t>(animal[k]) > nP) throw std::runtime_error("animal out of range");
+      if(time[k] < 1L || static_cast<size_t>(time[k]) > nT) throw std::runtime_error("time out of range");
+      data[(animal[k] - 1L) + (time[k] - 1L)*nP] = result[k];
+    }
+    addDataBuffer(data.data());
+  }
+
+  // Adds a time point with one test result per animal (of getNumAnimals)
+  virtual void appendTimepointBuffer(const int* /* results */)
+  {
+    throw std::runtime_error("Adding time points is not supported by this engine");
+  }
+
+  virtual int getNumPatterns() const = 0;
+
+  // Number of latent states of engines taking a K-state transition matrix
+  // (as for dhimmk), and 0 for engines taking the dhimm parameters
+  virtual int getNumStates() const
+  {
+    return 0L;
+  }
+
+  int getThreads() const
+  {
+    return m_threads;
+  }
+
+  // 0 uses the module-level default
+  void setThreads(const int threads)
+  {
+    if(threads < 0L) throw std::runtime_error("The number of threads must be non-negative");
+    m_threads = threads;
+  }
+
+  // Uses the number of threads of owner, for an engine that owner hands
+  // its calculations on to
+  void inheritThreads(const Himm& owner)
+  {
+    m_threads = owner.m_threads;
+  }
+
+  // Sets the six dhimm parameters (p1, beta_const, beta_freq, gamma, se, sp)
+  // from a contiguous array:  engines override this to avoid allocating
+  virtual void setDhimmPars(const double* pars)
+  {
+    setRates({ pars[0L] }, { pars[1L] }, { pars[2L] }, { pars[3L] });
+    setTestPars({ pars[4L], pars[5L] });
+  }
     
   virtual void calculate() = 0;
 
+  // As calculate, unless nothing has changed since the last calculation:
+  void update()
+  {
+    m_stale = false;
+    if(!m_current) calculate();
+  }
+
+  // Brings the results (log density, animal and herd log-likelihoods) up
+  // to date with the parameters after evaluate was served from the cache:
+  void refresh()
+  {
+    if(m_stale) update();
+  }
+
+  // Log-likelihood contribution of each animal from the last calculation,
+  // expanded from the unique patterns into out (of length getNumAnimals):
+  virtual size_t getNumAnimals() const = 0;
+  virtual size_t getNumTimepoints() const = 0;
+  virtual void animalLogLik(double* out) const = 0;
+
+  // Posterior probabilities from smooth for each animal and time point:
+  // 0 for engines that do not smooth
+  virtual size_t smoothValues() const
+  {
+    return 0L;
+  }
+
+  // Posterior probabilities under the current parameters into out, as an
+  // nP x nT x smoothValues column-major array
+  virtual void smooth(double* /* out */)
+  {
+    throw std::runtime_error("Smoothing is not supported by this engine");
+  }
+
+  // Draws the latent infection state of every animal at every time point
+  // from the posterior under the current parameters, into paths (resized
+  // to nP animals by nT), using uniform for U(0,1) variates:
+  virtual void samplePaths(PackedObservations& /* paths */, const std::function<double()>& /* uniform */)
+  {
+    throw std::runtime_error("Sampling of latent states is not supported by this engine");
+  }
+
+  // Log density for the six dhimm parameters, only calculated if these
+  // are not in the cache
+  double evaluate(const double* pars)
+  {
+    std::array<std::uint64_t, 6L> key;
+    std::memcpy(key.data(), pars, sizeof(key));
+    m_cache_clock++;
+
+    for(size_t i=0L; i<m_cache_entries; ++i)
+    {
+      if(m_cache[i].key == key)
+      {
+        m_cache[i].used = m_cache_clock;
+        m_cache_hits++;
+        // The engine is left with these parameters as after a miss, with
+        // the calculation itself put off until anything else needs it:
+        setDhimmPars(pars);
+        m_stale = true;
+        return m_cache[i].logdens;
+      }
+    }
+
+    m_cache_misses++;
+    setDhimmPars(pars);
+    update();
+    const double logdens = logDensity();
+
+    size_t slot = m_cache_entries;
+    if(slot < himm_cache_size)
+    {
+      m_cache_entries++;
+    }
+    else
+    {
+      slot = 0L;
+      for(size_t i=1L; i<himm_cache_size; ++i)
+      {
+        if(m_cache[i].used < m_cache[slot].used) slot = i;
+      }
+    }
+    m_cache[slot].key = key;
+    m_cache[slot].logdens = logdens;
+    m_cache[slot].used = m_cache_clock;
+
+    return logdens;
+  }
+
+  // Log densities for n consecutive sets of the six dhimm parameters, as
+  // evaluate:  engines override this to run the sets together
+  virtual void evaluateBatch(const double* pars, const size_t n, double* logdens)
+  {
+    for(size_t i=0L; i<n; ++i)
+    {
+      logdens[i] = evaluate(pars + 6L*i);
+    }
+  }
+
+  double cacheHits() const
+  {
+    return static_cast<double>(m_cache_hits);
+  }
+
+  double cacheMisses() const
+  {
+    return static_cast<double>(m_cache_misses);
+  }
+
+  // Calculates the log density (which is also returned) along with its
+  // gradient with respect to the six dhimm parameters, in the order
+  // p1, beta_const, beta_freq, gamma, se, sp (throwing, via
+  // gradient_unsupported, for models without one):
+  virtual double calculateWithGradient(std::array<double, 6L>& gradient) = 0;
+
+  void calculateGradient()
+  {
+    calculateWithGradient(m_gradient);
+  }
+
+  const std::array<double, 6L>& getGradient() const
+  {
+    return m_gradient;
+  }
+
   virtual ~Himm()
   {
     remove_pointer(pointer_index);
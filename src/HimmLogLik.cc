@@ -0,0 +1,87 @@
+#include <util/nainf.h>
+
+#include "HimmLogLik.h"
+#include "himm_api.h"
+
+using std::vector;
+
+/*
+  Log-likelihood of each animal for the parameters of dhimmvec.  The Himm
+  object only recalculates if the parameters differ from its last
+  calculation, so monitoring this alongside dhimm/dhimmvec re-uses the
+  same forward pass (for engines that track this).  Each unique history
+  is evaluated once, and is only expanded to animals here.
+*/
+
+#define INDEX(args) (*args[0])
+#define P1(args) (args[1])
+#define BETACONST(args) (args[2])
+#define BETAFREQ(args) (args[3])
+#define GAMMA(args) (args[4])
+#define SE(args) (args[5])
+#define SP(args) (args[6])
+
+namespace jags {
+namespace himm {
+
+HimmLogLik::HimmLogLik()
+    : VectorFunction("himm_loglik", 7L)
+{}
+
+bool HimmLogLik::checkParameterFixed(vector<bool> const &mask) const
+{
+  return mask[0];
+}
+
+bool HimmLogLik::checkParameterLength(vector<unsigned int> const &lengths) const
+{
+  return lengths[0] == 1L && lengths[1] >= 1L && lengths[2] >= 1L && lengths[3] == 1L &&
+    lengths[4] >= 1L && lengths[5] == 1L && lengths[6] == 1L;
+}
+
+bool HimmLogLik::checkParameterValue(vector<double const *> const &args,
+                                     vector<unsigned int> const &lengths) const
+{
+  if(!himm_from_index(static_cast<int>(INDEX(args)))) return false;
+  for(unsigned int p = 1; p < args.size(); ++p)
+  {
+    for(unsigned int i = 0; i < lengths[p]; ++i)
+    {
+      if(args[p][i] < 0.0 || args[p][i] > 1.0) return false;
+    }
+  }
+  return true;
+}
+
+unsigned int HimmLogLik::length(vector<unsigned int> const &lengths,
+                                vector<double const *> const &values) const
+{
+  return himm_num_animals(himm_from_index(static_cast<int>(INDEX(values))));
+}
+
+void HimmLogLik::evaluate(double *value, vector<double const *> const &args,
+                          vector<unsigned int> const &lengths) const
+{
+  const int index = static_cast<int>(INDEX(args));
+  himm_engine* engine = himm_from_index(index);
+  if(!engine)
+  {
+    printf("INVALID POINTER INDEX %i\n", index);
+    *value = JAGS_NAN;
+    return;
+  }
+
+  const himm_rates rates = { P1(args), lengths[1], BETACONST(args), lengths[2],
+                             *BETAFREQ(args), GAMMA(args), lengths[4], *SE(args), *SP(args) };
+  if(himm_animal_loglik(engine, &rates, value) != HIMM_OK)
+  {
+    printf("ERROR IN himm_loglik: %s\n", himm_last_error());
+    const size_t nP = himm_num_animals(engine);
+    for(size_t i = 0; i < nP; ++i)
+    {
+      value[i] = JAGS_NAN;
+    }
+  }
+}
+
+}}
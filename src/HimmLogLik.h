@@ -0,0 +1,35 @@
+#ifndef HIMM_LOGLIK_H_
+#define HIMM_LOGLIK_H_
+
+#include <function/VectorFunction.h>
+
+namespace jags {
+namespace himm {
+
+/**
+ * @short Per-animal log-likelihood contributions of dhimm/dhimmvec
+ * <pre>
+ * loglik[1:nP] <- himm_loglik(Index, p1, beta_const, beta_freq, gamma, se, sp)
+ * </pre>
+ * Takes the same arguments as dhimmvec (so p1, beta_const and gamma may
+ * be per animal) and returns the log-likelihood of each animal, e.g. for
+ * monitoring to calculate WAIC or PSIS-LOO.  Index must be fixed data, as
+ * it determines the length of the result.
+ */
+class HimmLogLik : public VectorFunction {
+public:
+    HimmLogLik();
+    void evaluate(double *value,
+		  std::vector<double const *> const &args,
+		  std::vector<unsigned int> const &lengths) const;
+    unsigned int length(std::vector<unsigned int> const &lengths,
+			std::vector<double const *> const &values) const;
+    bool checkParameterFixed(std::vector<bool> const &mask) const;
+    bool checkParameterLength(std::vector<unsigned int> const &lengths) const;
+    bool checkParameterValue(std::vector<double const *> const &args,
+			     std::vector<unsigned int> const &lengths) const;
+};
+
+}}
+
+#endif /* HIMM_LOGLIK_H_ */
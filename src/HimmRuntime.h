@@ -0,0 +1,37 @@
+#include <memory>
+#include <string>
+
+#include "Himm.h"
+#include "himm_factory.h"
+
+// A single class for any number of time points, holding the engine from
+// new_himm_engine.  The pointer index is that of the engine, so it can be
+// used with dhimm (and HimmLogLik) and the C interface directly.
+class HimmRuntime
+{
+  private:
+    std::unique_ptr<Himm> m_himm;
+
+    const int m_nT;
+
+  public:
+    HimmRuntime(const int nP, const int nT) :
+      m_himm(new_himm_engine(nP, nT)), m_nT(nT)
+    {
+    }
+
+    int getNT() const
+    {
+      return m_nT;
+    }
+
+    std::string getEngine() const
+    {
+      return m_nT <= himm_template_max_nT ? "HimmTemplate" : "SimpleForward";
+    }
+
+    int getIndex() const
+    {
+      return m_himm->getIndex();
+    }
+};
@@ -1,7 +1,18 @@
-#include <Rcpp.h>
+#include <algorithm>
 #include <array>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <stdexcept>
 
 #include "Himm.h"
+#include "himm_factory.h"
+#include "pattern_storage.h"
+#include "forward_kernels.h"
+
+// Largest number of p(y | z) values kept by HimmTemplate (32 MB), above
+// which the rows are calculated as needed:
+const size_t himm_emission_cache_size = 1L << 22L;
 
 template<int T_nP, int T_nT, int T_2pT>
 class HimmTemplate : public Himm
@@ -9,13 +20,43 @@ class HimmTemplate : public Himm
   private:
     std::array<double, T_2pT> m_comb_probs;
     std::vector<double> m_ind_probs;
-    std::vector<std::array<int, T_nT>> m_data;
+    // Unique observation histories as pattern ids, their multiplicity, and
+    // the pattern used by each animal.  The low T_nT bits of an id hold the
+    // test results (encoded in the same way as the latent sequences, so
+    // m_zs[id & (T_2pT-1)] gives the observations) and the next T_nT bits
+    // flag missing tests:
+    std::vector<std::int64_t> m_data;
+    std::vector<double> m_counts;
+    std::vector<int> m_pattern_index;
+    // Log-likelihood of each unique history from the last calculation:
+    std::vector<double> m_pattern_ll;
     std::array<std::array<int, T_nT>, T_2pT> m_zs;
+    // p(y | z) for every unique history y and latent sequence z, with
+    // index y*T_2pT + z, rebuilt by setTestPars and addData unless larger
+    // than himm_emission_cache_size (then left empty), and the powers of
+    // the test probabilities it is built from:
+    std::vector<double> m_emission;
+    std::array<double, T_nT+1L> m_pos1, m_neg1, m_pos0, m_neg0;
+    // Probability of each latent sequence, and two rows of T_2pT values for
+    // each block of unique histories (see blockRows):  these grow as 2^nT,
+    // so are kept here rather than on the stacks of the pool's threads
+    std::vector<double> m_zis;
+    std::vector<double> m_block_rows;
+    // The mean-field beta_freq term couples the animals, so while beta_freq
+    // is non-zero the calculations are handed on to a SimpleForward with
+    // the same data (see frequencyEngine), with its per-animal results:
+    std::unique_ptr<Himm> m_frequency;
+    std::vector<double> m_frequency_ll;
 
     double m_p1 = 0.1;
     double m_beta_const = 0.1;
-    double m_beta_freq = 0.1;
+    double m_beta_freq = 0.0;
     double m_gamma = 0.1;
+    // Per-step beta_const and gamma (see seasonal_steps), used for the
+    // transitions if m_seasonal:
+    std::array<double, T_nT> m_step_beta;
+    std::array<double, T_nT> m_step_gamma;
+    bool m_seasonal = false;
 
     double m_se = 0.99;
     double m_sp = 0.99;
@@ -28,15 +69,23 @@ class HimmTemplate : public Himm
       m_nP(nP)
     {
       // TODO: allow arbitrary nT with vector rather than array at some point
-      if(nT != T_nT) Rcpp::stop("Non-matching nT and T_nT");
-      if(std::pow(2L, nT) != T_2pT) Rcpp::stop("Non-matching 2^nT and T_nT");
+      if(nT != T_nT) throw std::runtime_error("Non-matching nT and T_nT");
+      if(std::pow(2L, nT) != T_2pT) throw std::runtime_error("Non-matching 2^nT and T_nT");
 
       for(int i=0; i<T_2pT; ++i)
       {
         m_zs[i] = binarise(i);
       }
 
-      m_data.resize(nP);
+      // Until data is added every animal has the all-negative history:
+      m_data.resize(1L, 0L);
+      m_counts.resize(1L, static_cast<double>(nP));
+      m_pattern_index.resize(nP, 0L);
+      m_pattern_ll.resize(1L, NAN);
+      m_zis.resize(T_2pT);
+      m_block_rows.resize(2L*T_2pT);
+
+      buildEmission();
     }
 
     std::array<int, T_nT> binarise(int num)
@@ -58,14 +107,26 @@ class HimmTemplate : public Himm
       return rv;
     }
 
-    Rcpp::IntegerMatrix getZs() const
+    // Inverse of binarise
+    int patternId(const std::array<int, T_nT>& ys) const
     {
-      Rcpp::IntegerMatrix rv(T_2pT, T_nT);
+      int rv = 0L;
+      for(int t=0L; t<T_nT; ++t)
+      {
+        rv = 2L*rv + (ys[t] != 0L);
+      }
+      return rv;
+    }
+
+    // The latent sequences as a T_2pT x T_nT column-major matrix
+    std::vector<int> getZs() const
+    {
+      std::vector<int> rv(T_2pT*T_nT);
       for(size_t i=0L; i<T_2pT; ++i)
       {
         for(size_t j=0L; j<T_nT; ++j)
         {
-          rv(i,j) = m_zs[i][j];
+          rv[i + j*T_2pT] = m_zs[i][j];
         }
       }
       return rv;
@@ -76,23 +137,55 @@ class HimmTemplate : public Himm
       return y==0L ? log(1.0-prob) : log(prob);
     }
 
-    double obsFun(const int zi, const int yi)
+    // Probability of the observations of pattern yi given latent sequence zi
+    double obsFun(const int zi, const int yi) const
     {
-      const std::array<int, T_nT>& ys = m_data[yi];
-      const std::array<int, T_nT>& zs = m_zs[zi];
+      return m_emission.empty() ? emission(yi, zi) : m_emission[yi*T_2pT + zi];
+    }
+
+    // p(y | z) only depends on the number of tested time points in each of
+    // the four (z, y) combinations, so it comes from the tables of powers
+    // (missing tests are left out of the counts):
+    double emission(const size_t p, const int z) const
+    {
+      const int y = m_data[p] & (T_2pT-1L);
+      const int tested = ~(m_data[p] >> T_nT) & (T_2pT-1L);
+      const int n11 = __builtin_popcount(z & y & tested);
+      const int n10 = __builtin_popcount(z & ~y & tested);
+      const int n01 = __builtin_popcount(~z & y & tested);
+      const int n00 = __builtin_popcount(tested) - n11 - n10 - n01;
+      return m_pos1[n11] * m_neg1[n10] * m_pos0[n01] * m_neg0[n00];
+    }
 
-      double ll = 0.0;
-      for(int i=0; i<T_nT; ++i)
+    // Row of p(y | z) over z for unique history p, from the cache or
+    // calculated into buffer
+    const double* emissionRow(const size_t p, double* buffer) const
+    {
+      if(!m_emission.empty()) return m_emission.data() + p*T_2pT;
+      for(int z=0L; z<T_2pT; ++z)
       {
-        ll += dbern(ys[i], zs[i]*m_se + (1L-zs[i])*(1.0-m_sp));
+        buffer[z] = emission(p, z);
       }
+      return buffer;
+    }
+
+    // Scratch rows for the block of unique histories starting at from
+    double* blockRows(const size_t from)
+    {
+      return m_block_rows.data() + (from / parallel_block_size) * 2L*T_2pT;
+    }
 
-      return exp(ll);
+    void calculateZis()
+    {
+      for(int z=0L; z<T_2pT; ++z)
+      {
+        m_zis[z] = calculateZi(z);
+      }
     }
 
     double calculateZi(int zi)
     {
-      if(zi < 0L || zi >= T_2pT) Rcpp::stop("zi out of range");
+      if(zi < 0L || zi >= T_2pT) throw std::runtime_error("zi out of range");
       const std::array<int, T_nT>& zs = m_zs[zi];
       // std::array<double, T_nT> pa;
 
@@ -103,7 +196,9 @@ class HimmTemplate : public Himm
       for(int t=1L; t<T_nT; ++t)
       {
         // zp = zs[t-1L] * (1.0 - (std::pow(1.0-m_beta_freq, pa[t-1L])) + (1L-zs[t-1L])*(1.0-m_gamma);
-        const double zp = (zs[t-1L]==0L) ? m_beta_const : (1.0-m_gamma);
+        const double beta = m_seasonal ? m_step_beta[t] : m_beta_const;
+        const double gamma = m_seasonal ? m_step_gamma[t] : m_gamma;
+        const double zp = (zs[t-1L]==0L) ? beta : (1.0-gamma);
         // pa[t] = zp;
 
         za = (zs[t]==0L) ? (1.0-zp) : zp;
@@ -115,122 +210,404 @@ class HimmTemplate : public Himm
 
     void show()
     {
-      //Rcpp::Rcout << "hello from Himm nr " << pointer_index << std::endl;
       printf("hello from Himm\n");
 
     }
 
-    int getIndex()
-    {
-      return pointer_index;
-    }
-
     double logDensity()
     {
       return m_logdens;
     }
 
-    double test(const double p1)
+    // beta_const and gamm may be seasonal, with length up to nT (but not
+    // nP, which would be per animal)
+    void setRates(const std::vector<double>& prv1, const std::vector<double>& beta_const,
+                  const std::vector<double>& beta_freq, const std::vector<double>& gamm)
     {
-      m_se = 0.9;
-      m_sp = 0.99;
-      m_beta_const = 0.05;
-      m_gamma = 0.08;
-      m_p1 = p1;
+      auto per_animal = [&](const size_t n)
+      {
+        return n != 1L && n == static_cast<size_t>(m_nP);
+      };
+      if(prv1.size() != 1L || per_animal(beta_const.size()) || per_animal(gamm.size()))
+      {
+        throw std::runtime_error("Per-animal rates are not supported by HimmTemplate");
+      }
+      if(beta_const.empty() || beta_const.size() > T_nT || gamm.empty() || gamm.size() > T_nT)
+      {
+        throw std::runtime_error("beta_const and gamm must have length 1 or at most nT");
+      }
 
-      calculate();
+      if(beta_freq[0L] != 0.0) frequencyEngine().setRates(prv1, beta_const, beta_freq, gamm);
+      m_p1 = prv1[0L];
+      m_beta_const = beta_const[0L];
+      m_beta_freq = beta_freq[0L];
+      m_gamma = gamm[0L];
+      m_seasonal = beta_const.size() != 1L || gamm.size() != 1L;
+      seasonal_steps(beta_const.data(), beta_const.size(), T_nT, m_step_beta.data());
+      seasonal_steps(gamm.data(), gamm.size(), T_nT, m_step_gamma.data());
+    }
 
-      return logDensity();
+    // A single test (se, sp):  several tests per time point need
+    // SimpleForward.  The emission cache is only rebuilt if se or sp has
+    // changed.
+    void setTestPars(const std::vector<double>& test_pars)
+    {
+      setTestParArray(test_pars.data(), test_pars.size());
+    }
 
+    void setTestParArray(const double* test_pars, const size_t n)
+    {
+      if(n != 2L) throw std::runtime_error("HimmTemplate takes the se and sp of a single test");
+      if(m_frequency) m_frequency->setTestParArray(test_pars, n);
+      if(test_pars[0L] != m_se || test_pars[1L] != m_sp)
+      {
+        m_se = test_pars[0L];
+        m_sp = test_pars[1L];
+        buildEmission();
+      }
     }
 
-    void setRates(const std::vector<double> prv1, const std::vector<double> beta_const,
-                  const std::vector<double> beta_freq, const std::vector<double> gamm)
+    // As setRates and setTestPars, from p1, beta_const, beta_freq, gamma,
+    // se, sp.  The emission cache is only rebuilt if se or sp has changed.
+    void setDhimmPars(const double* pars)
     {
-      // Ignore beta_freq for now
-      m_p1 = prv1[0L];
-      m_beta_const = beta_const[0L];
-      m_beta_freq = beta_freq[0L];
-      m_gamma = gamm[0L];
+      if(pars[2L] != 0.0) frequencyEngine().setDhimmPars(pars);
+      m_p1 = pars[0L];
+      m_beta_const = pars[1L];
+      m_beta_freq = pars[2L];
+      m_gamma = pars[3L];
+      m_seasonal = false;
+      if(pars[4L] != m_se || pars[5L] != m_sp)
+      {
+        m_se = pars[4L];
+        m_sp = pars[5L];
+        buildEmission();
+      }
     }
 
-    void setTestPars(const std::vector<double> test_pars)
+    void buildEmission()
     {
-      m_se = test_pars[0L];
-      m_sp = test_pars[1L];
+      for(int n=0L; n<=T_nT; ++n)
+      {
+        m_pos1[n] = std::pow(m_se, n);
+        m_neg1[n] = std::pow(1.0-m_se, n);
+        m_pos0[n] = std::pow(1.0-m_sp, n);
+        m_neg0[n] = std::pow(m_sp, n);
+      }
+
+      if(m_data.size()*T_2pT > himm_emission_cache_size)
+      {
+        m_emission.clear();
+        return;
+      }
+
+      m_emission.resize(m_data.size()*T_2pT);
+      for(size_t p=0L; p<m_data.size(); ++p)
+      {
+        for(int z=0L; z<T_2pT; ++z)
+        {
+          m_emission[p*T_2pT + z] = emission(p, z);
+        }
+      }
     }
 
     double obsprev(int tp)
     {
       double tot=0.0;
-      for(int i=0L; i<m_nP; ++i)
+      for(size_t p=0L; p<m_data.size(); ++p)
       {
-        tot += m_data[i][tp-1L];
+        tot += m_counts[p] * m_zs[m_data[p] & (T_2pT-1L)][tp-1L];
       }
 
       return tot/m_nP;
     }
 
-    Rcpp::NumericVector getZis()
+    std::vector<double> getZis()
     {
-      std::array<double, T_2pT> zis;
-      for(int z=0L; z<T_2pT; ++z)
+      calculateZis();
+
+      return m_zis;
+    }
+
+    // p(y | z) for each animal as a T_2pT x nP column-major matrix
+    std::vector<double> getObsProbs()
+    {
+      std::vector<double> rv(static_cast<size_t>(T_2pT)*m_nP);
+
+      std::vector<double> buffer(T_2pT);
+      for(int i=0L; i<m_nP; ++i)
       {
-        zis[z] = calculateZi(z);
+        const double* em = emissionRow(m_pattern_index[i], buffer.data());
+        std::copy(em, em + T_2pT, rv.begin() + static_cast<size_t>(i)*T_2pT);
       }
 
-      Rcpp::NumericVector rv = Rcpp::wrap(zis);
-
       return rv;
     }
 
-    Rcpp::NumericMatrix getObsProbs()
+    // The SimpleForward used while beta_freq is non-zero, created on first
+    // use from the unique histories and kept up to date from then on
+    Himm& frequencyEngine()
     {
-      Rcpp::NumericMatrix rv(T_2pT, m_nP);
-
-      for(int i=0L; i<m_nP; ++i)
+      if(!m_frequency)
       {
-        for(int z=0L; z<T_2pT; ++z)
+        std::vector<int> data(static_cast<size_t>(m_nP)*T_nT);
+        for(int i=0L; i<m_nP; ++i)
         {
-          rv(z,i) = obsFun(z,i);
+          const std::int64_t id = m_data[m_pattern_index[i]];
+          for(int t=0L; t<T_nT; ++t)
+          {
+            data[i + t*m_nP] = m_zs[id >> T_nT][t] ? himm_na_result : m_zs[id & (T_2pT-1L)][t];
+          }
         }
+        m_frequency.reset(new_simple_forward(m_nP, T_nT));
+        m_frequency->addDataBuffer(data.data());
+        m_frequency->setTestPars({ m_se, m_sp });
+        m_frequency_ll.resize(m_nP);
       }
+      return *m_frequency;
+    }
 
-      return rv;
+    void calculateFrequency()
+    {
+      m_frequency->inheritThreads(*this);
+      m_frequency->calculate();
+      m_logdens = m_frequency->logDensity();
+      m_frequency->animalLogLik(m_frequency_ll.data());
+      for(int i=0L; i<m_nP; ++i)
+      {
+        m_pattern_ll[m_pattern_index[i]] = m_frequency_ll[i];
+      }
     }
 
     void calculate()
     {
-      std::array<double, T_2pT> zis;
-      for(int z=0L; z<T_2pT; ++z)
+      if(m_beta_freq != 0.0)
+      {
+        calculateFrequency();
+        return;
+      }
+
+      calculateZis();
+
+      // Each unique history is evaluated once and weighted by its count,
+      // with the likelihood a dot product against its row of the cache:
+      m_logdens = parallel_block_sum(m_data.size(), T_2pT, activeThreads(), [&](const size_t from, const size_t to)
+      {
+        double* buffer = blockRows(from);
+        double total=0.0;
+        for(size_t p=from; p<to; ++p)
+        {
+          const double* em = emissionRow(p, buffer);
+          double itotal = 0.0;
+          for(int z=0L; z<T_2pT; ++z)
+          {
+            itotal += m_zis[z] * em[z];
+          }
+          m_pattern_ll[p] = log(itotal);
+          total += m_counts[p] * m_pattern_ll[p];
+        }
+        return total;
+      });
+    }
+
+    double calculateWithGradient(std::array<double, 6L>& gradient)
+    {
+      // As for SimpleForward, the mean-field coupling is not differentiated,
+      // and there is no single beta_const or gamma to differentiate by with
+      // seasonal rates:
+      if(m_beta_freq != 0.0) gradient_unsupported("frequency-dependent transmission (beta_freq != 0)");
+      if(m_seasonal) gradient_unsupported("seasonal beta_const or gamma");
+
+      calculateZis();
+
+      // The gradient is the posterior expectation over latent sequences of
+      // the complete-data score, via the expected sufficient statistics:
+      std::vector<double> partial_ll(parallel_num_blocks(m_data.size()), 0.0);
+      std::vector<TwoStateStats> partial_ss(partial_ll.size());
+      parallel_blocks(m_data.size(), T_2pT*T_nT, activeThreads(), [&](const size_t block, const size_t from, const size_t to)
       {
-        zis[z] = calculateZi(z);
+        TwoStateStats& ss = partial_ss[block];
+        ss.fill(0.0);
+
+        double* buffer = blockRows(from);
+        double* joint = buffer + T_2pT;
+        double total = 0.0;
+        for(size_t p=from; p<to; ++p)
+        {
+          const double* em = emissionRow(p, buffer);
+          double itotal = 0.0;
+          for(int z=0L; z<T_2pT; ++z)
+          {
+            joint[z] = m_zis[z] * em[z];
+            itotal += joint[z];
+          }
+          m_pattern_ll[p] = log(itotal);
+          total += m_counts[p] * m_pattern_ll[p];
+
+          const std::array<int, T_nT>& ys = m_zs[m_data[p] & (T_2pT-1L)];
+          const std::array<int, T_nT>& missing = m_zs[m_data[p] >> T_nT];
+          for(int z=0L; z<T_2pT; ++z)
+          {
+            const double post = m_counts[p] * joint[z] / itotal;
+            if(post == 0.0) continue;
+
+            const std::array<int, T_nT>& zs = m_zs[z];
+            ss[zs[0L]==0L ? ss_first0 : ss_first1] += post;
+            for(int t=1L; t<T_nT; ++t)
+            {
+              if(zs[t-1L]==0L)
+              {
+                ss[zs[t]==0L ? ss_n00 : ss_n01] += post;
+              }
+              else
+              {
+                ss[zs[t]==0L ? ss_n10 : ss_n11] += post;
+              }
+            }
+            for(int t=0L; t<T_nT; ++t)
+            {
+              if(missing[t]) continue;
+              if(zs[t]==0L)
+              {
+                ss[ys[t]==0L ? ss_neg0 : ss_pos0] += post;
+              }
+              else
+              {
+                ss[ys[t]==0L ? ss_neg1 : ss_pos1] += post;
+              }
+            }
+          }
+        }
+        partial_ll[block] = total;
+      });
+
+      TwoStateStats ss;
+      ss.fill(0.0);
+      m_logdens = 0.0;
+      for(size_t block=0L; block<partial_ll.size(); ++block)
+      {
+        m_logdens += partial_ll[block];
+        for(size_t k=0L; k<ss.size(); ++k)
+        {
+          ss[k] += partial_ss[block][k];
+        }
       }
 
-      double total=0.0;
+      gradient = two_state_gradient(ss, m_p1, m_beta_const, m_gamma, m_se, m_sp);
+      return m_logdens;
+    }
+
+    // Test results as an nP x nT column-major buffer, as for an R matrix,
+    // with himm_na_result for a missing test (several tests per time point
+    // need SimpleForward)
+    void addDataBuffer(const int* data)
+    {
+      std::vector<std::int64_t> rows(m_nP);
       for(int i=0L; i<m_nP; ++i)
       {
-        double itotal = 0.0;
-        for(int z=0L; z<T_2pT; ++z)
+        std::array<int, T_nT> ys;
+        std::array<int, T_nT> missing;
+        for(int t=0L; t<T_nT; ++t)
         {
-          itotal += (zis[z] * obsFun(z, i));
+          const int y = data[i + t*m_nP];
+          if(y != 0L && y != 1L && y != himm_na_result) throw std::runtime_error("Test results must be 0, 1 or NA");
+          missing[t] = y == himm_na_result;
+          ys[t] = missing[t] ? 0L : y;
         }
-        total += log(itotal);
+        rows[i] = patternId(ys) + static_cast<std::int64_t>(T_2pT)*patternId(missing);
       }
 
-      m_logdens = total;
+      compress_patterns(rows, m_data, m_counts, m_pattern_index);
+      m_pattern_ll.assign(m_data.size(), NAN);
+      m_block_rows.resize(parallel_num_blocks(m_data.size())*2L*T_2pT);
+      buildEmission();
+      if(m_frequency) m_frequency->addDataBuffer(data);
+      clearCache();
     }
 
-    void addData(Rcpp::IntegerMatrix data)
+    int getNumPatterns() const
     {
-      if(data.ncol()!=T_nT) Rcpp::stop("Wrong col dim");
-      if(data.nrow()!=m_nP) Rcpp::stop("Wrong row dim");
+      return m_data.size();
+    }
 
+    std::vector<double> getPatternCounts() const
+    {
+      return m_counts;
+    }
+
+    size_t getNumAnimals() const
+    {
+      return m_nP;
+    }
+
+    size_t getNumTimepoints() const
+    {
+      return T_nT;
+    }
+
+    void animalLogLik(double* out) const
+    {
       for(int i=0L; i<m_nP; ++i)
       {
-        for(int t=0L; t<T_nT; ++t)
+        out[i] = m_pattern_ll[m_pattern_index[i]];
+      }
+    }
+
+    // Exact sampling from the posterior over the 2^nT latent sequences,
+    // with the cumulative posterior of each unique history built once for
+    // all of the animals that share it
+    void samplePaths(PackedObservations& paths, const std::function<double()>& uniform)
+    {
+      if(m_beta_freq != 0.0)
+      {
+        m_frequency->inheritThreads(*this);
+        m_frequency->samplePaths(paths, uniform);
+        return;
+      }
+
+      calculateZis();
+
+      // Variates are drawn in order of animal, and the animals of pattern p
+      // are animals[animal_start[p], animal_start[p+1]):
+      std::vector<double> u(m_nP);
+      std::vector<int> animal_start(m_data.size() + 1L, 0L);
+      for(int i=0L; i<m_nP; ++i)
+      {
+        u[i] = uniform();
+        animal_start[m_pattern_index[i] + 1L]++;
+      }
+      for(size_t p=0L; p<m_data.size(); ++p)
+      {
+        animal_start[p + 1L] += animal_start[p];
+      }
+      std::vector<int> animals(m_nP);
+      std::vector<int> next(animal_start.begin(), animal_start.end() - 1L);
+      for(int i=0L; i<m_nP; ++i)
+      {
+        animals[next[m_pattern_index[i]]++] = i;
+      }
+
+      paths.resize(m_nP, T_nT);
+      double* buffer = blockRows(0L);
+      double* cum = buffer + T_2pT;
+      for(size_t p=0L; p<m_data.size(); ++p)
+      {
+        const double* em = emissionRow(p, buffer);
+        double total = 0.0;
+        for(int z=0L; z<T_2pT; ++z)
+        {
+          total += m_zis[z] * em[z];
+          cum[z] = total;
+        }
+
+        for(int k=animal_start[p]; k<animal_start[p + 1L]; ++k)
         {
-          m_data[i][t] = data(i,t);
+          const int i = animals[k];
+          const int z = std::min<int>(std::upper_bound(cum, cum + T_2pT, u[i] * total) - cum, T_2pT-1L);
+          for(int t=0L; t<T_nT; ++t)
+          {
+            paths.set(t, i, m_zs[z][t]);
+          }
         }
       }
     }
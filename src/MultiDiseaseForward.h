@@ -0,0 +1,463 @@
+#include <array>
+#include <cmath>
+#include <cstdio>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+
+#include "Himm.h"
+#include "pattern_storage.h"
+
+/*
+  Forward engine for nD independent two-state infections per animal, as in
+  simulate_hmm, where a single test at each time point is positive if any
+  of the per-disease tests would be:
+    - joint latent state s has bit d set if infected with disease d
+    - the joint transition matrix is the Kronecker product of the nD 2x2
+      matrices, and is applied one disease at a time, so each time point
+      costs O(nD 2^nD) rather than O(4^nD)
+    - p(negative | s) = prod_d (s_d ? 1-se_d : sp_d)
+  With non-zero beta_freq the diseases are moved forward in lockstep over
+  all patterns, with the expected prevalence of each disease at t-1 giving
+    beta_dt = 1 - (1 - beta_freq_d * prev_d(t-1)) * (1 - beta_const_d)
+  where the prevalence is over the animals whose records (from their first
+  to their last non-missing test) span t-1, as for SimpleForward.
+  With T_nD > 0 the number of diseases is fixed at compile time and the
+  loops over diseases are fully unrolled; T_nD == 0 takes nD at runtime.
+
+  Via the Himm interface, setRates takes p1, beta_const, beta_freq and
+  gamm each with one value per disease (or a single value shared by all
+  diseases), and setTestPars takes se followed by sp (length 2 or 2*nD).
+*/
+
+template<int T_nD>
+class MultiDiseaseForward : public Himm
+{
+  private:
+    typedef typename std::conditional<(T_nD > 0L), std::array<double, (T_nD > 0L ? (1L << T_nD) : 1L)>,
+                                      std::vector<double>>::type StateVector;
+
+    // Unique observation histories, their multiplicity, and the pattern
+    // used by each animal, with missing tests flagged in m_missing:
+    PackedObservations m_data;
+    PackedObservations m_missing;
+    std::vector<double> m_counts;
+    std::vector<int> m_pattern_index;
+    size_t m_nPat = 1L;
+    // Log-likelihood of each unique history from the last calculation:
+    std::vector<double> m_pattern_ll;
+    // First and one past the last non-missing test of each pattern, and the
+    // number of animals with records spanning each time point:
+    std::vector<size_t> m_pattern_first;
+    std::vector<size_t> m_pattern_end;
+    std::vector<double> m_active_count;
+
+    // Per-disease parameters:
+    std::vector<double> m_p1;
+    std::vector<double> m_beta_const;
+    std::vector<double> m_beta_freq;
+    std::vector<double> m_gamma;
+    std::vector<double> m_se;
+    std::vector<double> m_sp;
+
+    // Joint initial distribution and p(y | s) for y = 0, 1:
+    std::vector<double> m_init;
+    std::array<std::vector<double>, 2L> m_emission;
+
+    // Filtered joint state probabilities of every pattern, used by the
+    // lockstep pass for frequency-dependent transmission:
+    std::vector<double> m_alpha;
+
+    const int m_nD;
+    const int m_nS;
+    const size_t m_nP;
+    const size_t m_nT;
+    double m_logdens = 0.0;
+
+    static int numStates(const int nD)
+    {
+      if(T_nD > 0L && nD != T_nD) throw std::runtime_error("Non-matching nD and T_nD");
+      if(nD < 1L || nD > 16L) throw std::runtime_error("nD must be between 1 and 16");
+      return 1L << nD;
+    }
+
+    int numDiseases() const
+    {
+      return T_nD > 0L ? T_nD : m_nD;
+    }
+
+    // One value per disease from a vector of length 1 or nD:
+    std::vector<double> perDisease(const std::vector<double>& values, const char* name) const
+    {
+      if(values.size() == 1L) return std::vector<double>(m_nD, values[0L]);
+      if(values.size() != static_cast<size_t>(m_nD)) throw std::runtime_error(std::string(name) + " must have length 1 or nD");
+      return values;
+    }
+
+    StateVector makeStates() const
+    {
+      StateVector rv{};
+      if constexpr (T_nD == 0L)
+      {
+        rv.resize(m_nS);
+      }
+      return rv;
+    }
+
+    // Applies the joint transition to alpha (of length 2^nD) one disease
+    // at a time, with the infection probability of each disease in beta:
+    void transition(double* alpha, const double* beta) const
+    {
+      const int nD = numDiseases();
+      const int nS = 1L << nD;
+      for(int d=0L; d<nD; ++d)
+      {
+        const int bit = 1L << d;
+        const double b = beta[d];
+        const double g = m_gamma[d];
+        for(int s=0L; s<nS; ++s)
+        {
+          if(s & bit) continue;
+          const double a0 = alpha[s];
+          const double a1 = alpha[s | bit];
+          alpha[s] = a0 * (1.0 - b) + a1 * g;
+          alpha[s | bit] = a0 * b + a1 * (1.0 - g);
+        }
+      }
+    }
+
+    // Multiplies alpha by p(y | s) and renormalises, returning the log of
+    // the normalising constant (-Inf for an impossible test, which leaves
+    // alpha at zero rather than NaN):
+    double emit(double* alpha, const bool y) const
+    {
+      const int nS = 1L << numDiseases();
+      const double* em = m_emission[y].data();
+      double total = 0.0;
+      for(int s=0L; s<nS; ++s)
+      {
+        alpha[s] *= em[s];
+        total += alpha[s];
+      }
+      if(!(total > 0.0)) return -INFINITY;
+      const double scale = 1.0 / total;
+      for(int s=0L; s<nS; ++s)
+      {
+        alpha[s] *= scale;
+      }
+      return std::log(total);
+    }
+
+    // As emit for the test of pattern p at time point t, which leaves
+    // alpha unchanged if the test is missing:
+    double observe(double* alpha, const size_t t, const size_t p) const
+    {
+      if(m_missing.get(t, p)) return 0.0;
+      return emit(alpha, m_data.get(t, p));
+    }
+
+    // Independent forward pass over patterns [from, to) with beta_const:
+    double forwardBlock(const size_t from, const size_t to)
+    {
+      const int nS = 1L << numDiseases();
+      StateVector alpha = makeStates();
+
+      double total = 0.0;
+      for(size_t p=from; p<to; ++p)
+      {
+        for(int s=0L; s<nS; ++s)
+        {
+          alpha[s] = m_init[s];
+        }
+        double ll = observe(alpha.data(), 0L, p);
+        for(size_t t=1L; t<m_nT; ++t)
+        {
+          transition(alpha.data(), m_beta_const.data());
+          ll += observe(alpha.data(), t, p);
+        }
+        m_pattern_ll[p] = ll;
+        total += m_counts[p] * ll;
+      }
+      return total;
+    }
+
+    // The span of records of each pattern, and so the animals at risk at
+    // each time point
+    void countActive(const std::vector<std::vector<char>>& patterns)
+    {
+      m_pattern_first.assign(m_nPat, 0L);
+      m_pattern_end.assign(m_nPat, 0L);
+      m_active_count.assign(m_nT + 1L, 0.0);
+      for(size_t p=0L; p<m_nPat; ++p)
+      {
+        size_t first = 0L;
+        size_t end = m_nT;
+        while(first < end && patterns[p][first] == 2L) ++first;
+        while(end > first && patterns[p][end-1L] == 2L) --end;
+        m_pattern_first[p] = first;
+        m_pattern_end[p] = end;
+        m_active_count[first] += m_counts[p];
+        m_active_count[end] -= m_counts[p];
+      }
+      for(size_t t=1L; t<m_nT; ++t)
+      {
+        m_active_count[t] += m_active_count[t-1L];
+      }
+      m_active_count.resize(m_nT);
+    }
+
+    // Expected prevalence of each disease at time point t over the animals
+    // whose records span t (zero if there are none), written to prev with
+    // one value per disease:
+    void prevalence(const size_t t, std::vector<double>& prev)
+    {
+      const int nD = numDiseases();
+      const size_t nblocks = parallel_num_blocks(m_nPat);
+      std::vector<double> partial(nblocks*nD, 0.0);
+      parallel_blocks(m_nPat, m_nS, activeThreads(), [&](const size_t block, const size_t from, const size_t to)
+      {
+        double* part = partial.data() + block*nD;
+        for(size_t p=from; p<to; ++p)
+        {
+          if(t < m_pattern_first[p] || t >= m_pattern_end[p]) continue;
+          const double* alpha = m_alpha.data() + p*m_nS;
+          for(int s=0L; s<m_nS; ++s)
+          {
+            for(int d=0L; d<nD; ++d)
+            {
+              if(s & (1L << d)) part[d] += m_counts[p] * alpha[s];
+            }
+          }
+        }
+      });
+
+      prev.assign(nD, 0.0);
+      for(size_t block=0L; block<nblocks; ++block)
+      {
+        for(int d=0L; d<nD; ++d)
+        {
+          prev[d] += partial[block*nD + d];
+        }
+      }
+      for(int d=0L; d<nD; ++d)
+      {
+        prev[d] = m_active_count[t] > 0.0 ? prev[d] / m_active_count[t] : 0.0;
+      }
+    }
+
+    void calculateFrequency()
+    {
+      const int nD = numDiseases();
+      m_alpha.resize(m_nPat*m_nS);
+
+      parallel_blocks(m_nPat, m_nS, activeThreads(), [&](const size_t /* block */, const size_t from, const size_t to)
+      {
+        for(size_t p=from; p<to; ++p)
+        {
+          double* alpha = m_alpha.data() + p*m_nS;
+          for(int s=0L; s<m_nS; ++s)
+          {
+            alpha[s] = m_init[s];
+          }
+          m_pattern_ll[p] = observe(alpha, 0L, p);
+        }
+      });
+
+      std::vector<double> prev;
+      std::vector<double> beta(nD);
+      for(size_t t=1L; t<m_nT; ++t)
+      {
+        prevalence(t-1L, prev);
+        for(int d=0L; d<nD; ++d)
+        {
+          beta[d] = 1.0 - (1.0 - m_beta_freq[d] * prev[d]) * (1.0 - m_beta_const[d]);
+        }
+        parallel_blocks(m_nPat, nD*m_nS, activeThreads(), [&](const size_t /* block */, const size_t from, const size_t to)
+        {
+          for(size_t p=from; p<to; ++p)
+          {
+            double* alpha = m_alpha.data() + p*m_nS;
+            transition(alpha, beta.data());
+            m_pattern_ll[p] += observe(alpha, t, p);
+          }
+        });
+      }
+
+      m_logdens = parallel_block_sum(m_nPat, 1L, activeThreads(), [&](const size_t from, const size_t to)
+      {
+        double total = 0.0;
+        for(size_t p=from; p<to; ++p)
+        {
+          total += m_counts[p] * m_pattern_ll[p];
+        }
+        return total;
+      });
+    }
+
+  public:
+    MultiDiseaseForward(const int nP, const int nT, const int nD) :
+      m_nD(nD), m_nS(numStates(nD)), m_nP(nP), m_nT(nT)
+    {
+      if(nT < 1L) throw std::runtime_error("nT must be at least 1");
+
+      // Until data is added every animal has the all-negative history:
+      m_data.resize(m_nPat, m_nT);
+      m_missing.resize(m_nPat, m_nT);
+      m_counts.resize(m_nPat, static_cast<double>(m_nP));
+      m_pattern_index.resize(m_nP, 0L);
+      m_pattern_ll.resize(m_nPat, NAN);
+      countActive(std::vector<std::vector<char>>(m_nPat, std::vector<char>(m_nT, 0L)));
+
+      setRates({ 0.1 }, { 0.1 }, { 0.0 }, { 0.1 });
+      setTestPars({ 0.99, 0.99 });
+    }
+
+    // Test results as an nP x nT column-major buffer, as for an R matrix,
+    // with himm_na_result for a missing test
+    void addDataBuffer(const int* data)
+    {
+      // Each test as 0, 1, or 2 if missing:
+      std::vector<std::vector<char>> rows(m_nP);
+      for(size_t i=0L; i<m_nP; ++i)
+      {
+        rows[i].resize(m_nT);
+        for(size_t t=0L; t<m_nT; ++t)
+        {
+          const int y = data[i + t*m_nP];
+          if(y != 0L && y != 1L && y != himm_na_result) throw std::runtime_error("Test results must be 0, 1 or NA");
+          rows[i][t] = y == himm_na_result ? 2L : y;
+        }
+      }
+
+      std::vector<std::vector<char>> patterns;
+      compress_patterns(rows, patterns, m_counts, m_pattern_index);
+      m_nPat = patterns.size();
+
+      m_data.resize(m_nPat, m_nT);
+      m_missing.resize(m_nPat, m_nT);
+      for(size_t p=0L; p<m_nPat; ++p)
+      {
+        for(size_t t=0L; t<m_nT; ++t)
+        {
+          m_data.set(t, p, patterns[p][t] == 1L);
+          m_missing.set(t, p, patterns[p][t] == 2L);
+        }
+      }
+      m_pattern_ll.assign(m_nPat, NAN);
+      countActive(patterns);
+      clearCache();
+    }
+
+    void setRates(const std::vector<double>& prv1, const std::vector<double>& beta_const,
+                  const std::vector<double>& beta_freq, const std::vector<double>& gamm)
+    {
+      m_p1 = perDisease(prv1, "p1");
+      m_beta_const = perDisease(beta_const, "beta_const");
+      m_beta_freq = perDisease(beta_freq, "beta_freq");
+      m_gamma = perDisease(gamm, "gamma");
+      for(int d=0L; d<m_nD; ++d)
+      {
+        if(m_beta_freq[d] < 0.0 || m_beta_freq[d] > 1.0) throw std::runtime_error("Invalid beta_freq");
+      }
+
+      m_init.assign(m_nS, 1.0);
+      for(int s=0L; s<m_nS; ++s)
+      {
+        for(int d=0L; d<m_nD; ++d)
+        {
+          m_init[s] *= (s & (1L << d)) ? m_p1[d] : (1.0 - m_p1[d]);
+        }
+      }
+    }
+
+    void setTestPars(const std::vector<double>& test_pars)
+    {
+      if(test_pars.size() != 2L && test_pars.size() != static_cast<size_t>(2L*m_nD))
+      {
+        throw std::runtime_error("Test parameters must be se and sp, each of length 1 or nD");
+      }
+      const size_t n = test_pars.size() / 2L;
+      m_se = perDisease(std::vector<double>(test_pars.begin(), test_pars.begin() + n), "se");
+      m_sp = perDisease(std::vector<double>(test_pars.begin() + n, test_pars.end()), "sp");
+
+      m_emission[0L].assign(m_nS, 1.0);
+      m_emission[1L].resize(m_nS);
+      for(int s=0L; s<m_nS; ++s)
+      {
+        for(int d=0L; d<m_nD; ++d)
+        {
+          m_emission[0L][s] *= (s & (1L << d)) ? (1.0 - m_se[d]) : m_sp[d];
+        }
+        m_emission[1L][s] = 1.0 - m_emission[0L][s];
+      }
+    }
+
+    void calculate()
+    {
+      for(int d=0L; d<m_nD; ++d)
+      {
+        if(m_beta_freq[d] != 0.0)
+        {
+          calculateFrequency();
+          return;
+        }
+      }
+
+      // Each unique history is evaluated once and weighted by its count:
+      m_logdens = parallel_block_sum(m_nPat, m_nT*m_nD*m_nS, activeThreads(), [&](const size_t from, const size_t to)
+      {
+        return forwardBlock(from, to);
+      });
+    }
+
+    // The six dhimm parameters are shared between diseases, so there is
+    // no analytic gradient:
+    double calculateWithGradient(std::array<double, 6L>& /* gradient */)
+    {
+      gradient_unsupported("the multi-disease model");
+    }
+
+    void show()
+    {
+      printf("hello from MultiDiseaseForward with nD=%i\n", m_nD);
+    }
+
+    int getND() const
+    {
+      return m_nD;
+    }
+
+    int getNumPatterns() const
+    {
+      return m_nPat;
+    }
+
+    size_t getNumAnimals() const
+    {
+      return m_nP;
+    }
+
+    size_t getNumTimepoints() const
+    {
+      return m_nT;
+    }
+
+    void animalLogLik(double* out) const
+    {
+      for(size_t i=0L; i<m_nP; ++i)
+      {
+        out[i] = m_pattern_ll[m_pattern_index[i]];
+      }
+    }
+
+    double logDensity()
+    {
+      return m_logdens;
+    }
+
+    ~MultiDiseaseForward()
+    {
+
+    }
+
+};
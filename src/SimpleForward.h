@@ -1,143 +1,1387 @@
-#include <Rcpp.h>
+#include <algorithm>
 #include <array>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <map>
 #include <math.h>
+#include <stdexcept>
+#include <tuple>
+#include <utility>
 
 #include "Himm.h"
+#include "pattern_storage.h"
+#include "forward_kernels.h"
 
 class SimpleForward : public Himm
 {
   private:
-    std::vector<bool> m_data;
-    std::vector<double> m_seprob;
-    std::vector<double> m_spprob;
+    // Test results of an animal from its first to its last record (a
+    // bitmask of the results of each test, or missing_test for NA), with the time point of the first record.  The
+    // latent process runs over all nT time points, but as the time points
+    // outside the records carry no information they are never stored or
+    // visited by calculate.
+    typedef std::pair<int, std::vector<std::uint8_t>> TestHistory;
+
+    // Unique combinations of rate group and test history (patterns), their
+    // multiplicity, and the pattern used by each animal.  Patterns are
+    // sorted by decreasing length, so observations are bit-packed
+    // time-major for the SIMD kernel with time point t holding only the
+    // patterns still running (compressed sparse rows), and missing tests
+    // are flagged in m_missing with the same layout (see packPatterns):
+    PackedObservations m_data;
+    PackedObservations m_missing;
+    std::vector<double> m_counts;
+    std::vector<int> m_pattern_index;
+    std::vector<size_t> m_pattern_entry;
+    std::vector<size_t> m_pattern_length;
+    std::vector<int> m_pattern_history;
+    size_t m_nPat = 1L;
+    bool m_packed = false;
+
+    // Runs of patterns [m_run_start[r], m_run_start[r+1]) with the same
+    // length, rate group, first time point and (non-)missing tests, which
+    // the kernels process together:
+    std::vector<size_t> m_run_start;
+    std::vector<int> m_run_group;
+    std::vector<size_t> m_run_entry;
+    std::vector<size_t> m_run_length;
+    std::vector<bool> m_run_masked;
+    size_t m_max_entry = 0L;
+    // Number of animals between their first and last records at each time
+    // point, over which the mean-field prevalence is taken:
+    std::vector<double> m_active_count;
+
+    // Unique test histories and the history of each animal:
+    std::vector<TestHistory> m_histories;
+    std::vector<bool> m_history_masked;
+    std::vector<int> m_history_index;
+
+    // Animals with the same p1, beta_const and gamma share a rate group,
+    // with the values taken from the first animal in the group:
+    std::vector<int> m_animal_group;
+    std::vector<int> m_group_first;
+    std::vector<double> m_group_p1;
+    std::vector<double> m_group_beta;
+    std::vector<double> m_group_gamma;
+    // Seasonal beta_const and gamma for the step into each time point (see
+    // seasonal_steps), shared by all animals and replacing the values of
+    // the rate groups, or empty if constant:
+    std::vector<double> m_seasonal_beta;
+    std::vector<double> m_seasonal_gamma;
+    size_t m_seasonal_beta_period = 0L;
+    size_t m_seasonal_gamma_period = 0L;
+    std::vector<TwoStateLogPars> m_group_lp;
+    std::vector<TwoStateLinPars> m_group_lin;
+    std::vector<int> m_group_interval;
+    // Prior probability of infection of each rate group at time points
+    // 0..m_max_entry (index g*(m_max_entry+1) + t), for constant rates:
+    std::vector<double> m_entry_prob;
+
+    std::vector<double> m_pattern_ll;
+    // Forward messages for the lockstep (frequency-dependent) pass, with
+    // the infection probability on entry and log transition probabilities
+    // of each rate group at the current step:
+    std::vector<double> m_logalpha0;
+    std::vector<double> m_logalpha1;
+    std::vector<double> m_step_entry;
+    std::vector<TwoStateLogPars> m_step_lp;
+    // Filtered probabilities of infection p(z_t = 1 | y_1..t) of every
+    // pattern (time-major) and the infection probability of each rate group
+    // at each step, kept for sampling until the parameters change:
+    std::vector<double> m_filtered;
+    std::vector<double> m_step_beta;
+    std::vector<double> m_step_gamma;
+    bool m_filter_valid = false;
+    // State of every animal at the last time point for the current
+    // parameters and data, for appendTimepoint:  the filtered probability
+    // of infection (carried on without emissions after its last record),
+    // its log-likelihood so far, and the mean-field prevalence:
+    std::vector<double> m_online_filtered;
+    std::vector<double> m_online_ll;
+    double m_online_prevalence = 0.0;
+    bool m_online_valid = false;
+    // Smoothing stores every forward message unless checkpoints are asked
+    // for, which only pays when nT x nP messages would not fit in memory:
+    bool m_smooth_checkpoints = false;
+    bool m_use_simd = true;
+    bool m_use_scaled = false;
     /*
     std::array<bool, 200L> m_data;
     std::array<double, 200L> m_seprob;
     std::array<double, 200L> m_spprob;
     */
 
-    double m_p1 = 0.1;
-    double m_beta_const = 0.1;
-    double m_gamma = 0.1;
+    double m_beta_freq = 0.0;
 
     double m_se = -1.0;
     double m_sp = -1.0;
+    // Number of tests per time point, with the se and sp of each if more
+    // than one (m_se and m_sp are those of the first):
+    int m_tests = 1L;
+    std::vector<double> m_test_se;
+    std::vector<double> m_test_sp;
 
     const size_t m_nP;
-    const size_t m_nT;
+    // Grows with appendTimepoint:
+    size_t m_nT;
     double m_logdens = 0.0;
 
+    // Patterns from the rate group and history of each animal, in
+    // O(nP log nPat):  the observations are only packed by packPatterns,
+    // before they are next needed
+    void buildPatterns()
+    {
+      // Keyed on (-length, group, first time point, any missing, history),
+      // so that the animals are sorted by decreasing length and then by run:
+      typedef std::tuple<int, int, int, bool, int> PatternKey;
+      std::vector<std::pair<PatternKey, int>> animal_key(m_nP);
+      for(size_t i=0L; i<m_nP; ++i)
+      {
+        const TestHistory& history = m_histories[m_history_index[i]];
+        animal_key[i].first = PatternKey(-static_cast<int>(history.second.size()), m_animal_group[i], history.first,
+                                         m_history_masked[m_history_index[i]], m_history_index[i]);
+        animal_key[i].second = i;
+      }
+      std::sort(animal_key.begin(), animal_key.end());
+
+      m_nPat = 0L;
+      for(size_t k=0L; k<m_nP; ++k)
+      {
+        if(k == 0L || animal_key[k].first != animal_key[k-1L].first) m_nPat++;
+      }
+      m_pattern_entry.resize(m_nPat);
+      m_pattern_length.resize(m_nPat);
+      m_pattern_history.resize(m_nPat);
+      m_counts.assign(m_nPat, 0.0);
+      m_pattern_index.resize(m_nP);
+      m_run_start.clear();
+      m_run_group.clear();
+      m_run_entry.clear();
+      m_run_length.clear();
+      m_run_masked.clear();
+      m_max_entry = 0L;
+
+      int pt = -1L;
+      const PatternKey* last = nullptr;
+      for(const auto& entry : animal_key)
+      {
+        const PatternKey& key = entry.first;
+        if(!last || key != *last)
+        {
+          pt++;
+          const size_t length = -std::get<0L>(key);
+          const size_t first = std::get<2L>(key);
+          if(!last || std::get<0L>(key) != std::get<0L>(*last) || std::get<1L>(key) != std::get<1L>(*last) ||
+             std::get<2L>(key) != std::get<2L>(*last) || std::get<3L>(key) != std::get<3L>(*last))
+          {
+            m_run_start.push_back(pt);
+            m_run_group.push_back(std::get<1L>(key));
+            m_run_entry.push_back(first);
+            m_run_length.push_back(length);
+            m_run_masked.push_back(std::get<3L>(key));
+          }
+          last = &key;
+
+          m_pattern_entry[pt] = first;
+          m_pattern_length[pt] = length;
+          m_pattern_history[pt] = std::get<4L>(key);
+          m_max_entry = std::max(m_max_entry, first);
+        }
+        m_pattern_index[entry.second] = pt;
+        m_counts[pt] += 1.0;
+      }
+      m_run_start.push_back(m_nPat);
+
+      // From the changes in the count at the first and after the last
+      // record of each pattern:
+      m_active_count.assign(m_nT + 1L, 0.0);
+      for(size_t p=0L; p<m_nPat; ++p)
+      {
+        m_active_count[m_pattern_entry[p]] += m_counts[p];
+        m_active_count[m_pattern_entry[p] + m_pattern_length[p]] -= m_counts[p];
+      }
+      for(size_t t=1L; t<m_nT; ++t)
+      {
+        m_active_count[t] += m_active_count[t-1L];
+      }
+      m_active_count.resize(m_nT);
+
+      m_pattern_ll.assign(m_nPat, NAN);
+      m_packed = false;
+    }
+
+    // The number of tests in the data, from the packed observations if
+    // there are any
+    int dataPlanes() const
+    {
+      if(m_packed) return m_data.planes();
+
+      int planes = 1L;
+      for(size_t p=0L; p<m_nPat; ++p)
+      {
+        for(const std::uint8_t y : m_histories[m_pattern_history[p]].second)
+        {
+          while(y != missing_test && (y >> planes) != 0L) ++planes;
+        }
+      }
+      return planes;
+    }
+
+    // Observations of the patterns from buildPatterns, packed for the
+    // kernels, if not already done
+    void packPatterns()
+    {
+      if(m_packed) return;
+
+      std::vector<size_t> row_patterns(m_nT, 0L);
+      for(size_t p=0L; p<m_nPat; ++p)
+      {
+        for(size_t t=0L; t<m_pattern_length[p]; ++t)
+        {
+          row_patterns[t] = p + 1L;
+        }
+      }
+
+      m_data.resize(row_patterns, dataPlanes());
+      m_missing.resize(row_patterns);
+      for(size_t p=0L; p<m_nPat; ++p)
+      {
+        const std::vector<std::uint8_t>& tests = m_histories[m_pattern_history[p]].second;
+        for(size_t t=0L; t<tests.size(); ++t)
+        {
+          m_data.set(t, p, tests[t] == missing_test ? 0L : tests[t]);
+          if(tests[t] == missing_test) m_missing.set(t, p, true);
+        }
+      }
+      m_packed = true;
+    }
+
+    // Whether each unique history has a missing test between its first and
+    // last records
+    void findMasked()
+    {
+      m_history_masked.resize(m_histories.size());
+      for(size_t h=0L; h<m_histories.size(); ++h)
+      {
+        const std::vector<std::uint8_t>& tests = m_histories[h].second;
+        m_history_masked[h] = std::find(tests.begin(), tests.end(), missing_test) != tests.end();
+      }
+    }
+
+    // Test result of pattern p at time point t, or missing_test outside
+    // its records
+    int observation(const size_t t, const size_t p) const
+    {
+      const size_t first = m_pattern_entry[p];
+      if(t < first || t >= first + m_pattern_length[p]) return missing_test;
+      return observed_test(m_data, &m_missing, t - first, p);
+    }
+
+    bool runActive(const size_t r, const size_t t) const
+    {
+      return t >= m_run_entry[r] && t < m_run_entry[r] + m_run_length[r];
+    }
+
+    // Mean-field prevalence from the count-weighted infection probability
+    // of the animals with records spanning time point t
+    double prevalenceAt(const size_t t, const double infected) const
+    {
+      return m_active_count[t] > 0.0 ? infected / m_active_count[t] : 0.0;
+    }
+
+    // Sets a parameter, noting if the last calculation no longer applies:
+    void change(double& target, const double value)
+    {
+      if(target != value)
+      {
+        m_current = false;
+        m_filter_valid = false;
+        m_online_valid = false;
+      }
+      target = value;
+    }
+
+    void setNumTests(const int tests)
+    {
+      if(m_tests != tests)
+      {
+        m_current = false;
+        m_filter_valid = false;
+        m_online_valid = false;
+      }
+      m_tests = tests;
+    }
+
+    static std::array<std::uint64_t, 3L> rateKey(const double p1, const double beta, const double gamma)
+    {
+      const double values[3L] = { p1, beta, gamma };
+      std::array<std::uint64_t, 3L> key;
+      std::memcpy(key.data(), values, sizeof(values));
+      return key;
+    }
+
+    // Rates for each animal from arrays of length nP, or 1 if shared.  The
+    // grouping (and so the patterns) is only rebuilt if an animal no longer
+    // has the same values (bit for bit) as the first animal in its group.
+    void setGroupRates(const double* prv1, const bool vec_prv1, const double* beta_const,
+                       const bool vec_beta_const, const double* gamm, const bool vec_gamm)
+    {
+      auto key = [&](const size_t i)
+      {
+        return rateKey(prv1[vec_prv1 ? i : 0L], beta_const[vec_beta_const ? i : 0L], gamm[vec_gamm ? i : 0L]);
+      };
+
+      bool regroup;
+      if(!vec_prv1 && !vec_beta_const && !vec_gamm)
+      {
+        regroup = m_group_first.size() != 1L;
+      }
+      else
+      {
+        regroup = false;
+        for(size_t i=0L; i<m_nP && !regroup; ++i)
+        {
+          regroup = key(i) != key(m_group_first[m_animal_group[i]]);
+        }
+      }
+
+      if(regroup)
+      {
+        std::map<std::array<std::uint64_t, 3L>, int> lookup;
+        m_group_first.clear();
+        for(size_t i=0L; i<m_nP; ++i)
+        {
+          const auto found = lookup.emplace(key(i), m_group_first.size());
+          if(found.second) m_group_first.push_back(i);
+          m_animal_group[i] = found.first->second;
+        }
+        buildPatterns();
+        clearCache();
+        m_filter_valid = false;
+        m_online_valid = false;
+      }
+
+      const size_t nGroups = m_group_first.size();
+      m_group_p1.resize(nGroups);
+      m_group_beta.resize(nGroups);
+      m_group_gamma.resize(nGroups);
+      for(size_t g=0L; g<nGroups; ++g)
+      {
+        const size_t i = m_group_first[g];
+        change(m_group_p1[g], prv1[vec_prv1 ? i : 0L]);
+        change(m_group_beta[g], beta_const[vec_beta_const ? i : 0L]);
+        change(m_group_gamma[g], gamm[vec_gamm ? i : 0L]);
+      }
+    }
+
+    // Rates of group g for the step into time point t
+    double stepBetaConst(const size_t g, const size_t t) const
+    {
+      return m_seasonal_beta.empty() ? m_group_beta[g] : m_seasonal_beta[t];
+    }
+
+    double stepGamma(const size_t g, const size_t t) const
+    {
+      return m_seasonal_gamma.empty() ? m_group_gamma[g] : m_seasonal_gamma[t];
+    }
+
+    // Infection probability including frequency-dependent transmission at
+    // the given prevalence
+    double stepBeta(const size_t g, const size_t t, const double prevalence) const
+    {
+      const double beta_const = stepBetaConst(g, t);
+      return m_beta_freq != 0.0 ? 1.0 - (1.0 - m_beta_freq * prevalence) * (1.0 - beta_const) : beta_const;
+    }
+
+    bool seasonal() const
+    {
+      return !m_seasonal_beta.empty() || !m_seasonal_gamma.empty();
+    }
+
+    // Sets the values of a seasonal rate from n values (see seasonal_steps),
+    // or makes it constant if n is 0.  The period is kept so that the
+    // values carry on over time points added by appendTimepoint.
+    void setSeasonal(std::vector<double>& target, size_t& period, const double* values, const size_t n)
+    {
+      period = n;
+      if(n == 0L)
+      {
+        if(!target.empty())
+        {
+          target.clear();
+          m_current = false;
+          m_filter_valid = false;
+          m_online_valid = false;
+        }
+        return;
+      }
+
+      std::vector<double> steps(m_nT);
+      seasonal_steps(values, n, m_nT, steps.data());
+      if(target.size() != m_nT) target.assign(m_nT, NAN);
+      for(size_t t=0L; t<m_nT; ++t)
+      {
+        change(target[t], steps[t]);
+      }
+    }
+
+    // Calls f(run, from, to) for each run of patterns within [from, to)
+    template<class F>
+    void forRuns(size_t from, const size_t to, F f) const
+    {
+      size_t r = std::upper_bound(m_run_start.begin(), m_run_start.end(), from) - m_run_start.begin() - 1L;
+      while(from < to)
+      {
+        const size_t end = std::min(to, m_run_start[r+1L]);
+        f(r, from, end);
+        from = end;
+        ++r;
+      }
+    }
+
+    // Forward filtering in linear space of p(z_t = 1 | y_1..t) for every
+    // pattern over all nT time points (with no emission outside the
+    // records), with the same mean-field prevalence as calculateFrequency
+    // when beta_freq is non-zero, and the resulting infection probability
+    // of each rate group at each step in m_step_beta (with the recovery
+    // probability in m_step_gamma).  All time points are
+    // kept in m_filtered if keep_all, and otherwise only the last two.
+    void filterStates(const bool keep_all)
+    {
+      packPatterns();
+      const size_t nGroups = m_group_first.size();
+      m_filtered.resize((keep_all ? m_nT : 2L)*m_nPat);
+      m_step_beta.resize(m_nT*nGroups);
+      m_step_gamma.resize(m_nT*nGroups);
+      auto row = [&](const size_t t)
+      {
+        return m_filtered.data() + (keep_all ? t : t % 2L)*m_nPat;
+      };
+
+      std::array<double, missing_test + 1L> em0, em1;
+      testProbabilities(em0.data(), em1.data());
+      auto posterior = [&](const double pred, const int y)
+      {
+        if(y == missing_test) return pred;
+        const double a1 = pred * em1[y];
+        const double a0 = (1.0 - pred) * em0[y];
+        return a1 / (a0 + a1);
+      };
+
+      double infected = 0.0;
+      forRuns(0L, m_nPat, [&](const size_t r, const size_t from, const size_t to)
+      {
+        const bool active = runActive(r, 0L);
+        for(size_t p=from; p<to; ++p)
+        {
+          m_filtered[p] = posterior(m_group_p1[m_run_group[r]], observation(0L, p));
+          if(active) infected += m_counts[p] * m_filtered[p];
+        }
+      });
+      double prevalence = prevalenceAt(0L, infected);
+
+      for(size_t t=1L; t<m_nT; ++t)
+      {
+        for(size_t g=0L; g<nGroups; ++g)
+        {
+          m_step_beta[t*nGroups + g] = stepBeta(g, t, prevalence);
+          m_step_gamma[t*nGroups + g] = stepGamma(g, t);
+        }
+
+        const double* last = row(t-1L);
+        double* current = row(t);
+        infected = 0.0;
+        forRuns(0L, m_nPat, [&](const size_t r, const size_t from, const size_t to)
+        {
+          const size_t g = m_run_group[r];
+          const double beta = m_step_beta[t*nGroups + g];
+          const double gamma = m_step_gamma[t*nGroups + g];
+          const bool active = runActive(r, t);
+          for(size_t p=from; p<to; ++p)
+          {
+            const double pred = last[p] * (1.0 - gamma) + (1.0 - last[p]) * beta;
+            current[p] = posterior(pred, observation(t, p));
+            if(active) infected += m_counts[p] * current[p];
+          }
+        });
+        prevalence = prevalenceAt(t, infected);
+      }
+
+      m_filter_valid = keep_all;
+    }
+
+    // The state of each animal at the last time point for appendTimepoint,
+    // from the filtered probabilities of its pattern and the log-likelihood
+    // of the last calculation
+    void makeOnlineState()
+    {
+      if(!m_filter_valid) filterStates(false);
+      const double* last = m_filtered.data() + (m_filter_valid ? m_nT-1L : (m_nT-1L) % 2L)*m_nPat;
+
+      m_online_filtered.resize(m_nP);
+      m_online_ll.resize(m_nP);
+      double infected = 0.0;
+      for(size_t i=0L; i<m_nP; ++i)
+      {
+        const size_t p = m_pattern_index[i];
+        m_online_filtered[i] = last[p];
+        m_online_ll[i] = m_pattern_ll[p];
+        if(m_pattern_length[p] > 0L && m_pattern_entry[p] + m_pattern_length[p] == m_nT) infected += last[p];
+      }
+      m_online_prevalence = prevalenceAt(m_nT-1L, infected);
+      m_online_valid = true;
+    }
+
+    // Probability of each combination of test results given the latent
+    // state (1 for missing_test)
+    void testProbabilities(double* em0, double* em1) const
+    {
+      checkNumTests();
+      for(int y=0L; y<(1L << m_tests); ++y)
+      {
+        em0[y] = 1.0;
+        em1[y] = 1.0;
+        for(int k=0L; k<m_tests; ++k)
+        {
+          const bool positive = (y >> k) & 1L;
+          const double se = m_tests > 1L ? m_test_se[k] : m_se;
+          const double sp = m_tests > 1L ? m_test_sp[k] : m_sp;
+          em0[y] *= positive ? 1.0 - sp : sp;
+          em1[y] *= positive ? se : 1.0 - se;
+        }
+      }
+      em0[missing_test] = 1.0;
+      em1[missing_test] = 1.0;
+    }
+
+    void makeGroupPars()
+    {
+      checkNumTests();
+
+      const size_t nGroups = m_group_first.size();
+      m_group_lp.resize(nGroups);
+      m_group_lin.resize(nGroups);
+      m_group_interval.resize(nGroups);
+      for(size_t g=0L; g<nGroups; ++g)
+      {
+        m_group_lp[g] = make_log_pars(m_group_p1[g], m_group_beta[g], m_group_gamma[g], m_se, m_sp);
+        m_group_lin[g] = make_lin_pars(m_group_p1[g], m_group_beta[g], m_group_gamma[g], m_se, m_sp);
+        m_group_interval[g] = (m_use_scaled && m_tests == 1L) ? scaled_interval(m_group_lin[g]) : 0L;
+        if(m_tests > 1L) set_test_emissions(m_group_lp[g], m_tests, m_test_se.data(), m_test_sp.data());
+      }
+
+      // Patterns whose first record is at time point t start from the
+      // infection probability at t under the transitions alone:
+      m_entry_prob.resize(nGroups*(m_max_entry + 1L));
+      for(size_t g=0L; g<nGroups; ++g)
+      {
+        double q = m_group_p1[g];
+        for(size_t t=0L; t<=m_max_entry; ++t)
+        {
+          if(t > 0L) q = q * (1.0 - stepGamma(g, t)) + (1.0 - q) * stepBetaConst(g, t);
+          m_entry_prob[g*(m_max_entry + 1L) + t] = q;
+        }
+      }
+    }
+
+    // Parameters of run r, starting from the entry probability if its first
+    // record is after the first time point
+    TwoStateLogPars runLogPars(const size_t r) const
+    {
+      TwoStateLogPars lp = m_group_lp[m_run_group[r]];
+      if(m_run_entry[r] > 0L)
+      {
+        const double q = m_entry_prob[m_run_group[r]*(m_max_entry + 1L) + m_run_entry[r]];
+        lp.p1 = std::log(q);
+        lp.p1m = std::log1p(-q);
+      }
+      return lp;
+    }
+
+    TwoStateLinPars runLinPars(const size_t r) const
+    {
+      TwoStateLinPars lin = m_group_lin[m_run_group[r]];
+      if(m_run_entry[r] > 0L)
+      {
+        lin.p1 = m_entry_prob[m_run_group[r]*(m_max_entry + 1L) + m_run_entry[r]];
+        lin.p1m = 1.0 - lin.p1;
+      }
+      return lin;
+    }
+
+    static std::uint8_t testResult(const int y)
+    {
+      if(y == himm_na_result) return missing_test;
+      if(y < 0L || y >= (1L << max_tests)) throw std::runtime_error("Test results must be bitmasks of at most 4 tests (or NA)");
+      return y;
+    }
+
   public:
     SimpleForward(const int nP, const int nT) :
       m_nP(nP), m_nT(nT)
     {
-      m_data.resize(m_nP*m_nT);
-      m_seprob.resize(m_nP*m_nT);
-      m_spprob.resize(m_nP*m_nT);
+      // Until data is added every animal has the all-negative history, and
+      // all animals share the same rates:
+      m_histories.assign(1L, TestHistory(0L, std::vector<std::uint8_t>(m_nT, 0L)));
+      m_history_masked.assign(1L, false);
+      m_history_index.assign(m_nP, 0L);
+      m_animal_group.assign(m_nP, 0L);
+      m_group_first.assign(1L, 0L);
+      m_group_p1.assign(1L, 0.1);
+      m_group_beta.assign(1L, 0.1);
+      m_group_gamma.assign(1L, 0.1);
+      buildPatterns();
     }
 
-    void addData(Rcpp::IntegerMatrix data)
+    // Test results as an nP x nT column-major buffer, as for an R matrix,
+    // with himm_na_result for a missing test:  the records of each animal run
+    // from its first to its last non-missing test.  With several tests per
+    // time point each result is a bitmask (bit k positive for test k+1).
+    void addDataBuffer(const int* data)
     {
-      if(data.ncol()!=m_nT) Rcpp::stop("Wrong col dim");
-      if(data.nrow()!=m_nP) Rcpp::stop("Wrong row dim");
+      std::vector<TestHistory> rows(m_nP);
+      for(size_t i=0L; i<m_nP; ++i)
+      {
+        size_t first = 0L;
+        size_t end = m_nT;
+        while(first < end && data[i + first*m_nP] == himm_na_result) ++first;
+        while(end > first && data[i + (end-1L)*m_nP] == himm_na_result) --end;
 
-      for(int i=0L; i<m_nP; ++i)
+        rows[i].first = first < end ? first : 0L;
+        rows[i].second.resize(end - first);
+        for(size_t t=first; t<end; ++t)
+        {
+          rows[i].second[t - first] = testResult(data[i + t*m_nP]);
+        }
+      }
+
+      setHistories(rows);
+    }
+
+    // Test records in long format (1-based animal and time point, result
+    // NA for a missing test), so that nothing of size nP x nT is needed.
+    // Time points between the first and last records of an animal without
+    // a record are missing, and later records replace earlier duplicates.
+    void addRecordBuffer(const int* animal, const int* time, const int* result, const size_t nR)
+    {
+      std::vector<int> first(m_nP, m_nT);
+      std::vector<int> last(m_nP, -1L);
+      for(size_t k=0L; k<nR; ++k)
+      {
+        if(animal[k] < 1L || animal[k] > static_cast<int>(m_nP)) throw std::runtime_error("animal out of range");
+        if(time[k] < 1L || time[k] > static_cast<int>(m_nT)) throw std::runtime_error("time out of range");
+        if(result[k] == himm_na_result) continue;
+        const int i = animal[k] - 1L;
+        first[i] = std::min<int>(first[i], time[k] - 1L);
+        last[i] = std::max<int>(last[i], time[k] - 1L);
+      }
+
+      std::vector<TestHistory> rows(m_nP);
+      for(size_t i=0L; i<m_nP; ++i)
+      {
+        if(last[i] < first[i]) continue;
+        rows[i].first = first[i];
+        rows[i].second.assign(last[i] - first[i] + 1L, missing_test);
+      }
+      for(size_t k=0L; k<nR; ++k)
+      {
+        if(result[k] == himm_na_result) continue;
+        const int i = animal[k] - 1L;
+        rows[i].second[time[k] - 1L - first[i]] = testResult(result[k]);
+      }
+
+      setHistories(rows);
+    }
+
+    void setHistories(const std::vector<TestHistory>& rows)
+    {
+      std::vector<double> counts;
+      compress_patterns(rows, m_histories, counts, m_history_index);
+      findMasked();
+
+      buildPatterns();
+      clearCache();
+      m_filter_valid = false;
+      m_online_valid = false;
+    }
+
+    // Adds a time point with the result of each animal (NA if not tested),
+    // so that e.g. a new test round is added without re-reading the data.
+    // If the last calculation holds for the current parameters, the new
+    // log density follows from the state of each animal at the last time
+    // point, in O(nP log nP) for the new patterns rather than O(nP nT), and
+    // otherwise everything is recalculated.  With
+    // frequency-dependent transmission, a new record after a gap in the
+    // records of an animal changes the prevalence at earlier time points,
+    // so this also needs a full calculation.  The whole time point is
+    // checked before anything changes, so a bad result leaves the data and
+    // the last calculation as they were.
+    void appendTimepointBuffer(const int* results)
+    {
+      checkTimepoint(results);
+
+      const size_t T = m_nT;
+      std::vector<std::uint8_t> y(m_nP);
+      std::vector<bool> kept(m_histories.size(), false);
+      bool gap = false;
+      for(size_t i=0L; i<m_nP; ++i)
+      {
+        y[i] = testResult(results[i]);
+        const TestHistory& history = m_histories[m_history_index[i]];
+        if(y[i] == missing_test) kept[m_history_index[i]] = true;
+        else if(!history.second.empty() && history.first + history.second.size() < T) gap = true;
+      }
+      const bool incremental = m_current && !(m_beta_freq != 0.0 && gap);
+      if(incremental && !m_online_valid) makeOnlineState();
+
+      // Animals with the same history and new result share the extended
+      // history, which replaces the old one in place if no animal keeps it
+      auto extend = [&](const int h, const std::uint8_t result)
+      {
+        TestHistory& history = m_histories[h];
+        if(history.second.empty()) history.first = T;
+        if(history.first + history.second.size() < T) m_history_masked[h] = true;
+        history.second.resize(T - history.first, missing_test);
+        history.second.push_back(result);
+      };
+      // (the first result for each history in a table, and any others in
+      // a map):
+      std::vector<int> first_target(m_histories.size(), -1L);
+      std::vector<std::uint8_t> first_result(m_histories.size());
+      std::map<std::pair<int, std::uint8_t>, int> other_target;
+      std::vector<std::pair<int, std::uint8_t>> to_extend;
+      for(size_t i=0L; i<m_nP; ++i)
       {
-        for(int t=0L; t<m_nT; ++t)
+        if(y[i] == missing_test) continue;
+        const int h = m_history_index[i];
+        int* target = &first_target[h];
+        if(*target >= 0L && first_result[h] != y[i]) target = &other_target.emplace(std::make_pair(h, y[i]), -1L).first->second;
+        if(*target < 0L)
         {
-          m_data[m_nT*i + t] = data(i,t) == 1L;
+          if(first_target[h] < 0L) first_result[h] = y[i];
+          if(kept[h])
+          {
+            *target = m_histories.size();
+            m_histories.push_back(m_histories[h]);
+            m_history_masked.push_back(m_history_masked[h]);
+          }
+          else
+          {
+            kept[h] = true;
+            *target = h;
+          }
+          to_extend.push_back(std::make_pair(*target, y[i]));
+        }
+        m_history_index[i] = *target;
+      }
+      for(const auto& entry : to_extend)
+      {
+        extend(entry.first, entry.second);
+      }
+
+      m_nT++;
+      if(!m_seasonal_beta.empty()) m_seasonal_beta.push_back(m_seasonal_beta[T - m_seasonal_beta_period]);
+      if(!m_seasonal_gamma.empty()) m_seasonal_gamma.push_back(m_seasonal_gamma[T - m_seasonal_gamma_period]);
+      buildPatterns();
+      clearCache();
+      m_filter_valid = false;
+
+      if(!incremental)
+      {
+        m_online_valid = false;
+        calculate();
+        return;
+      }
+
+      // One forward step for every animal from its state at T-1:
+      std::array<double, missing_test + 1L> em0, em1;
+      testProbabilities(em0.data(), em1.data());
+      const size_t nGroups = m_group_first.size();
+      std::vector<double> step_beta(nGroups), step_gamma(nGroups);
+      for(size_t g=0L; g<nGroups; ++g)
+      {
+        step_beta[g] = stepBeta(g, T, m_online_prevalence);
+        step_gamma[g] = stepGamma(g, T);
+      }
+      double infected = 0.0;
+      for(size_t i=0L; i<m_nP; ++i)
+      {
+        const double beta = step_beta[m_animal_group[i]];
+        const double gamma = step_gamma[m_animal_group[i]];
+        double& f = m_online_filtered[i];
+        const double pred = f * (1.0 - gamma) + (1.0 - f) * beta;
+        if(y[i] == missing_test)
+        {
+          f = pred;
+          continue;
         }
+        const double a1 = pred * em1[y[i]];
+        const double a0 = (1.0 - pred) * em0[y[i]];
+        m_online_ll[i] += std::log(a0 + a1);
+        f = a1 / (a0 + a1);
+        infected += f;
+      }
+      m_online_prevalence = prevalenceAt(T, infected);
+
+      for(size_t i=0L; i<m_nP; ++i)
+      {
+        m_pattern_ll[m_pattern_index[i]] = m_online_ll[i];
       }
+      m_logdens = 0.0;
+      for(size_t p=0L; p<m_nPat; ++p)
+      {
+        m_logdens += m_counts[p] * m_pattern_ll[p];
+      }
+      m_current = true;
+    }
+
+    size_t getNumTimepoints() const
+    {
+      return m_nT;
     }
 
-    void setRates(const std::vector<double> prv1, const std::vector<double> beta_const,
-                  const std::vector<double> beta_freq, const std::vector<double> gamm)
+    int getNumPatterns() const
     {
-      if(beta_freq[0L]!=0.0)
+      return m_nPat;
+    }
+
+    int getNumRateGroups() const
+    {
+      return m_group_first.size();
+    }
+
+    std::vector<double> getPatternCounts() const
+    {
+      return m_counts;
+    }
+
+    size_t getNumAnimals() const
+    {
+      return m_nP;
+    }
+
+    void animalLogLik(double* out) const
+    {
+      for(size_t i=0L; i<m_nP; ++i)
       {
-        Rcpp::Rcout << "Note: invalid non-zero beta_freq" << std::endl;
-        Rcpp::stop("Invalid non-zero beta_freq");
+        out[i] = m_pattern_ll[m_pattern_index[i]];
       }
+    }
 
-      m_p1 = prv1[0L];
-      m_beta_const = beta_const[0L];
-      m_gamma = gamm[0L];
+    bool getSmoothCheckpoints() const
+    {
+      return m_smooth_checkpoints;
+    }
+
+    void setSmoothCheckpoints(const bool smooth_checkpoints)
+    {
+      m_smooth_checkpoints = smooth_checkpoints;
+    }
+
+    // Posterior probability of infection of each animal at each time point
+    // given all of its data, by forward-backward smoothing of each unique
+    // pattern.  With checkpoints the forward messages are only stored
+    // every sqrt(nT) time points (see smooth_sequence).
+    size_t smoothValues() const
+    {
+      return 1L;
     }
 
-    void setTestPars(const std::vector<double> test_pars)
+    void smooth(double* rv)
     {
-      if(std::abs(m_se - test_pars[0L]) > 0.0001 || std::abs(m_sp - test_pars[1L]) > 0.0001)
+      packPatterns();
+      if(!m_filter_valid) filterStates(false);
+
+      const size_t nGroups = m_group_first.size();
+      const size_t interval = m_smooth_checkpoints ? smooth_checkpoint_interval(m_nT) : 1L;
+      std::array<double, missing_test + 1L> em0, em1;
+      testProbabilities(em0.data(), em1.data());
+      std::vector<double> marginal(m_nPat*m_nT);
+      parallel_blocks(m_nPat, 6L*m_nT, activeThreads(), [&](const size_t /* block */, const size_t from, const size_t to)
       {
-        m_se = test_pars[0L];
-        m_sp = test_pars[1L];
+        std::vector<double> work;
+        std::vector<double> out(2L*m_nT);
+        forRuns(from, to, [&](const size_t r, const size_t run_from, const size_t run_to)
+        {
+          const size_t g = m_run_group[r];
+          const double p1 = m_group_p1[g];
+          const double* step_beta = m_step_beta.data() + g;
+          const double* step_gamma = m_step_gamma.data() + g;
+          for(size_t p=run_from; p<run_to; ++p)
+          {
+            auto emit = [&](const size_t t, double* x)
+            {
+              const int y = observation(t, p);
+              if(y == missing_test) return;
+              x[0L] *= em0[y];
+              x[1L] *= em1[y];
+            };
+            auto init = [&](double* alpha)
+            {
+              alpha[0L] = 1.0 - p1;
+              alpha[1L] = p1;
+              emit(0L, alpha);
+            };
+            auto step = [&](const size_t t, double* alpha)
+            {
+              const double beta = step_beta[t*nGroups];
+              const double gamma = step_gamma[t*nGroups];
+              const double a0 = alpha[0L];
+              const double a1 = alpha[1L];
+              alpha[0L] = a0 * (1.0 - beta) + a1 * gamma;
+              alpha[1L] = a0 * beta + a1 * (1.0 - gamma);
+              emit(t, alpha);
+            };
+            auto back = [&](const size_t t, double* b)
+            {
+              const double beta = step_beta[t*nGroups];
+              const double gamma = step_gamma[t*nGroups];
+              emit(t, b);
+              const double b0 = b[0L];
+              const double b1 = b[1L];
+              b[0L] = b0 * (1.0 - beta) + b1 * beta;
+              b[1L] = b0 * gamma + b1 * (1.0 - gamma);
+            };
+            smooth_sequence(m_nT, 2L, interval, work, out.data(), init, step, back);
 
-        const double sp = std::log(m_sp);
-        const double sp1m = log1m(m_sp);
-        const double se = std::log(m_se);
-        const double se1m = log1m(m_se);
+            for(size_t t=0L; t<m_nT; ++t)
+            {
+              marginal[p*m_nT + t] = out[2L*t + 1L];
+            }
+          }
+        });
+      });
 
-        for(size_t i=0L; i<m_seprob.size(); ++i)
+      for(size_t i=0L; i<m_nP; ++i)
+      {
+        const double* pm = marginal.data() + m_pattern_index[i]*m_nT;
+        for(size_t t=0L; t<m_nT; ++t)
         {
-          m_seprob[i] = m_data[i] ? se : se1m;
-          m_spprob[i] = m_data[i] ? sp1m : sp;
+          rv[i + t*m_nP] = pm[t];
         }
+      }
+    }
+
+    // Forward filtering, backward sampling:  the filtered probabilities are
+    // shared by animals with the same pattern and re-used between draws
+    // until the parameters change, so each draw costs O(nP nT)
+    void samplePaths(PackedObservations& paths, const std::function<double()>& uniform)
+    {
+      if(!m_filter_valid) filterStates(true);
 
+      const size_t nGroups = m_group_first.size();
+      paths.resize(m_nP, m_nT);
+      for(size_t i=0L; i<m_nP; ++i)
+      {
+        const size_t p = m_pattern_index[i];
+        const size_t g = m_animal_group[i];
+
+        bool z = uniform() < m_filtered[(m_nT-1L)*m_nPat + p];
+        paths.set(m_nT-1L, i, z);
+        for(size_t t=m_nT-1L; t>0L; --t)
+        {
+          const double f = m_filtered[(t-1L)*m_nPat + p];
+          const double beta = m_step_beta[t*nGroups + g];
+          const double gamma = m_step_gamma[t*nGroups + g];
+          const double w1 = f * (z ? 1.0 - gamma : gamma);
+          const double w0 = (1.0 - f) * (z ? beta : 1.0 - beta);
+          z = uniform() * (w0 + w1) < w1;
+          paths.set(t-1L, i, z);
+        }
       }
     }
 
-    double log1m(const double p)
+    bool getSimd() const
     {
-      return std::log1p(-p);
+      return m_use_simd;
     }
 
-    double log_sum_exp(const double u, const double v)
+    // The kernels can differ in the last bits, so the cache is cleared:
+    void setSimd(const bool use_simd)
     {
-      const double m = std::max(u, v);
-      return m + std::log(std::exp(u - m) + std::exp(v - m));
+      m_use_simd = use_simd;
+      clearCache();
     }
 
-    void calculate()
+    bool getScaled() const
+    {
+      return m_use_scaled;
+    }
+
+    void setScaled(const bool use_scaled)
     {
+      m_use_scaled = use_scaled;
+      clearCache();
+    }
 
-      const double p1 = std::log(m_p1);
-      const double p1m = log1m(m_p1);
-      const double be = std::log(m_beta_const);
-      const double be1m = log1m(m_beta_const);
-      const double ga = std::log(m_gamma);
-      const double ga1m = log1m(m_gamma);
+    // Renormalisation interval of the scaled kernel for the current
+    // parameters (of the first rate group), or 0 if the log-space kernel
+    // is being used:
+    int getScaledInterval() const
+    {
+      return (m_use_scaled && m_tests == 1L) ? scaled_interval(make_lin_pars(m_group_p1[0L], m_group_beta[0L], m_group_gamma[0L], m_se, m_sp)) : 0L;
+    }
 
-      m_logdens = 0.0;
+    int getSimdLanes() const
+    {
+      return m_use_simd ? forward_simd_lanes() : 0L;
+    }
 
-      size_t i=0L;
-      for(size_t p=0L; p<m_nP; ++p)
+    // prv1, beta_const and gamm may have length 1 or nP (one per animal),
+    // and beta_const and gamm may also be seasonal with any other length up
+    // to nT (one per step, repeated with that period; see seasonal_steps)
+    void setRates(const std::vector<double>& prv1, const std::vector<double>& beta_const,
+                  const std::vector<double>& beta_freq, const std::vector<double>& gamm)
+    {
+      if(beta_freq.size() != 1L) throw std::runtime_error("beta_freq must have length 1");
+      setRateArrays(prv1.data(), prv1.size(), beta_const.data(), beta_const.size(),
+                    beta_freq[0L], gamm.data(), gamm.size());
+    }
+
+    void setRateArrays(const double* prv1, const size_t n_prv1, const double* beta_const,
+                       const size_t n_beta_const, const double beta_freq,
+                       const double* gamm, const size_t n_gamm)
+    {
+      if(beta_freq < 0.0 || beta_freq > 1.0) throw std::runtime_error("Invalid beta_freq");
+      auto per_animal = [&](const size_t n)
       {
-        std::array<double, 2L> logalpha;
-        logalpha[0L] = p1m + m_spprob[i];
-        logalpha[1L] = p1 + m_seprob[i];
+        return n != 1L && n == m_nP;
+      };
+      auto is_seasonal = [&](const size_t n)
+      {
+        return n != 1L && n != m_nP;
+      };
+      if(is_seasonal(n_prv1)) throw std::runtime_error("prv1 must have length 1 or nP");
+      if((is_seasonal(n_beta_const) && (n_beta_const == 0L || n_beta_const > m_nT)) ||
+         (is_seasonal(n_gamm) && (n_gamm == 0L || n_gamm > m_nT)))
+      {
+        throw std::runtime_error("beta_const and gamm must have length 1, nP, or at most nT");
+      }
 
-        for(size_t t=1L; t<m_nT; ++t)
+      change(m_beta_freq, beta_freq);
+      // Seasonal rates are the same for every animal, so take no part in
+      // the rate groups:
+      const double none = 0.0;
+      setSeasonal(m_seasonal_beta, m_seasonal_beta_period, beta_const, is_seasonal(n_beta_const) ? n_beta_const : 0L);
+      setSeasonal(m_seasonal_gamma, m_seasonal_gamma_period, gamm, is_seasonal(n_gamm) ? n_gamm : 0L);
+      setGroupRates(prv1, per_animal(n_prv1),
+                    is_seasonal(n_beta_const) ? &none : beta_const, per_animal(n_beta_const),
+                    is_seasonal(n_gamm) ? &none : gamm, per_animal(n_gamm));
+    }
+
+    // As setRates and setTestPars, from p1, beta_const, beta_freq, gamma, se, sp:
+    void setDhimmPars(const double* pars)
+    {
+      if(pars[2L] < 0.0 || pars[2L] > 1.0) throw std::runtime_error("Invalid beta_freq");
+
+      change(m_beta_freq, pars[2L]);
+      setSeasonal(m_seasonal_beta, m_seasonal_beta_period, nullptr, 0L);
+      setSeasonal(m_seasonal_gamma, m_seasonal_gamma_period, nullptr, 0L);
+      setGroupRates(pars, false, pars + 1L, false, pars + 3L, false);
+      setNumTests(1L);
+      change(m_se, pars[4L]);
+      change(m_sp, pars[5L]);
+    }
+
+    // The se of each of the M tests at a time point followed by their sp
+    // (so se, sp for a single test).  The kernels build their table of 2^M
+    // emission probabilities from these, so any change takes effect exactly
+    // and without revisiting the data:
+    void setTestPars(const std::vector<double>& test_pars)
+    {
+      setTestParArray(test_pars.data(), test_pars.size());
+    }
+
+    void setTestParArray(const double* test_pars, const size_t n)
+    {
+      const size_t M = n / 2L;
+      if(M < 1L || n != 2L*M || M > static_cast<size_t>(max_tests))
+      {
+        throw std::runtime_error("test_pars must be the se then the sp of 1 to 4 tests");
+      }
+
+      setNumTests(M);
+      m_test_se.resize(M);
+      m_test_sp.resize(M);
+      for(size_t k=0L; k<M; ++k)
+      {
+        change(m_test_se[k], test_pars[k]);
+        change(m_test_sp[k], test_pars[M + k]);
+      }
+      change(m_se, test_pars[0L]);
+      change(m_sp, test_pars[M]);
+    }
+
+    int getNumTests() const
+    {
+      return m_tests;
+    }
+
+    // Throws unless the data has results for at most the tests of
+    // setTestPars
+    void checkNumTests() const
+    {
+      if(dataPlanes() > m_tests) throw std::runtime_error("The data has results for more tests than setTestPars");
+    }
+
+    // Throws unless appendTimepointBuffer can add these results, so that a
+    // bad time point is found before anything changes
+    void checkTimepoint(const int* results) const
+    {
+      checkNumTests();
+      for(size_t i=0L; i<m_nP; ++i)
+      {
+        const std::uint8_t y = testResult(results[i]);
+        if(y != missing_test && (y >> m_tests) != 0L) throw std::runtime_error("The data has results for more tests than setTestPars");
+      }
+    }
+
+    // Throws unless evaluateBatch can take these n sets of the six dhimm
+    // parameters (which are for a single test)
+    void checkDhimmPars(const double* pars, const size_t n) const
+    {
+      for(size_t m=0L; m<n; ++m)
+      {
+        if(pars[6L*m + 2L] < 0.0 || pars[6L*m + 2L] > 1.0) throw std::runtime_error("Invalid beta_freq");
+      }
+      if(n > 0L && dataPlanes() > 1L) throw std::runtime_error("The data has results for more tests than setTestPars");
+    }
+
+    // Log density for n consecutive sets of the six dhimm parameters, as
+    // evaluate but without the cache, leaving the parameters at those of
+    // one of the sets.  Sets without frequency-dependent transmission (and
+    // safe for the scaled kernel) are run together, with the results of
+    // each pattern read once for all of them and the sets in SIMD lanes;
+    // the others are evaluated in turn.
+    void evaluateBatch(const double* pars, const size_t n, double* logdens)
+    {
+      std::vector<size_t> batched;
+      for(size_t m=0L; m<n; ++m)
+      {
+        const double* set = pars + 6L*m;
+        if(set[2L] == 0.0 && scaled_interval(make_lin_pars(set[0L], set[1L], set[3L], set[4L], set[5L])) > 0L)
         {
-          i++;
-          const std::array<double, 2L> lastlogalpha = logalpha;
+          batched.push_back(m);
+        }
+        else
+        {
+          logdens[m] = evaluate(set);
+        }
+      }
+      if(batched.empty()) return;
+
+      // As for evaluate, with one rate group and a single test:
+      setDhimmPars(pars + 6L*batched[0L]);
+      packPatterns();
+      checkNumTests();
 
+      // Parameters of each set, with the infection probability at each
+      // first time point of the patterns (index t*nB + m):
+      const size_t nB = batched.size();
+      const size_t nE = m_max_entry + 1L;
+      TwoStateLinBatch batch;
+      batch.resize(nB);
+      std::vector<double> entry_p1(nE*nB), entry_p1m(nE*nB);
+      for(size_t m=0L; m<nB; ++m)
+      {
+        const double* set = pars + 6L*batched[m];
+        batch.set(m, make_lin_pars(set[0L], set[1L], set[3L], set[4L], set[5L]));
+        double q = set[0L];
+        for(size_t t=0L; t<nE; ++t)
+        {
+          if(t > 0L) q = q * (1.0 - set[3L]) + (1.0 - q) * set[1L];
+          entry_p1[t*nB + m] = q;
+          entry_p1m[t*nB + m] = 1.0 - q;
+        }
+      }
+
+      // Per-block totals of each set, combined in a fixed order:
+      std::vector<double> partial(parallel_num_blocks(m_nPat)*nB, 0.0);
+      parallel_blocks(m_nPat, nB*m_nT, activeThreads(), [&](const size_t block, const size_t from, const size_t to)
+      {
+        std::vector<std::uint8_t> y(m_nT);
+        for(size_t p=from; p<to; ++p)
+        {
+          const size_t entry = m_pattern_entry[p];
+          const size_t length = m_pattern_length[p];
+          if(length == 0L) continue;
+          for(size_t t=0L; t<length; ++t)
           {
-            const double acc0 = lastlogalpha[0L] + be1m + m_spprob[i];
-            const double acc1 = lastlogalpha[1L] + ga + m_spprob[i];
-            logalpha[0L] = log_sum_exp(acc0, acc1);
+            y[t] = observation(entry + t, p);
           }
+          forward_two_state_batch(m_use_simd, y.data(), length, batch, entry_p1.data() + entry*nB,
+                                  entry_p1m.data() + entry*nB, m_counts[p], 0L, nB, partial.data() + block*nB);
+        }
+      });
+
+      for(size_t m=0L; m<nB; ++m)
+      {
+        double total = 0.0;
+        for(size_t block=0L; block<partial.size()/nB; ++block)
+        {
+          total += partial[block*nB + m];
+        }
+        logdens[batched[m]] = total;
+      }
+    }
 
+    double log1m(const double p)
+    {
+      return std::log1p(-p);
+    }
+
+    // Frequency-dependent transmission using a mean-field approximation:
+    // all patterns are moved forward one time point at a time, and the
+    // expected herd prevalence under the filtered state probabilities at
+    // t-1 sets the infection probability for step t as
+    //   beta_t = 1 - (1 - beta_freq * prev_{t-1}) * (1 - beta_const)
+    // with beta_const taken from each pattern's rate group.  The prevalence
+    // is over the animals with records spanning t-1, and each pattern
+    // joins at its first record with the infection probability of its
+    // rate group under the same steps.  Seasonal rates are also moved
+    // forward this way, with the log transition probabilities of each rate
+    // group computed once per step and shared by all of its patterns.
+    void calculateFrequency()
+    {
+      makeGroupPars();
+
+      const size_t nGroups = m_group_first.size();
+      m_logalpha0.resize(m_nPat);
+      m_logalpha1.resize(m_nPat);
+      m_step_entry.assign(m_group_p1.begin(), m_group_p1.end());
+      m_step_lp.assign(m_group_lp.begin(), m_group_lp.end());
+      std::vector<double>& entry = m_step_entry;
+      std::vector<TwoStateLogPars>& step_lp = m_step_lp;
+
+      double prevalence = 0.0;
+      for(size_t t=0L; t<m_nT; ++t)
+      {
+        if(t > 0L)
+        {
+          for(size_t g=0L; g<nGroups; ++g)
           {
-            const double acc0 = lastlogalpha[0L] + be + m_seprob[i];
-            const double acc1 = lastlogalpha[1L] + ga1m + m_seprob[i];
-            logalpha[1L] = log_sum_exp(acc0, acc1);
+            const double beta = stepBeta(g, t, prevalence);
+            const double gamma = stepGamma(g, t);
+            entry[g] = entry[g] * (1.0 - gamma) + (1.0 - entry[g]) * beta;
+            step_lp[g].be = std::log(beta);
+            step_lp[g].be1m = log1m(beta);
+            step_lp[g].ga = std::log(gamma);
+            step_lp[g].ga1m = log1m(gamma);
           }
+        }
+
+        const double infected = parallel_block_sum(m_nPat, 1L, activeThreads(), [&](const size_t from, const size_t to)
+        {
+          double total = 0.0;
+          forRuns(from, to, [&](const size_t r, const size_t run_from, const size_t run_to)
+          {
+            if(!runActive(r, t)) return;
+
+            const size_t g = m_run_group[r];
+            const size_t tr = t - m_run_entry[r];
+            const PackedObservations* missing = m_run_masked[r] ? &m_missing : nullptr;
+            const TwoStateLogPars& lp = step_lp[g];
+            if(tr == 0L)
+            {
+              const double p1 = std::log(entry[g]);
+              const double p1m = log1m(entry[g]);
+              for(size_t p=run_from; p<run_to; ++p)
+              {
+                const int y = observed_test(m_data, missing, 0L, p);
+                m_logalpha0[p] = p1m + lp.em0[y];
+                m_logalpha1[p] = p1 + lp.em1[y];
+              }
+            }
+            else
+            {
+              if(missing)
+              {
+                forward_two_state_step_scalar(m_data, tr, lp, run_from, run_to,
+                                              m_logalpha0.data(), m_logalpha1.data(), missing);
+              }
+              else
+              {
+                forward_two_state_step(m_use_simd && m_data.planes() == 1L, m_data, tr, lp, run_from, run_to,
+                                       m_logalpha0.data(), m_logalpha1.data());
+              }
+            }
 
+            if(m_beta_freq == 0.0) return;
+            for(size_t p=run_from; p<run_to; ++p)
+            {
+              total += m_counts[p] / (1.0 + std::exp(m_logalpha0[p] - m_logalpha1[p]));
+            }
+          });
+          return total;
+        });
+        prevalence = prevalenceAt(t, infected);
+      }
+
+      m_logdens = parallel_block_sum(m_nPat, 1L, activeThreads(), [&](const size_t from, const size_t to)
+      {
+        double total = 0.0;
+        for(size_t p=from; p<to; ++p)
+        {
+          m_pattern_ll[p] = m_pattern_length[p] > 0L ? log_sum_exp_scalar(m_logalpha0[p], m_logalpha1[p]) : 0.0;
+          total += m_counts[p] * m_pattern_ll[p];
         }
-        i++;
+        return total;
+      });
+      m_current = true;
+    }
 
-        m_logdens += log_sum_exp(logalpha[0L], logalpha[1L]);
+    void calculate()
+    {
+      packPatterns();
+      if(m_beta_freq != 0.0 || seasonal())
+      {
+        calculateFrequency();
+        return;
       }
 
+      makeGroupPars();
+
+      // Each unique pattern is evaluated once over its records and weighted
+      // by its count, with patterns that have missing tests left to the
+      // scalar kernel:
+      m_logdens = parallel_block_sum(m_nPat, m_nT, activeThreads(), [&](const size_t from, const size_t to)
+      {
+        forRuns(from, to, [&](const size_t r, const size_t run_from, const size_t run_to)
+        {
+          const size_t g = m_run_group[r];
+          const size_t length = m_run_length[r];
+          if(length == 0L)
+          {
+            std::fill(m_pattern_ll.begin() + run_from, m_pattern_ll.begin() + run_to, 0.0);
+          }
+          else if(m_run_masked[r])
+          {
+            forward_two_state_scalar(m_data, length, runLogPars(r), run_from, run_to, m_pattern_ll.data(), &m_missing);
+          }
+          else if(m_group_interval[g] > 0L)
+          {
+            forward_two_state_scaled(m_data, length, runLinPars(r), m_group_interval[g], run_from, run_to, m_pattern_ll.data());
+          }
+          else if(m_use_simd && m_data.planes() == 1L)
+          {
+            forward_two_state_simd(m_data, length, runLogPars(r), run_from, run_to, m_pattern_ll.data());
+          }
+          else
+          {
+            forward_two_state_scalar(m_data, length, runLogPars(r), run_from, run_to, m_pattern_ll.data());
+          }
+        });
+
+        double total = 0.0;
+        for(size_t p=from; p<to; ++p)
+        {
+          total += m_counts[p] * m_pattern_ll[p];
+        }
+        return total;
+      });
+      m_current = true;
+
       /*
       for(size_t p=0L; p<m_nP; ++p)
       {
@@ -202,38 +1446,84 @@ class SimpleForward : public Himm
   }
 
       */
-
     }
 
-    void show()
+    // Throws unless calculateWithGradient supports the model:  the
+    // mean-field coupling between animals is not differentiated, and with
+    // per-animal rates there is no single rate to differentiate by.  Nor is
+    // the entry probability of animals whose records start late, and se
+    // and sp are only those of a single test, and beta_const and gamma
+    // constant.
+    void checkGradient() const
     {
-      //Rcpp::Rcout << "hello from Himm nr " << pointer_index << std::endl;
-      printf("hello from Himm\n");
-
+      if(m_beta_freq != 0.0) gradient_unsupported("frequency-dependent transmission (beta_freq != 0)");
+      if(m_group_first.size() != 1L) gradient_unsupported("per-animal rates");
+      for(size_t r=0L; r<m_run_entry.size(); ++r)
+      {
+        if(m_run_entry[r] > 0L && m_run_length[r] > 0L) gradient_unsupported("records starting after the first time point");
+      }
+      if(m_tests > 1L || dataPlanes() > 1L) gradient_unsupported("more than one test per time point");
+      if(seasonal()) gradient_unsupported("seasonal beta_const or gamma");
     }
 
-    int getIndex()
+    double calculateWithGradient(std::array<double, 6L>& gradient)
     {
-      return pointer_index;
-    }
+      checkGradient();
+      packPatterns();
 
-    double logDensity()
-    {
+      const double p1 = m_group_p1[0L];
+      const double beta_const = m_group_beta[0L];
+      const double gamma = m_group_gamma[0L];
+      const TwoStateLogPars lp = make_log_pars(p1, beta_const, gamma, m_se, m_sp);
+
+      // One forward-backward sweep per pattern over its records, with
+      // per-block statistics combined in a fixed order as for calculate:
+      std::vector<double> partial_ll(parallel_num_blocks(m_nPat), 0.0);
+      std::vector<TwoStateStats> partial_ss(partial_ll.size());
+      parallel_blocks(m_nPat, 3L*m_nT, activeThreads(), [&](const size_t block, const size_t from, const size_t to)
+      {
+        partial_ss[block].fill(0.0);
+        forRuns(from, to, [&](const size_t r, const size_t run_from, const size_t run_to)
+        {
+          const size_t length = m_run_length[r];
+          if(length == 0L)
+          {
+            std::fill(m_pattern_ll.begin() + run_from, m_pattern_ll.begin() + run_to, 0.0);
+            return;
+          }
+          partial_ll[block] += forward_backward_two_state(m_data, m_counts.data(), length, lp, run_from, run_to,
+                                                          m_pattern_ll.data(), partial_ss[block],
+                                                          m_run_masked[r] ? &m_missing : nullptr);
+        });
+      });
+
+      TwoStateStats ss;
+      ss.fill(0.0);
+      m_logdens = 0.0;
+      for(size_t block=0L; block<partial_ll.size(); ++block)
+      {
+        m_logdens += partial_ll[block];
+        for(size_t k=0L; k<ss.size(); ++k)
+        {
+          ss[k] += partial_ss[block][k];
+        }
+      }
+
+      gradient = two_state_gradient(ss, p1, beta_const, gamma, m_se, m_sp);
+      m_current = true;
       return m_logdens;
     }
 
-    double test(const double p1)
-    {
-      m_se = 0.9;
-      m_sp = 0.99;
-      m_beta_const = 0.05;
-      m_gamma = 0.08;
-      m_p1 = p1;
 
-      calculate();
+    void show()
+    {
+      printf("hello from Himm\n");
 
-      return logDensity();
+    }
 
+    double logDensity()
+    {
+      return m_logdens;
     }
 
     ~SimpleForward()
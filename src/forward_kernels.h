@@ -0,0 +1,939 @@
+#ifndef FORWARD_KERNELS_H_
+#define FORWARD_KERNELS_H_
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <vector>
+
+#include "pattern_storage.h"
+
+/*
+  Kernels for the two-state forward algorithm over a set of observation
+  patterns.  Observations are bit-packed time-major (see
+  PackedObservations) so that consecutive patterns sit next to each other
+  in memory, which lets the SIMD kernel take one time point for several
+  patterns from a single word.  The emission probabilities come from a
+  table indexed by latent state and observed test results, which for
+  several tests per time point is a bitmask with 2^M entries (so that the
+  inner loop is still one lookup).  The SIMD and scaled kernels are for a
+  single test (one plane of observations).  The scalar kernels also take an optional mask of missing tests (set bits, with the
+  same layout as the observations), for which the emission term is skipped.
+
+  The SIMD kernel uses GCC/clang vector extensions, with the instruction
+  set selected at runtime:  8 lanes with AVX-512, 4 lanes with AVX2, and
+  the scalar kernel otherwise (or on non-x86 platforms).
+*/
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define HIMM_X86_SIMD 1
+#else
+#define HIMM_X86_SIMD 0
+#endif
+
+// Largest number of tests per time point:  the results are a bitmask (bit
+// k for test k), and missing_test follows the largest bitmask
+const int max_tests = 4L;
+const int missing_test = 1L << max_tests;
+
+// Log-transformed parameters of the two-state model
+struct TwoStateLogPars
+{
+  double p1;
+  double p1m;
+  double be;
+  double be1m;
+  double ga;
+  double ga1m;
+  // Log emission probabilities indexed by the test results, or by
+  // missing_test (where they are zero):
+  double em0[missing_test + 1L];
+  double em1[missing_test + 1L];
+};
+
+// Test result at time point t of pattern p, or missing_test if masked
+inline int observed_test(const PackedObservations& obs, const PackedObservations* missing,
+                         const size_t t, const size_t p)
+{
+  return (missing && missing->get(t, p)) ? missing_test : obs.get(t, p);
+}
+
+inline TwoStateLogPars make_log_pars(const double p1, const double beta_const, const double gamma,
+                                     const double se, const double sp)
+{
+  TwoStateLogPars lp;
+  lp.p1 = std::log(p1);
+  lp.p1m = std::log1p(-p1);
+  lp.be = std::log(beta_const);
+  lp.be1m = std::log1p(-beta_const);
+  lp.ga = std::log(gamma);
+  lp.ga1m = std::log1p(-gamma);
+  lp.em0[0L] = std::log(sp);
+  lp.em0[1L] = std::log1p(-sp);
+  lp.em1[0L] = std::log1p(-se);
+  lp.em1[1L] = std::log(se);
+  lp.em0[missing_test] = 0.0;
+  lp.em1[missing_test] = 0.0;
+  return lp;
+}
+
+// Replaces the emission tables for M independent tests with the given
+// sensitivities and specificities, so that any combination of results is
+// still a single lookup.  M = 1 gives the same table as make_log_pars.
+inline void set_test_emissions(TwoStateLogPars& lp, const int M, const double* se, const double* sp)
+{
+  for(int y=0L; y<(1L << M); ++y)
+  {
+    lp.em0[y] = 0.0;
+    lp.em1[y] = 0.0;
+    for(int k=0L; k<M; ++k)
+    {
+      const bool positive = (y >> k) & 1L;
+      lp.em0[y] += positive ? std::log1p(-sp[k]) : std::log(sp[k]);
+      lp.em1[y] += positive ? std::log(se[k]) : std::log1p(-se[k]);
+    }
+  }
+}
+
+inline double log_sum_exp_scalar(const double u, const double v)
+{
+  const double m = std::max(u, v);
+  return m + std::log(std::exp(u - m) + std::exp(v - m));
+}
+
+// Log-likelihood of patterns [from, to) written to ll[from, to)
+inline void forward_two_state_scalar(const PackedObservations& obs, const size_t nT,
+                                     const TwoStateLogPars& lp,
+                                     const size_t from, const size_t to, double* ll,
+                                     const PackedObservations* missing = nullptr)
+{
+  for(size_t p=from; p<to; ++p)
+  {
+    const int y0 = observed_test(obs, missing, 0L, p);
+    double logalpha0 = lp.p1m + lp.em0[y0];
+    double logalpha1 = lp.p1 + lp.em1[y0];
+
+    for(size_t t=1L; t<nT; ++t)
+    {
+      const int y = observed_test(obs, missing, t, p);
+      const double last0 = logalpha0;
+      const double last1 = logalpha1;
+
+      logalpha0 = log_sum_exp_scalar(last0 + lp.be1m + lp.em0[y], last1 + lp.ga + lp.em0[y]);
+      logalpha1 = log_sum_exp_scalar(last0 + lp.be + lp.em1[y], last1 + lp.ga1m + lp.em1[y]);
+    }
+
+    ll[p] = log_sum_exp_scalar(logalpha0, logalpha1);
+  }
+}
+
+// Parameters of the two-state model on the probability scale
+struct TwoStateLinPars
+{
+  double p1;
+  double p1m;
+  double be;
+  double be1m;
+  double ga;
+  double ga1m;
+  double se;
+  double se1m;
+  double sp;
+  double sp1m;
+};
+
+inline TwoStateLinPars make_lin_pars(const double p1, const double beta_const, const double gamma,
+                                     const double se, const double sp)
+{
+  TwoStateLinPars pars;
+  pars.p1 = p1;
+  pars.p1m = 1.0 - p1;
+  pars.be = beta_const;
+  pars.be1m = 1.0 - beta_const;
+  pars.ga = gamma;
+  pars.ga1m = 1.0 - gamma;
+  pars.se = se;
+  pars.se1m = 1.0 - se;
+  pars.sp = sp;
+  pars.sp1m = 1.0 - sp;
+  return pars;
+}
+
+// Number of time points between renormalisations for the scaled kernel.
+// As each row of the transition matrix sums to 1, the total forward
+// probability shrinks by at most the smallest emission probability per
+// step, so this interval keeps it well clear of underflow.  Returns 0 when
+// the scaled kernel is not safe (zero emission probabilities), in which
+// case the log-space kernel should be used instead.
+inline int scaled_interval(const TwoStateLinPars& pars)
+{
+  const double emin = std::min(std::min(pars.se, pars.se1m), std::min(pars.sp, pars.sp1m));
+  if(!(emin > 1e-100)) return 0L;
+  if(!(pars.p1 >= 0.0 && pars.p1m >= 0.0 && pars.be >= 0.0 && pars.be1m >= 0.0 &&
+       pars.ga >= 0.0 && pars.ga1m >= 0.0)) return 0L;
+
+  const double steps = std::log(1e-250) / std::log(emin);
+  return static_cast<int>(std::max(1.0, std::min(64.0, std::floor(steps))));
+}
+
+// Linear-space forward algorithm for patterns [from, to):  the messages are
+// renormalised every interval time points, with the log of the scaling
+// factors accumulated, so there is only one log per interval
+inline void forward_two_state_scaled(const PackedObservations& obs, const size_t nT,
+                                     const TwoStateLinPars& pars, const int interval,
+                                     const size_t from, const size_t to, double* ll)
+{
+  for(size_t p=from; p<to; ++p)
+  {
+    const bool y0 = obs.get(0L, p);
+    double alpha0 = pars.p1m * (y0 ? pars.sp1m : pars.sp);
+    double alpha1 = pars.p1 * (y0 ? pars.se : pars.se1m);
+    double logscale = 0.0;
+
+    int since = 0L;
+    for(size_t t=1L; t<nT; ++t)
+    {
+      const bool y = obs.get(t, p);
+      const double last0 = alpha0;
+      const double last1 = alpha1;
+
+      alpha0 = (last0 * pars.be1m + last1 * pars.ga) * (y ? pars.sp1m : pars.sp);
+      alpha1 = (last0 * pars.be + last1 * pars.ga1m) * (y ? pars.se : pars.se1m);
+
+      if(++since == interval)
+      {
+        const double total = alpha0 + alpha1;
+        if(total == 0.0) break;
+        logscale += std::log(total);
+        alpha0 /= total;
+        alpha1 /= total;
+        since = 0L;
+      }
+    }
+
+    ll[p] = logscale + std::log(alpha0 + alpha1);
+  }
+}
+
+// One time point of the forward recursion for patterns [from, to), run in
+// lockstep over patterns:  the messages in logalpha0/logalpha1 are updated
+// in place using the observations at time point t
+inline void forward_two_state_step_scalar(const PackedObservations& obs, const size_t t,
+                                          const TwoStateLogPars& lp,
+                                          const size_t from, const size_t to,
+                                          double* logalpha0, double* logalpha1,
+                                          const PackedObservations* missing = nullptr)
+{
+  for(size_t p=from; p<to; ++p)
+  {
+    const int y = observed_test(obs, missing, t, p);
+    const double last0 = logalpha0[p];
+    const double last1 = logalpha1[p];
+
+    logalpha0[p] = log_sum_exp_scalar(last0 + lp.be1m + lp.em0[y], last1 + lp.ga + lp.em0[y]);
+    logalpha1[p] = log_sum_exp_scalar(last0 + lp.be + lp.em1[y], last1 + lp.ga1m + lp.em1[y]);
+  }
+}
+
+// Parameters of a batch of parameter sets (with a single test) on the
+// probability scale, held field by field so that the sets are contiguous:
+// the batched kernels run one pattern at a time with the sets in lanes,
+// renormalising at every time point and taking the log of the product of
+// the scaling factors every interval time points (as for the scaled
+// kernel, with the interval of the least safe set)
+struct TwoStateLinBatch
+{
+  std::vector<double> be;
+  std::vector<double> be1m;
+  std::vector<double> ga;
+  std::vector<double> ga1m;
+  // Indexed by the test result:
+  std::vector<double> em0[2L];
+  std::vector<double> em1[2L];
+  int interval = 64L;
+
+  void resize(const size_t n)
+  {
+    for(std::vector<double>* field : { &be, &be1m, &ga, &ga1m, &em0[0L], &em0[1L], &em1[0L], &em1[1L] })
+    {
+      field->resize(n);
+    }
+  }
+
+  void set(const size_t m, const TwoStateLinPars& pars)
+  {
+    be[m] = pars.be;
+    be1m[m] = pars.be1m;
+    ga[m] = pars.ga;
+    ga1m[m] = pars.ga1m;
+    em0[0L][m] = pars.sp;
+    em0[1L][m] = pars.sp1m;
+    em1[0L][m] = pars.se1m;
+    em1[1L][m] = pars.se;
+    interval = std::min(interval, scaled_interval(pars));
+  }
+};
+
+// Log-likelihood of one pattern with test results y[0..nT) (0, 1 or
+// missing_test) under the parameter sets [from, to) of the batch, starting
+// from the infection probabilities p1 (and p1m = 1 - p1) of each set, with
+// weight times the log-likelihood added to ll[from, to).  The batch must
+// have a positive interval.
+inline void forward_two_state_batch_scalar(const std::uint8_t* y, const size_t nT,
+                                           const TwoStateLinBatch& batch,
+                                           const double* p1, const double* p1m, const double weight,
+                                           const size_t from, const size_t to, double* ll)
+{
+  for(size_t m=from; m<to; ++m)
+  {
+    double alpha0 = p1m[m] * (y[0L] == missing_test ? 1.0 : batch.em0[y[0L]][m]);
+    double alpha1 = p1[m] * (y[0L] == missing_test ? 1.0 : batch.em1[y[0L]][m]);
+    double scale = alpha0 + alpha1;
+    alpha0 /= scale;
+    alpha1 /= scale;
+    double logscale = 0.0;
+
+    int since = 1L;
+    for(size_t t=1L; t<nT; ++t)
+    {
+      const double em0 = y[t] == missing_test ? 1.0 : batch.em0[y[t]][m];
+      const double em1 = y[t] == missing_test ? 1.0 : batch.em1[y[t]][m];
+      const double next0 = (alpha0 * batch.be1m[m] + alpha1 * batch.ga[m]) * em0;
+      const double next1 = (alpha0 * batch.be[m] + alpha1 * batch.ga1m[m]) * em1;
+      const double total = next0 + next1;
+      alpha0 = next0 / total;
+      alpha1 = next1 / total;
+      scale *= total;
+
+      if(++since == batch.interval)
+      {
+        logscale += std::log(scale);
+        scale = 1.0;
+        since = 0L;
+      }
+    }
+
+    ll[m] += weight * (logscale + std::log(scale));
+  }
+}
+
+// Expected sufficient statistics of the two-state model given the data:
+// posterior probability of each state at the first time point, expected
+// number of each transition, and expected number of positive/negative
+// tests in each state (missing tests are not counted)
+enum TwoStateStat
+{
+  ss_first1, ss_first0, ss_n01, ss_n00, ss_n10, ss_n11,
+  ss_pos1, ss_neg1, ss_pos0, ss_neg0
+};
+typedef std::array<double, 10L> TwoStateStats;
+
+// Gradient of the log-likelihood with respect to the six dhimm parameters
+// (p1, beta_const, beta_freq, gamma, se, sp) from the sufficient statistics.
+// The beta_freq component is not defined for the constant-rate model.
+inline std::array<double, 6L> two_state_gradient(const TwoStateStats& ss, const double p1,
+                                                 const double beta_const, const double gamma,
+                                                 const double se, const double sp)
+{
+  std::array<double, 6L> gradient;
+  gradient[0L] = ss[ss_first1] / p1 - ss[ss_first0] / (1.0 - p1);
+  gradient[1L] = ss[ss_n01] / beta_const - ss[ss_n00] / (1.0 - beta_const);
+  gradient[2L] = std::numeric_limits<double>::quiet_NaN();
+  gradient[3L] = ss[ss_n10] / gamma - ss[ss_n11] / (1.0 - gamma);
+  gradient[4L] = ss[ss_pos1] / se - ss[ss_neg1] / (1.0 - se);
+  gradient[5L] = ss[ss_neg0] / sp - ss[ss_pos0] / (1.0 - sp);
+  return gradient;
+}
+
+// Forward-backward pass in log space over patterns [from, to), adding the
+// count-weighted sufficient statistics to ss, writing the log-likelihood of
+// each pattern to ll and returning the count-weighted total.  Only the
+// forward messages of the current pattern are stored, and the backward
+// messages are accumulated on the fly.
+inline double forward_backward_two_state(const PackedObservations& obs, const double* counts,
+                                         const size_t nT, const TwoStateLogPars& lp,
+                                         const size_t from, const size_t to, double* ll_out,
+                                         TwoStateStats& ss, const PackedObservations* missing = nullptr)
+{
+  std::vector<double> logalpha0(nT);
+  std::vector<double> logalpha1(nT);
+
+  double total = 0.0;
+  for(size_t p=from; p<to; ++p)
+  {
+    const int y0 = observed_test(obs, missing, 0L, p);
+    logalpha0[0L] = lp.p1m + lp.em0[y0];
+    logalpha1[0L] = lp.p1 + lp.em1[y0];
+    for(size_t t=1L; t<nT; ++t)
+    {
+      const int y = observed_test(obs, missing, t, p);
+      logalpha0[t] = log_sum_exp_scalar(logalpha0[t-1L] + lp.be1m + lp.em0[y], logalpha1[t-1L] + lp.ga + lp.em0[y]);
+      logalpha1[t] = log_sum_exp_scalar(logalpha0[t-1L] + lp.be + lp.em1[y], logalpha1[t-1L] + lp.ga1m + lp.em1[y]);
+    }
+
+    const double ll = log_sum_exp_scalar(logalpha0[nT-1L], logalpha1[nT-1L]);
+    const double count = counts[p];
+    ll_out[p] = ll;
+    total += count * ll;
+
+    double logbeta0 = 0.0;
+    double logbeta1 = 0.0;
+    for(size_t t=nT-1L; t>0L; --t)
+    {
+      const int y = observed_test(obs, missing, t, p);
+      const double e0 = lp.em0[y] + logbeta0;
+      const double e1 = lp.em1[y] + logbeta1;
+
+      // Posterior probabilities of each transition from t-1 to t:
+      const double x00 = count * std::exp(logalpha0[t-1L] + lp.be1m + e0 - ll);
+      const double x01 = count * std::exp(logalpha0[t-1L] + lp.be + e1 - ll);
+      const double x10 = count * std::exp(logalpha1[t-1L] + lp.ga + e0 - ll);
+      const double x11 = count * std::exp(logalpha1[t-1L] + lp.ga1m + e1 - ll);
+
+      ss[ss_n00] += x00;
+      ss[ss_n01] += x01;
+      ss[ss_n10] += x10;
+      ss[ss_n11] += x11;
+      if(y != missing_test)
+      {
+        ss[y ? ss_pos1 : ss_neg1] += x01 + x11;
+        ss[y ? ss_pos0 : ss_neg0] += x00 + x10;
+      }
+
+      logbeta0 = log_sum_exp_scalar(lp.be1m + e0, lp.be + e1);
+      logbeta1 = log_sum_exp_scalar(lp.ga + e0, lp.ga1m + e1);
+    }
+
+    const double g0 = count * std::exp(logalpha0[0L] + logbeta0 - ll);
+    const double g1 = count * std::exp(logalpha1[0L] + logbeta1 - ll);
+    ss[ss_first0] += g0;
+    ss[ss_first1] += g1;
+    if(y0 != missing_test)
+    {
+      ss[y0 ? ss_pos1 : ss_neg1] += g1;
+      ss[y0 ? ss_pos0 : ss_neg0] += g0;
+    }
+  }
+
+  return total;
+}
+
+// Number of time points between stored forward messages when
+// smoothing with checkpoints, which balances the checkpoints against the
+// segment buffer
+inline size_t smooth_checkpoint_interval(const size_t nT)
+{
+  return std::max<size_t>(1L, static_cast<size_t>(std::ceil(std::sqrt(static_cast<double>(nT)))));
+}
+
+// Posterior marginals p(z_t = k | y_1..nT) of one sequence with K states,
+// written to out[t*K + k], in linear space with renormalisation at every
+// step.  The model is given by in-place updates of K-vectors:
+//   init(alpha)     alpha_0 from the prior and the first observation
+//   step(t, alpha)  alpha_{t-1} to alpha_t (transition then emission)
+//   back(t, beta)   beta_t to beta_{t-1} (emission then transition)
+// Forward messages are only stored every interval time points; each
+// segment is recomputed from its checkpoint during the backward pass, so
+// the work buffer holds (nT/interval + interval + 1)*K values at the cost
+// of a second forward pass.  An interval of 1 stores every message.
+template<class F_init, class F_step, class F_back>
+void smooth_sequence(const size_t nT, const int K, const size_t interval,
+                     std::vector<double>& work, double* out,
+                     F_init init, F_step step, F_back back)
+{
+  const size_t ncheck = (nT + interval - 1L) / interval;
+  work.resize((ncheck + interval + 1L) * K);
+  double* checkpoints = work.data();
+  double* segment = checkpoints + ncheck*K;
+  double* beta = segment + interval*K;
+
+  auto normalise = [K](double* x)
+  {
+    double total = 0.0;
+    for(int k=0L; k<K; ++k) total += x[k];
+    const double scale = 1.0 / total;
+    for(int k=0L; k<K; ++k) x[k] *= scale;
+  };
+
+  // Forward pass keeping only the checkpoints:
+  init(segment);
+  normalise(segment);
+  std::copy(segment, segment + K, checkpoints);
+  for(size_t t=1L; t<nT; ++t)
+  {
+    step(t, segment);
+    normalise(segment);
+    if(t % interval == 0L)
+    {
+      std::copy(segment, segment + K, checkpoints + (t/interval)*K);
+    }
+  }
+
+  // Backward pass over the segments in reverse:
+  std::fill(beta, beta + K, 1.0);
+  for(size_t c=ncheck; c-- > 0L; )
+  {
+    const size_t start = c*interval;
+    const size_t end = std::min(nT, start + interval);
+
+    std::copy(checkpoints + c*K, checkpoints + (c+1L)*K, segment);
+    for(size_t t=start+1L; t<end; ++t)
+    {
+      double* alpha = segment + (t-start)*K;
+      std::copy(alpha - K, alpha, alpha);
+      step(t, alpha);
+      normalise(alpha);
+    }
+
+    for(size_t t=end; t-- > start; )
+    {
+      const double* alpha = segment + (t-start)*K;
+      for(int k=0L; k<K; ++k)
+      {
+        out[t*K + k] = alpha[k] * beta[k];
+      }
+      normalise(out + t*K);
+      if(t > 0L)
+      {
+        back(t, beta);
+        normalise(beta);
+      }
+    }
+  }
+}
+
+#if HIMM_X86_SIMD
+
+#define HIMM_ALWAYS_INLINE inline __attribute__((always_inline))
+
+template<int W>
+struct SimdLanes
+{
+  typedef double vd __attribute__((vector_size(8*W)));
+  typedef std::int64_t vi __attribute__((vector_size(8*W)));
+};
+
+// Note: vectors are passed by reference throughout, as passing AVX
+// vectors by value to functions without the target attribute changes the ABI
+
+// In-place exp:  Cody-Waite reduction to |r| <= log(2)/2 then a degree 13
+// Taylor polynomial, which is accurate to within 1-2 ulp.  Inputs below
+// -708 (including -Inf) return 0.
+template<int W>
+HIMM_ALWAYS_INLINE void simd_exp(typename SimdLanes<W>::vd& x)
+{
+  typedef typename SimdLanes<W>::vd vd;
+  typedef typename SimdLanes<W>::vi vi;
+
+  const vd zero = vd{};
+  const vd shifter = zero + 6755399441055744.0;
+  const vi underflow = x < -708.0;
+  const vi overflow = x > 709.0;
+  const vd xc = underflow ? zero - 708.0 : (overflow ? zero + 709.0 : x);
+
+  // n = round(x/log(2)), with the integer value left in the low bits of t:
+  const vd t = xc * 1.4426950408889634074 + shifter;
+  const vd n = t - shifter;
+  const vd r = (xc - n * 6.93147180369123816490e-01) - n * 1.90821492927058770002e-10;
+
+  vd p = zero + 1.0/6227020800.0;
+  p = p * r + 1.0/479001600.0;
+  p = p * r + 1.0/39916800.0;
+  p = p * r + 1.0/3628800.0;
+  p = p * r + 1.0/362880.0;
+  p = p * r + 1.0/40320.0;
+  p = p * r + 1.0/5040.0;
+  p = p * r + 1.0/720.0;
+  p = p * r + 1.0/120.0;
+  p = p * r + 1.0/24.0;
+  p = p * r + 1.0/6.0;
+  p = p * r + 0.5;
+  p = p * r + 1.0;
+  p = p * r + 1.0;
+
+  const vi ni = (vi)t - (vi)shifter;
+  const vd scale = (vd)((ni + 1023L) << 52);
+
+  x = underflow ? zero : p * scale;
+}
+
+// In-place log1p for x >= 0:  y = 1+x is split into 2^k * m with m in
+// [sqrt(1/2), sqrt(2)), log(m) uses the atanh series in s = (m-1)/(m+1),
+// and the rounding error in forming 1+x is added back as a correction
+template<int W>
+HIMM_ALWAYS_INLINE void simd_log1p(typename SimdLanes<W>::vd& x)
+{
+  typedef typename SimdLanes<W>::vd vd;
+  typedef typename SimdLanes<W>::vi vi;
+
+  const vd zero = vd{};
+  const vd y = x + 1.0;
+  const vd c = (x - (y - 1.0)) / y;
+
+  const vi yb = (vi)y;
+  vi k = ((yb >> 52) & 0x7ffL) - 1023L;
+  vd m = (vd)((yb & 0x000fffffffffffffL) | 0x3ff0000000000000L);
+  const vi big = m > 1.41421356237309504880;
+  m = big ? m * 0.5 : m;
+  k = k - big;
+
+  // Exact conversion of the (small) integer k to double:
+  const vd shifter = zero + 6755399441055744.0;
+  const vd kd = (vd)((vi)shifter + k) - shifter;
+
+  const vd s = (m - 1.0) / (m + 1.0);
+  const vd s2 = s * s;
+  vd p = zero + 1.0/21.0;
+  p = p * s2 + 1.0/19.0;
+  p = p * s2 + 1.0/17.0;
+  p = p * s2 + 1.0/15.0;
+  p = p * s2 + 1.0/13.0;
+  p = p * s2 + 1.0/11.0;
+  p = p * s2 + 1.0/9.0;
+  p = p * s2 + 1.0/7.0;
+  p = p * s2 + 1.0/5.0;
+  p = p * s2 + 1.0/3.0;
+  p = p * s2 + 1.0;
+  const vd logm = 2.0 * s * p;
+
+  x = kd * 6.93147180369123816490e-01 + (logm + (c + kd * 1.90821492927058770002e-10));
+}
+
+// out = log(exp(u) + exp(v)), computed as max + log1p(exp(-|u-v|))
+template<int W>
+HIMM_ALWAYS_INLINE void simd_log_sum_exp(const typename SimdLanes<W>::vd& u,
+                                         const typename SimdLanes<W>::vd& v,
+                                         typename SimdLanes<W>::vd& out)
+{
+  typedef typename SimdLanes<W>::vd vd;
+
+  const vd m = u > v ? u : v;
+  const vd d = u - v;
+  vd e = d < 0.0 ? d : -d;
+  simd_exp<W>(e);
+  simd_log1p<W>(e);
+  out = (m == -std::numeric_limits<double>::infinity()) ? m : m + e;
+}
+
+template<int W>
+HIMM_ALWAYS_INLINE void simd_load(const double* src, typename SimdLanes<W>::vd& dst)
+{
+  std::memcpy(&dst, src, sizeof(dst));
+}
+
+template<int W>
+HIMM_ALWAYS_INLINE void simd_store(const typename SimdLanes<W>::vd& src, double* dst)
+{
+  std::memcpy(dst, &src, sizeof(src));
+}
+
+// Log emission probabilities of W consecutive patterns at time point t,
+// selected from the 2x2 table by the observed bits (of a single test)
+template<int W>
+HIMM_ALWAYS_INLINE void simd_emissions(const PackedObservations& obs, const size_t t, const size_t p,
+                                       const TwoStateLogPars& lp,
+                                       typename SimdLanes<W>::vd& em0,
+                                       typename SimdLanes<W>::vd& em1)
+{
+  typedef typename SimdLanes<W>::vd vd;
+  typedef typename SimdLanes<W>::vi vi;
+
+  vi lane;
+  for(int i=0L; i<W; ++i) lane[i] = i;
+
+  const vd zero = vd{};
+  const vi y = ((vi{} + static_cast<std::int64_t>(obs.bits(t, p, W))) >> lane) & 1L;
+  em0 = y != 0L ? zero + lp.em0[1L] : zero + lp.em0[0L];
+  em1 = y != 0L ? zero + lp.em1[1L] : zero + lp.em1[0L];
+}
+
+// Runs W patterns per lane group, leaving the remainder to the scalar kernel
+template<int W>
+HIMM_ALWAYS_INLINE void forward_two_state_lanes(const PackedObservations& obs, const size_t nT,
+                                                const TwoStateLogPars& lp,
+                                                const size_t from, const size_t to, double* ll)
+{
+  typedef typename SimdLanes<W>::vd vd;
+
+  const vd zero = vd{};
+  const vd p1 = zero + lp.p1;
+  const vd p1m = zero + lp.p1m;
+  const vd be = zero + lp.be;
+  const vd be1m = zero + lp.be1m;
+  const vd ga = zero + lp.ga;
+  const vd ga1m = zero + lp.ga1m;
+
+  size_t p = from;
+  for(; p+W<=to; p+=W)
+  {
+    vd em0, em1;
+    simd_emissions<W>(obs, 0L, p, lp, em0, em1);
+
+    vd logalpha0 = p1m + em0;
+    vd logalpha1 = p1 + em1;
+
+    for(size_t t=1L; t<nT; ++t)
+    {
+      simd_emissions<W>(obs, t, p, lp, em0, em1);
+
+      vd next0, next1;
+      simd_log_sum_exp<W>(logalpha0 + be1m + em0, logalpha1 + ga + em0, next0);
+      simd_log_sum_exp<W>(logalpha0 + be + em1, logalpha1 + ga1m + em1, next1);
+      logalpha0 = next0;
+      logalpha1 = next1;
+    }
+
+    vd total;
+    simd_log_sum_exp<W>(logalpha0, logalpha1, total);
+    simd_store<W>(total, ll + p);
+  }
+
+  // Scalar tail:
+  forward_two_state_scalar(obs, nT, lp, p, to, ll);
+}
+
+template<int W>
+HIMM_ALWAYS_INLINE void forward_two_state_step_lanes(const PackedObservations& obs, const size_t t,
+                                                     const TwoStateLogPars& lp,
+                                                     const size_t from, const size_t to,
+                                                     double* logalpha0, double* logalpha1)
+{
+  typedef typename SimdLanes<W>::vd vd;
+
+  const vd zero = vd{};
+  const vd be = zero + lp.be;
+  const vd be1m = zero + lp.be1m;
+  const vd ga = zero + lp.ga;
+  const vd ga1m = zero + lp.ga1m;
+
+  size_t p = from;
+  for(; p+W<=to; p+=W)
+  {
+    vd em0, em1, last0, last1;
+    simd_emissions<W>(obs, t, p, lp, em0, em1);
+    simd_load<W>(logalpha0 + p, last0);
+    simd_load<W>(logalpha1 + p, last1);
+
+    vd next0, next1;
+    simd_log_sum_exp<W>(last0 + be1m + em0, last1 + ga + em0, next0);
+    simd_log_sum_exp<W>(last0 + be + em1, last1 + ga1m + em1, next1);
+    simd_store<W>(next0, logalpha0 + p);
+    simd_store<W>(next1, logalpha1 + p);
+  }
+
+  forward_two_state_step_scalar(obs, t, lp, p, to, logalpha0, logalpha1);
+}
+
+// As forward_two_state_batch_scalar with W parameter sets per lane group:
+// the test result at each time point is shared by the lanes, so the
+// emission probabilities are loaded for that result
+template<int W>
+HIMM_ALWAYS_INLINE void forward_two_state_batch_lanes(const std::uint8_t* y, const size_t nT,
+                                                      const TwoStateLinBatch& batch,
+                                                      const double* p1, const double* p1m, const double weight,
+                                                      const size_t from, const size_t to, double* ll)
+{
+  typedef typename SimdLanes<W>::vd vd;
+
+  const vd one = vd{} + 1.0;
+  size_t m = from;
+  for(; m+W<=to; m+=W)
+  {
+    vd be, be1m, ga, ga1m, em0 = one, em1 = one;
+    simd_load<W>(batch.be.data() + m, be);
+    simd_load<W>(batch.be1m.data() + m, be1m);
+    simd_load<W>(batch.ga.data() + m, ga);
+    simd_load<W>(batch.ga1m.data() + m, ga1m);
+
+    vd alpha0, alpha1;
+    simd_load<W>(p1m + m, alpha0);
+    simd_load<W>(p1 + m, alpha1);
+    if(y[0L] != missing_test)
+    {
+      simd_load<W>(batch.em0[y[0L]].data() + m, em0);
+      simd_load<W>(batch.em1[y[0L]].data() + m, em1);
+    }
+    alpha0 *= em0;
+    alpha1 *= em1;
+    vd scale = alpha0 + alpha1;
+    alpha0 /= scale;
+    alpha1 /= scale;
+    double logscale[W] = {};
+
+    int since = 1L;
+    for(size_t t=1L; t<nT; ++t)
+    {
+      if(y[t] == missing_test)
+      {
+        em0 = one;
+        em1 = one;
+      }
+      else
+      {
+        simd_load<W>(batch.em0[y[t]].data() + m, em0);
+        simd_load<W>(batch.em1[y[t]].data() + m, em1);
+      }
+
+      const vd next0 = (alpha0 * be1m + alpha1 * ga) * em0;
+      const vd next1 = (alpha0 * be + alpha1 * ga1m) * em1;
+      const vd total = next0 + next1;
+      alpha0 = next0 / total;
+      alpha1 = next1 / total;
+      scale *= total;
+
+      if(++since == batch.interval)
+      {
+        for(int i=0L; i<W; ++i)
+        {
+          logscale[i] += std::log(scale[i]);
+        }
+        scale = one;
+        since = 0L;
+      }
+    }
+
+    for(int i=0L; i<W; ++i)
+    {
+      ll[m + i] += weight * (logscale[i] + std::log(scale[i]));
+    }
+  }
+
+  forward_two_state_batch_scalar(y, nT, batch, p1, p1m, weight, m, to, ll);
+}
+
+__attribute__((target("avx512f")))
+inline void forward_two_state_batch_avx512(const std::uint8_t* y, const size_t nT,
+                                           const TwoStateLinBatch& batch,
+                                           const double* p1, const double* p1m, const double weight,
+                                           const size_t from, const size_t to, double* ll)
+{
+  forward_two_state_batch_lanes<8>(y, nT, batch, p1, p1m, weight, from, to, ll);
+}
+
+__attribute__((target("avx2")))
+inline void forward_two_state_batch_avx2(const std::uint8_t* y, const size_t nT,
+                                         const TwoStateLinBatch& batch,
+                                         const double* p1, const double* p1m, const double weight,
+                                         const size_t from, const size_t to, double* ll)
+{
+  forward_two_state_batch_lanes<4>(y, nT, batch, p1, p1m, weight, from, to, ll);
+}
+
+__attribute__((target("avx512f")))
+inline void forward_two_state_step_avx512(const PackedObservations& obs, const size_t t,
+                                          const TwoStateLogPars& lp,
+                                          const size_t from, const size_t to,
+                                          double* logalpha0, double* logalpha1)
+{
+  forward_two_state_step_lanes<8>(obs, t, lp, from, to, logalpha0, logalpha1);
+}
+
+__attribute__((target("avx2")))
+inline void forward_two_state_step_avx2(const PackedObservations& obs, const size_t t,
+                                        const TwoStateLogPars& lp,
+                                        const size_t from, const size_t to,
+                                        double* logalpha0, double* logalpha1)
+{
+  forward_two_state_step_lanes<4>(obs, t, lp, from, to, logalpha0, logalpha1);
+}
+
+__attribute__((target("avx512f")))
+inline void forward_two_state_avx512(const PackedObservations& obs, const size_t nT,
+                                     const TwoStateLogPars& lp,
+                                     const size_t from, const size_t to, double* ll)
+{
+  forward_two_state_lanes<8>(obs, nT, lp, from, to, ll);
+}
+
+__attribute__((target("avx2")))
+inline void forward_two_state_avx2(const PackedObservations& obs, const size_t nT,
+                                   const TwoStateLogPars& lp,
+                                   const size_t from, const size_t to, double* ll)
+{
+  forward_two_state_lanes<4>(obs, nT, lp, from, to, ll);
+}
+
+#endif // HIMM_X86_SIMD
+
+// Number of patterns evaluated per lane group on this CPU (0 if no SIMD)
+inline int forward_simd_lanes()
+{
+#if HIMM_X86_SIMD
+  static const int lanes = __builtin_cpu_supports("avx512f") ? 8 :
+    (__builtin_cpu_supports("avx2") ? 4 : 0);
+  return lanes;
+#else
+  return 0;
+#endif
+}
+
+// SIMD kernel with runtime dispatch, falling back to the scalar kernel
+inline void forward_two_state_simd(const PackedObservations& obs, const size_t nT,
+                                   const TwoStateLogPars& lp,
+                                   const size_t from, const size_t to, double* ll)
+{
+#if HIMM_X86_SIMD
+  const int lanes = forward_simd_lanes();
+  if(lanes == 8L)
+  {
+    forward_two_state_avx512(obs, nT, lp, from, to, ll);
+    return;
+  }
+  if(lanes == 4L)
+  {
+    forward_two_state_avx2(obs, nT, lp, from, to, ll);
+    return;
+  }
+#endif
+  forward_two_state_scalar(obs, nT, lp, from, to, ll);
+}
+
+// Lockstep single time point with runtime dispatch
+inline void forward_two_state_step(const bool use_simd,
+                                   const PackedObservations& obs, const size_t t,
+                                   const TwoStateLogPars& lp,
+                                   const size_t from, const size_t to,
+                                   double* logalpha0, double* logalpha1)
+{
+#if HIMM_X86_SIMD
+  const int lanes = use_simd ? forward_simd_lanes() : 0L;
+  if(lanes == 8L)
+  {
+    forward_two_state_step_avx512(obs, t, lp, from, to, logalpha0, logalpha1);
+    return;
+  }
+  if(lanes == 4L)
+  {
+    forward_two_state_step_avx2(obs, t, lp, from, to, logalpha0, logalpha1);
+    return;
+  }
+#endif
+  forward_two_state_step_scalar(obs, t, lp, from, to, logalpha0, logalpha1);
+}
+
+// Batched kernel with runtime dispatch (see forward_two_state_batch_scalar)
+inline void forward_two_state_batch(const bool use_simd, const std::uint8_t* y, const size_t nT,
+                                    const TwoStateLinBatch& batch,
+                                    const double* p1, const double* p1m, const double weight,
+                                    const size_t from, const size_t to, double* ll)
+{
+#if HIMM_X86_SIMD
+  const int lanes = use_simd ? forward_simd_lanes() : 0L;
+  if(lanes == 8L)
+  {
+    forward_two_state_batch_avx512(y, nT, batch, p1, p1m, weight, from, to, ll);
+    return;
+  }
+  if(lanes == 4L)
+  {
+    forward_two_state_batch_avx2(y, nT, batch, p1, p1m, weight, from, to, ll);
+    return;
+  }
+#endif
+  forward_two_state_batch_scalar(y, nT, batch, p1, p1m, weight, from, to, ll);
+}
+
+#endif // FORWARD_KERNELS_H_
@@ -0,0 +1,417 @@
+// C interface to the likelihood engines
+
+#include <algorithm>
+#include <exception>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "himm_api.h"
+#include "Himm.h"
+#include "SimpleForward.h"
+#include "HimmTemplate.h"
+#include "himm_factory.h"
+#include "pointer_storage.h"
+
+namespace
+{
+  thread_local std::string last_error;
+
+  Himm* as_himm(himm_engine* engine)
+  {
+    return reinterpret_cast<Himm*>(engine);
+  }
+
+  himm_engine* as_engine(Himm* himm)
+  {
+    return reinterpret_cast<himm_engine*>(himm);
+  }
+
+  static_assert(HIMM_NA == himm_na_result, "HIMM_NA must match the engines' missing result");
+
+  // Runs f, turning any exception into HIMM_ERROR
+  template<class F>
+  int guarded(F f)
+  {
+    try
+    {
+      f();
+      return HIMM_OK;
+    }
+    catch(const std::exception& e)
+    {
+      last_error = e.what();
+    }
+    catch(...)
+    {
+      last_error = "Unknown error";
+    }
+    return HIMM_ERROR;
+  }
+
+  Himm* checked(himm_engine* engine)
+  {
+    if(!engine) throw std::runtime_error("engine must not be NULL");
+    return as_himm(engine);
+  }
+
+  // Single values go through setDhimmPars, which does not allocate:
+  void set_rates(Himm* himm, const himm_rates* rates)
+  {
+    if(rates->n_p1 == 1L && rates->n_beta_const == 1L && rates->n_gamma == 1L)
+    {
+      const double pars[HIMM_NPARS] = { rates->p1[0L], rates->beta_const[0L], rates->beta_freq,
+                                        rates->gamma[0L], rates->se, rates->sp };
+      himm->setDhimmPars(pars);
+    }
+    else
+    {
+      const double test_pars[2L] = { rates->se, rates->sp };
+      himm->setRateArrays(rates->p1, rates->n_p1, rates->beta_const, rates->n_beta_const,
+                          rates->beta_freq, rates->gamma, rates->n_gamma);
+      himm->setTestParArray(test_pars, 2L);
+    }
+  }
+}
+
+extern "C" {
+
+int himm_create(himm_engine_type type, const int* obs, int nP, int nT, himm_engine** engine)
+{
+  return guarded([&]()
+  {
+    if(!engine) throw std::runtime_error("engine must not be NULL");
+    *engine = 0L;
+    if(!obs) throw std::runtime_error("obs must not be NULL");
+    if(nP < 1L || nT < 1L) throw std::runtime_error("nP and nT must be at least 1");
+
+    if(type == HIMM_SIMPLE_FORWARD)
+    {
+      std::unique_ptr<SimpleForward> himm(new SimpleForward(nP, nT));
+      himm->addDataBuffer(obs);
+      *engine = as_engine(himm.release());
+    }
+    else if(type == HIMM_TEMPLATE_NX5)
+    {
+      if(nT != 5L) throw std::runtime_error("HIMM_TEMPLATE_NX5 requires nT == 5");
+      std::unique_ptr<HimmTemplate<0L, 5L, 32L>> himm(new HimmTemplate<0L, 5L, 32L>(nP, nT));
+      himm->addDataBuffer(obs);
+      *engine = as_engine(himm.release());
+    }
+    else if(type == HIMM_TEMPLATE)
+    {
+      std::unique_ptr<Himm> himm(new_himm_engine(nP, nT));
+      himm->addDataBuffer(obs);
+      *engine = as_engine(himm.release());
+    }
+    else
+    {
+      throw std::runtime_error("Unknown engine type");
+    }
+  });
+}
+
+himm_engine* himm_from_index(int pointer_index)
+{
+  if(pointer_index < 1L) return 0L;
+  return as_engine(find_pointer(pointer_index));
+}
+
+int himm_dims(himm_engine* engine, int* nP, int* nT)
+{
+  return guarded([&]()
+  {
+    Himm* himm = checked(engine);
+    if(nP) *nP = himm->getNumAnimals();
+    if(nT) *nT = himm->getNumTimepoints();
+  });
+}
+
+int himm_set_data(himm_engine* engine, const int* obs, int nP, int nT)
+{
+  return guarded([&]()
+  {
+    Himm* himm = checked(engine);
+    if(!obs) throw std::runtime_error("obs must not be NULL");
+    if(static_cast<size_t>(nP) != himm->getNumAnimals()) throw std::runtime_error("Wrong row dim");
+    if(static_cast<size_t>(nT) != himm->getNumTimepoints()) throw std::runtime_error("Wrong col dim");
+    himm->addDataBuffer(obs);
+  });
+}
+
+int himm_set_records(himm_engine* engine, const int* animal, const int* time, const int* result, size_t n)
+{
+  return guarded([&]()
+  {
+    Himm* himm = checked(engine);
+    if(n > 0L && (!animal || !time || !result)) throw std::runtime_error("animal, time and result must not be NULL");
+    himm->addRecordBuffer(animal, time, result, n);
+  });
+}
+
+int himm_append_timepoint(himm_engine* engine, const int* results, int nP)
+{
+  return guarded([&]()
+  {
+    Himm* himm = checked(engine);
+    if(!results) throw std::runtime_error("results must not be NULL");
+    if(static_cast<size_t>(nP) != himm->getNumAnimals()) throw std::runtime_error("results must have length nP");
+    himm->appendTimepointBuffer(results);
+  });
+}
+
+int himm_evaluate(himm_engine* engine, const double* pars, double* logdens)
+{
+  return himm_evaluate_batch(engine, pars, 1L, logdens);
+}
+
+int himm_evaluate_batch(himm_engine* engine, const double* pars, size_t n, double* logdens)
+{
+  return guarded([&]()
+  {
+    if(!engine || !pars || !logdens) throw std::runtime_error("engine, pars and logdens must not be NULL");
+
+    Himm* himm = as_himm(engine);
+    for(size_t i=0L; i<n; ++i)
+    {
+      logdens[i] = himm->evaluate(pars + i*HIMM_NPARS);
+    }
+  });
+}
+
+int himm_evaluate_sets(himm_engine* engine, const double* pars, size_t n, double* logdens)
+{
+  return guarded([&]()
+  {
+    if(!engine || !pars || !logdens) throw std::runtime_error("engine, pars and logdens must not be NULL");
+    as_himm(engine)->evaluateBatch(pars, n, logdens);
+  });
+}
+
+int himm_set_rates(himm_engine* engine, const double* p1, size_t n_p1, const double* beta_const,
+                   size_t n_beta_const, const double* beta_freq, size_t n_beta_freq,
+                   const double* gamma, size_t n_gamma)
+{
+  return guarded([&]()
+  {
+    Himm* himm = checked(engine);
+    if(!p1 || !beta_const || !beta_freq || !gamma) throw std::runtime_error("rates must not be NULL");
+    if(n_beta_freq == 0L) throw std::runtime_error("beta_freq must not be empty");
+
+    // Engines with more than one beta_freq (per herd or per disease) only
+    // take these through setRates:
+    if(n_beta_freq == 1L)
+    {
+      himm->setRateArrays(p1, n_p1, beta_const, n_beta_const, beta_freq[0L], gamma, n_gamma);
+    }
+    else
+    {
+      himm->setRates(std::vector<double>(p1, p1 + n_p1), std::vector<double>(beta_const, beta_const + n_beta_const),
+                     std::vector<double>(beta_freq, beta_freq + n_beta_freq), std::vector<double>(gamma, gamma + n_gamma));
+    }
+  });
+}
+
+int himm_set_test_pars(himm_engine* engine, const double* test_pars, size_t n)
+{
+  return guarded([&]()
+  {
+    Himm* himm = checked(engine);
+    if(!test_pars) throw std::runtime_error("test_pars must not be NULL");
+    himm->setTestParArray(test_pars, n);
+  });
+}
+
+int himm_calculate(himm_engine* engine, double* logdens)
+{
+  return guarded([&]()
+  {
+    Himm* himm = checked(engine);
+    himm->calculate();
+    if(logdens) *logdens = himm->logDensity();
+  });
+}
+
+int himm_calculate_gradient(himm_engine* engine, double* logdens, double* gradient)
+{
+  return guarded([&]()
+  {
+    Himm* himm = checked(engine);
+    himm->calculateGradient();
+    if(logdens) *logdens = himm->logDensity();
+    if(gradient) std::copy(himm->getGradient().begin(), himm->getGradient().end(), gradient);
+  });
+}
+
+int himm_gradient(himm_engine* engine, double* gradient)
+{
+  return guarded([&]()
+  {
+    Himm* himm = checked(engine);
+    if(!gradient) throw std::runtime_error("gradient must not be NULL");
+    std::copy(himm->getGradient().begin(), himm->getGradient().end(), gradient);
+  });
+}
+
+int himm_log_density(himm_engine* engine, double* logdens)
+{
+  return guarded([&]()
+  {
+    Himm* himm = checked(engine);
+    if(!logdens) throw std::runtime_error("logdens must not be NULL");
+    himm->refresh();
+    *logdens = himm->logDensity();
+  });
+}
+
+int himm_evaluate_rates(himm_engine* engine, const himm_rates* rates, double* logdens)
+{
+  return guarded([&]()
+  {
+    if(!engine || !rates || !logdens) throw std::runtime_error("engine, rates and logdens must not be NULL");
+
+    Himm* himm = as_himm(engine);
+    set_rates(himm, rates);
+    himm->update();
+    *logdens = himm->logDensity();
+  });
+}
+
+int himm_animal_loglik(himm_engine* engine, const himm_rates* rates, double* out)
+{
+  return guarded([&]()
+  {
+    if(!engine || !out) throw std::runtime_error("engine and out must not be NULL");
+
+    Himm* himm = as_himm(engine);
+    if(rates)
+    {
+      set_rates(himm, rates);
+      himm->update();
+    }
+    else
+    {
+      himm->refresh();
+    }
+    himm->animalLogLik(out);
+  });
+}
+
+int himm_sample_paths(himm_engine* engine, const himm_rates* rates, double (*uniform)(void*), void* state,
+                      int nP, int nT, double* paths)
+{
+  return guarded([&]()
+  {
+    if(!engine || !uniform || !paths) throw std::runtime_error("engine, uniform and paths must not be NULL");
+
+    Himm* himm = as_himm(engine);
+    if(rates) set_rates(himm, rates);
+    PackedObservations packed;
+    himm->samplePaths(packed, [uniform, state]() { return uniform(state); });
+    if(packed.patterns() != static_cast<size_t>(nP) || packed.timepoints() != static_cast<size_t>(nT))
+    {
+      throw std::runtime_error("paths does not match the dimensions of the data");
+    }
+
+    // Column-major, as for the data:
+    for(int t=0L; t<nT; ++t)
+    {
+      for(int i=0L; i<nP; ++i)
+      {
+        paths[i + static_cast<size_t>(t)*nP] = packed.get(t, i);
+      }
+    }
+  });
+}
+
+int himm_evaluate_k(himm_engine* engine, const double* pi1, const double* trans, const double* test_char,
+                    int K, double* logdens)
+{
+  return guarded([&]()
+  {
+    if(!engine || !pi1 || !trans || !test_char || !logdens) throw std::runtime_error("engine, parameters and logdens must not be NULL");
+    if(K < 1L) throw std::runtime_error("K must be at least 1");
+
+    Himm* himm = as_himm(engine);
+    if(himm->getNumStates() == 0L) throw std::runtime_error("The engine is not a K-state engine");
+    if(himm->getNumStates() != K) throw std::runtime_error("K does not match the number of states of the engine");
+
+    // The transition matrix goes via beta_const; there is no beta_freq or
+    // gamma:
+    const double none = 0.0;
+    himm->setRateArrays(pi1, K, trans, static_cast<size_t>(K)*K, 0.0, &none, 1L);
+    himm->setTestParArray(test_char, K);
+    himm->update();
+    *logdens = himm->logDensity();
+  });
+}
+
+int himm_smooth(himm_engine* engine, double* out, size_t n)
+{
+  return guarded([&]()
+  {
+    Himm* himm = checked(engine);
+    if(!out) throw std::runtime_error("out must not be NULL");
+    if(himm->smoothValues() > 0L && n != himm->getNumAnimals()*himm->getNumTimepoints()*himm->smoothValues())
+    {
+      throw std::runtime_error("out does not match the dimensions of the data");
+    }
+    himm->smooth(out);
+  });
+}
+
+size_t himm_smooth_values(himm_engine* engine)
+{
+  return engine ? as_himm(engine)->smoothValues() : 0L;
+}
+
+int himm_set_threads(himm_engine* engine, int threads)
+{
+  return guarded([&]()
+  {
+    checked(engine)->setThreads(threads);
+  });
+}
+
+int himm_threads(himm_engine* engine)
+{
+  return engine ? as_himm(engine)->getThreads() : 0L;
+}
+
+size_t himm_num_animals(himm_engine* engine)
+{
+  return engine ? as_himm(engine)->getNumAnimals() : 0L;
+}
+
+size_t himm_num_patterns(himm_engine* engine)
+{
+  return engine ? as_himm(engine)->getNumPatterns() : 0L;
+}
+
+int himm_num_states(himm_engine* engine)
+{
+  return engine ? as_himm(engine)->getNumStates() : 0L;
+}
+
+int himm_cache_stats(himm_engine* engine, double* hits, double* misses)
+{
+  return guarded([&]()
+  {
+    Himm* himm = checked(engine);
+    if(hits) *hits = himm->cacheHits();
+    if(misses) *misses = himm->cacheMisses();
+  });
+}
+
+void himm_destroy(himm_engine* engine)
+{
+  delete as_himm(engine);
+}
+
+const char* himm_last_error(void)
+{
+  return last_error.c_str();
+}
+
+}
@@ -0,0 +1,183 @@
+#ifndef HIMM_API_H_
+#define HIMM_API_H_
+
+/*
+  Plain C interface to the likelihood engines, used by the R module, the
+  JAGS functions and by callers that do not go through R or JAGS (it does
+  not depend on R).  Engines are created from a caller-owned buffer of
+  test results (which is compressed into unique histories and not kept),
+  after which himm_evaluate, himm_evaluate_batch and himm_evaluate_k
+  neither copy nor allocate for the engines of himm_create.
+
+  Parameter vectors have the six dhimm parameters in the order
+    p1, beta_const, beta_freq, gamma, se, sp
+  and a batch of n vectors is n consecutive blocks of six values.
+
+  Functions returning int give HIMM_OK on success, or HIMM_ERROR with the
+  reason available from himm_last_error (per thread).
+*/
+
+#include <limits.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define HIMM_OK 0
+#define HIMM_ERROR 1
+
+#define HIMM_NPARS 6
+
+/* A missing test result (the same value as NA for an R integer) */
+#define HIMM_NA INT_MIN
+
+typedef struct himm_engine himm_engine;
+
+typedef enum
+{
+  HIMM_SIMPLE_FORWARD = 1,
+  HIMM_TEMPLATE_NX5 = 2,
+  HIMM_TEMPLATE = 3
+} himm_engine_type;
+
+/* obs is an nP x nT column-major matrix (as in R) with 1 for a positive
+   test result and HIMM_NA for a missing test.  HIMM_TEMPLATE_NX5 requires nT == 5, and HIMM_TEMPLATE
+   uses the template specialised for nT up to 8 and HIMM_SIMPLE_FORWARD
+   otherwise. */
+int himm_create(himm_engine_type type, const int* obs, int nP, int nT, himm_engine** engine);
+
+/* Handle for an engine created elsewhere (e.g. from R), from the pointer
+   index used as the dhimm response; NULL if the index is not active */
+himm_engine* himm_from_index(int pointer_index);
+
+/* Number of animals and (current) number of time points */
+int himm_dims(himm_engine* engine, int* nP, int* nT);
+
+/* Replaces the data, with obs as for himm_create */
+int himm_set_data(himm_engine* engine, const int* obs, int nP, int nT);
+
+/* Replaces the data with n test records in long format (1-based animal
+   and time point), with the time points of an animal without a record
+   treated as missing */
+int himm_set_records(himm_engine* engine, const int* animal, const int* time, const int* result, size_t n);
+
+/* Adds a time point with one test result (or HIMM_NA) per animal, for
+   engines that support it; the engine is unchanged if this fails */
+int himm_append_timepoint(himm_engine* engine, const int* results, int nP);
+
+/* Results for the most recently used parameter vectors are cached by the
+   engine, so repeated values are not recalculated.  Either way the engine
+   is left with pars, as for himm_log_density */
+int himm_evaluate(himm_engine* engine, const double* pars, double* logdens);
+
+int himm_evaluate_batch(himm_engine* engine, const double* pars, size_t n, double* logdens);
+
+/* As himm_evaluate_batch, but with the n vectors evaluated together by the
+   engine (in SIMD lanes where supported) and not cached:  this allocates,
+   and leaves the engine with the parameters of one of the vectors */
+int himm_evaluate_sets(himm_engine* engine, const double* pars, size_t n, double* logdens);
+
+/* Sets the rates as for the engine's setRates, from arrays read in place:
+   for the two-state engines p1, beta_const, beta_freq and gamma, and for
+   K-state engines pi1 (as p1) and the K x K column-major transition matrix
+   (as beta_const) with beta_freq zero and gamma unused */
+int himm_set_rates(himm_engine* engine, const double* p1, size_t n_p1, const double* beta_const,
+                   size_t n_beta_const, const double* beta_freq, size_t n_beta_freq,
+                   const double* gamma, size_t n_gamma);
+
+/* Sets the test parameters as for the engine's setTestPars (e.g. se then
+   sp, or the probability of a positive test in each of K states) */
+int himm_set_test_pars(himm_engine* engine, const double* test_pars, size_t n);
+
+/* Calculates the log density for the current parameters (logdens may be
+   NULL), even if nothing has changed */
+int himm_calculate(himm_engine* engine, double* logdens);
+
+/* As himm_calculate, with the gradient with respect to the six dhimm
+   parameters into gradient (of length HIMM_NPARS, or NULL), which is also
+   kept for himm_gradient.  HIMM_ERROR, with the feature named by
+   himm_last_error, for models without a gradient (e.g. beta_freq != 0) */
+int himm_calculate_gradient(himm_engine* engine, double* logdens, double* gradient);
+
+int himm_gradient(himm_engine* engine, double* gradient);
+
+/* From the last calculation, or for the parameters of the last
+   himm_evaluate if that was served from the cache */
+int himm_log_density(himm_engine* engine, double* logdens);
+
+/* The dhimm parameters with p1, beta_const and gamma each of length 1 or
+   one per animal (and beta_const and gamma also seasonal, of any other
+   length up to nT), read in place */
+typedef struct
+{
+  const double* p1;
+  size_t n_p1;
+  const double* beta_const;
+  size_t n_beta_const;
+  double beta_freq;
+  const double* gamma;
+  size_t n_gamma;
+  double se;
+  double sp;
+} himm_rates;
+
+/* Not cached as for himm_evaluate, but nothing is recalculated if rates
+   are those of the last calculation */
+int himm_evaluate_rates(himm_engine* engine, const himm_rates* rates, double* logdens);
+
+/* Log-likelihood contribution of each animal, into out of length
+   himm_num_animals, from the last calculation if rates is NULL */
+int himm_animal_loglik(himm_engine* engine, const himm_rates* rates, double* out);
+
+/* Draws the latent state (0 or 1) of every animal at every time point from
+   the posterior, into the nP x nT column-major buffer paths, with uniform
+   called with state for each U(0,1) variate (with the current parameters
+   if rates is NULL) */
+int himm_sample_paths(himm_engine* engine, const himm_rates* rates, double (*uniform)(void*), void* state,
+                      int nP, int nT, double* paths);
+
+/* For K-state engines:  the initial distribution pi1 (length K), the K x K
+   column-major transition matrix trans, and the probability of a positive
+   test in each state, all read in place, with nothing recalculated if
+   these are the parameters of the last calculation.  HIMM_ERROR unless
+   himm_num_states is K */
+int himm_evaluate_k(himm_engine* engine, const double* pi1, const double* trans, const double* test_char,
+                    int K, double* logdens);
+
+/* Posterior probabilities from forward-backward smoothing under the
+   current parameters, as an nP x nT x himm_smooth_values column-major
+   array into out of length n (one value per animal and time point for the
+   two-state engines, and one per state for K-state engines) */
+int himm_smooth(himm_engine* engine, double* out, size_t n);
+
+/* 0 if engine is NULL or does not smooth */
+size_t himm_smooth_values(himm_engine* engine);
+
+/* 0 uses the module-level default */
+int himm_set_threads(himm_engine* engine, int threads);
+
+/* 0 if engine is NULL */
+int himm_threads(himm_engine* engine);
+
+/* The number of states of a K-state engine, and 0 if engine is NULL or
+   takes the dhimm parameters */
+int himm_num_states(himm_engine* engine);
+size_t himm_num_animals(himm_engine* engine);
+size_t himm_num_patterns(himm_engine* engine);
+
+/* Evaluations served from (hits) and added to (misses) the cache, counted
+   from the creation of the engine (new data empties the cache but keeps the
+   counts) */
+int himm_cache_stats(himm_engine* engine, double* hits, double* misses);
+
+/* Only for engines from himm_create */
+void himm_destroy(himm_engine* engine);
+
+const char* himm_last_error(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* HIMM_API_H_ */
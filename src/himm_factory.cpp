@@ -0,0 +1,36 @@
+// Dispatch from a runtime nT to the compiled engines
+
+#include <stdexcept>
+
+#include "himm_factory.h"
+#include "SimpleForward.h"
+#include "HimmTemplate.h"
+
+namespace
+{
+  // Each nT from T_nT up to himm_template_max_nT has its own HimmTemplate,
+  // so that the loops over time points are fully unrolled
+  template<int T_nT>
+  Himm* new_himm_template(const int nP, const int nT)
+  {
+    if(nT == T_nT) return new HimmTemplate<0L, T_nT, (1L << T_nT)>(nP, nT);
+    return new_himm_template<T_nT + 1L>(nP, nT);
+  }
+
+  template<>
+  Himm* new_himm_template<himm_template_max_nT + 1L>(const int nP, const int nT)
+  {
+    return new SimpleForward(nP, nT);
+  }
+}
+
+Himm* new_himm_engine(const int nP, const int nT)
+{
+  if(nP < 1L || nT < 1L) throw std::runtime_error("nP and nT must be at least 1");
+  return new_himm_template<1L>(nP, nT);
+}
+
+Himm* new_simple_forward(const int nP, const int nT)
+{
+  return new SimpleForward(nP, nT);
+}
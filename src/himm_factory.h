@@ -0,0 +1,23 @@
+#ifndef HIMM_FACTORY_H_
+#define HIMM_FACTORY_H_
+
+#include "Himm.h"
+
+// Engines for a number of time points chosen at runtime
+
+// Largest nT with a compiled HimmTemplate, which enumerates the 2^nT
+// latent sequences of each unique history:  beyond this the O(nT) forward
+// pass of SimpleForward is faster (from about nT = 9 or 10, depending on
+// the number of unique histories)
+const int himm_template_max_nT = 8L;
+
+// New engine for nP animals and nT time points, owned by the caller:  the
+// HimmTemplate specialised for nT if nT <= himm_template_max_nT, and
+// otherwise SimpleForward
+Himm* new_himm_engine(const int nP, const int nT);
+
+// New SimpleForward for nP animals and nT time points, owned by the caller
+// (for engines that hand the mean-field beta_freq term on to it)
+Himm* new_simple_forward(const int nP, const int nT);
+
+#endif // HIMM_FACTORY_H_
@@ -4,6 +4,10 @@
 #include <function/QFunction.h>
 
 #include "DHimm.h"
+#include "DHimmK.h"
+#include "DHimmPath.h"
+#include "DHimmVec.h"
+#include "HimmLogLik.h"
 
 using std::vector;
 
@@ -22,6 +26,10 @@ HimmModule::HimmModule() : Module("himm")
 {
   // For functions or scalar/vector distributions:
   insert(new DHimm);
+  insert(new DHimmK);
+  insert(new DHimmVec);
+  insert(new DHimmPath);
+  insert(new HimmLogLik);
 
   // For distributions using d/p/q/r:
   // Rinsert(new DLom);
@@ -0,0 +1,152 @@
+#ifndef PATTERN_STORAGE_H_
+#define PATTERN_STORAGE_H_
+
+#include <algorithm>
+#include <cstdint>
+#include <map>
+#include <vector>
+
+// Compression of observation histories into unique patterns
+
+// Collapses rows into the distinct values, in order of first appearance,
+// with the number of times each one occurs and the pattern used by each row
+template<class T_row>
+void compress_patterns(const std::vector<T_row>& rows, std::vector<T_row>& patterns,
+                       std::vector<double>& counts, std::vector<int>& index)
+{
+  std::map<T_row, int> lookup;
+
+  patterns.clear();
+  counts.clear();
+  index.resize(rows.size());
+
+  for(size_t i=0L; i<rows.size(); ++i)
+  {
+    const auto found = lookup.find(rows[i]);
+    if(found == lookup.end())
+    {
+      const int pt = patterns.size();
+      lookup.emplace(rows[i], pt);
+      patterns.push_back(rows[i]);
+      counts.push_back(1.0);
+      index[i] = pt;
+    }
+    else
+    {
+      counts[found->second] += 1.0;
+      index[i] = found->second;
+    }
+  }
+}
+
+// Binary observations of nPat patterns at nT time points, packed 64 per
+// word in time-major order:  bit p of time point t is bit (p & 63) of word
+// m_offset[t] + p/64, so 1e7 observations take about 1.25 MB.  Time points
+// may hold different numbers of patterns (compressed sparse rows), e.g. for
+// patterns sorted by decreasing length, so that nothing is stored past the
+// end of a shorter pattern.  Each entry may also be a value of several
+// bits (e.g. the results of several tests at one time point), held as one
+// such layout per bit (plane).  Also used for sampled latent states, with
+// one column per animal rather than pattern.
+class PackedObservations
+{
+  private:
+    std::vector<std::uint64_t> m_words;
+    std::vector<size_t> m_offset;
+    size_t m_nPat = 0L;
+    size_t m_nT = 0L;
+    int m_planes = 1L;
+    size_t m_plane_words = 0L;
+
+  public:
+    void resize(const size_t nPat, const size_t nT)
+    {
+      resize(std::vector<size_t>(nT, nPat));
+    }
+
+    // Time point t holds patterns [0, row_patterns[t]), with values of
+    // planes bits
+    void resize(const std::vector<size_t>& row_patterns, const int planes = 1L)
+    {
+      m_nT = row_patterns.size();
+      m_nPat = 0L;
+      m_offset.resize(m_nT + 1L);
+      m_offset[0L] = 0L;
+      for(size_t t=0L; t<m_nT; ++t)
+      {
+        m_nPat = std::max(m_nPat, row_patterns[t]);
+        m_offset[t+1L] = m_offset[t] + (row_patterns[t] + 63L) / 64L;
+      }
+      m_planes = planes;
+      m_plane_words = m_offset[m_nT];
+      m_words.assign(m_plane_words*m_planes, 0L);
+    }
+
+    size_t patterns() const
+    {
+      return m_nPat;
+    }
+
+    size_t timepoints() const
+    {
+      return m_nT;
+    }
+
+    int planes() const
+    {
+      return m_planes;
+    }
+
+    void set(const size_t t, const size_t p, const int y)
+    {
+      const std::uint64_t bit = std::uint64_t(1L) << (p & 63L);
+      const size_t w = m_offset[t] + (p >> 6L);
+      for(int k=0L; k<m_planes; ++k)
+      {
+        std::uint64_t& word = m_words[w + k*m_plane_words];
+        word = ((y >> k) & 1L) ? (word | bit) : (word & ~bit);
+      }
+    }
+
+    int get(const size_t t, const size_t p) const
+    {
+      const size_t w = m_offset[t] + (p >> 6L);
+      const int shift = p & 63L;
+      int rv = (m_words[w] >> shift) & 1L;
+      for(int k=1L; k<m_planes; ++k)
+      {
+        rv |= ((m_words[w + k*m_plane_words] >> shift) & 1L) << k;
+      }
+      return rv;
+    }
+
+    // The n <= 64 bits for patterns [p, p+n) at time point t (of the first
+    // plane), in the low bits of the return value
+    std::uint64_t bits(const size_t t, const size_t p, const int n) const
+    {
+      const std::uint64_t* row = m_words.data() + m_offset[t];
+      const size_t w = p >> 6L;
+      const int shift = p & 63L;
+      std::uint64_t rv = row[w] >> shift;
+      if(shift + n > 64L) rv |= row[w+1L] << (64L - shift);
+      return n == 64L ? rv : (rv & ((std::uint64_t(1L) << n) - 1L));
+    }
+
+    size_t bytes() const
+    {
+      return m_words.size() * sizeof(std::uint64_t);
+    }
+
+    // The packed words, e.g. to copy bytes() bytes in or out
+    std::uint64_t* words()
+    {
+      return m_words.data();
+    }
+
+    const std::uint64_t* words() const
+    {
+      return m_words.data();
+    }
+};
+
+#endif // PATTERN_STORAGE_H_
@@ -1,49 +1,153 @@
 // Storage of pointers
 
-#include <Rcpp.h>
+#include <atomic>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <stdexcept>
 #include <vector>
 
 #include "Himm.h"
 #include "pointer_storage.h"
 
-std::vector<Himm*> himm_pointers;
-std::vector<bool> himm_active;
+namespace
+{
+  // Handles are (generation << slot_bits) | (slot + 1), which stays within
+  // a positive int (and so is exactly representable as a JAGS double).  A
+  // slot whose generation reaches max_generation is retired rather than
+  // wrapping round to handles that were given out before:
+  const int slot_bits = 21L;
+  const size_t max_slots = (size_t(1L) << slot_bits) - 1L;
+  const unsigned max_generation = (1U << (31L - slot_bits)) - 1U;
+
+  // Slots live in fixed-size chunks that are never moved or freed, so a
+  // lookup only needs atomic loads while other threads add objects
+  const size_t chunk_bits = 10L;
+  const size_t chunk_size = size_t(1L) << chunk_bits;
+  const size_t max_chunks = (max_slots + chunk_size) / chunk_size;
+
+  struct Slot
+  {
+    std::atomic<Himm*> pointer;
+    std::atomic<unsigned> generation;
+  };
+
+  std::atomic<Slot*> chunks[max_chunks];
+  std::atomic<size_t> slots_used(0L);
+
+  // Guards the free list and slot allocation (but not lookups).  Freed
+  // slots are re-used oldest first, so that creating and deleting objects
+  // in a loop cycles through the free slots rather than using up the
+  // generations of one:
+  std::mutex registry_mutex;
+  std::deque<size_t> free_slots;
+
+  Slot* slot_of(const size_t slot)
+  {
+    Slot* chunk = chunks[slot >> chunk_bits].load(std::memory_order_acquire);
+    return chunk ? chunk + (slot & (chunk_size - 1L)) : 0L;
+  }
+
+  bool decode(const size_t pt_index, size_t& slot, unsigned& generation)
+  {
+    if(pt_index < 1L || pt_index > static_cast<size_t>(INT32_MAX)) return false;
+    slot = (pt_index & max_slots) - 1L;
+    generation = static_cast<unsigned>(pt_index >> slot_bits);
+    return (pt_index & max_slots) != 0L;
+  }
+}
 
 int add_pointer(Himm* pointer)
 {
-  himm_pointers.push_back(pointer);
-  himm_active.push_back(true);
-  return himm_active.size();
+  std::lock_guard<std::mutex> lock(registry_mutex);
+
+  size_t slot;
+  if(!free_slots.empty())
+  {
+    slot = free_slots.front();
+    free_slots.pop_front();
+  }
+  else
+  {
+    slot = slots_used.load(std::memory_order_relaxed);
+    if(slot >= max_slots) throw std::runtime_error("Too many active Himm objects");
+    if(slot % chunk_size == 0L)
+    {
+      Slot* chunk = new Slot[chunk_size];
+      for(size_t i=0L; i<chunk_size; ++i)
+      {
+        chunk[i].pointer.store(0L, std::memory_order_relaxed);
+        chunk[i].generation.store(0U, std::memory_order_relaxed);
+      }
+      chunks[slot >> chunk_bits].store(chunk, std::memory_order_release);
+    }
+    slots_used.store(slot + 1L, std::memory_order_release);
+  }
+
+  Slot* s = slot_of(slot);
+  s->pointer.store(pointer, std::memory_order_release);
+  const unsigned generation = s->generation.load(std::memory_order_relaxed);
+
+  return static_cast<int>((static_cast<size_t>(generation) << slot_bits) | (slot + 1L));
 }
 
 void remove_pointer(size_t pt_index)
 {
-  if(!verify_index(pt_index)) Rcpp::stop("Index inactive");
-  himm_active[pt_index-1L] = false;
-  himm_pointers[pt_index-1L] = 0L;
+  size_t slot;
+  unsigned generation;
+  std::lock_guard<std::mutex> lock(registry_mutex);
+  if(!decode(pt_index, slot, generation) || !find_pointer(pt_index)) throw std::runtime_error("Index inactive");
+
+  // Retire the generation before clearing the pointer, so that a
+  // concurrent lookup with this handle can only fail (after the last
+  // generation no handle matches, and the slot is not used again):
+  Slot* s = slot_of(slot);
+  s->generation.store(generation + 1U, std::memory_order_release);
+  s->pointer.store(0L, std::memory_order_release);
+  if(generation < max_generation) free_slots.push_back(slot);
 }
 
 void show_pointer(size_t pt_index)
 {
-  if(!verify_index(pt_index)) Rcpp::stop("Index inactive");
-  himm_pointers[pt_index-1L]->show();
+  get_pointer(pt_index)->show();
+}
+
+Himm* find_pointer(const size_t pt_index)
+{
+  size_t slot;
+  unsigned generation;
+  if(!decode(pt_index, slot, generation)) return 0L;
+  if(slot >= slots_used.load(std::memory_order_acquire)) return 0L;
+
+  // The generation is checked either side of reading the pointer, so a
+  // slot that is re-used in between is not returned for the old handle:
+  const Slot* s = slot_of(slot);
+  if(s->generation.load(std::memory_order_acquire) != generation) return 0L;
+  Himm* pointer = s->pointer.load(std::memory_order_acquire);
+  if(s->generation.load(std::memory_order_acquire) != generation) return 0L;
+  return pointer;
 }
 
 bool verify_index(const size_t pt_index)
 {
-  if(pt_index < 1L) return false;
-  if(pt_index > himm_active.size()) return false;
-  return himm_active[pt_index-1L];
+  return find_pointer(pt_index) != 0L;
 }
 
-Rcpp::LogicalVector active_index()
+// Whether each slot used so far currently holds an object
+std::vector<bool> active_pointers()
 {
-  Rcpp::LogicalVector rv = Rcpp::wrap(himm_active);
-  return rv;
+  std::vector<bool> active(slots_used.load(std::memory_order_acquire));
+  for(size_t i=0L; i<active.size(); ++i)
+  {
+    active[i] = slot_of(i)->pointer.load(std::memory_order_acquire) != 0L;
+  }
+
+  return active;
 }
 
 Himm* get_pointer(const size_t pt_index)
 {
-  if(!verify_index(pt_index)) Rcpp::stop("Index inactive");
-  return himm_pointers[pt_index-1L];
+  Himm* pointer = find_pointer(pt_index);
+  if(!pointer) throw std::runtime_error("Index inactive");
+  return pointer;
 }
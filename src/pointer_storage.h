@@ -1,16 +1,24 @@
 #ifndef POINTER_H_
 #define POINTER_H_
 
+#include <cstddef>
+#include <vector>
+
 class Himm;
 
+// Registry of Himm objects:  each object gets an integer handle (the
+// pointer index used as the dhimm response), made up of a slot and that
+// slot's generation so that the handle of a deleted object is never
+// mistaken for a later object re-using the slot.  Lookups are lock-free.
+
 int add_pointer(Himm* pointer);
 void remove_pointer(size_t pt_index);
 void show_pointer(size_t pt_index);
 bool verify_index(const size_t pt_index);
 Himm* get_pointer(const size_t pt_index);
-
-// Can't include this here:
-// #include <Rcpp.h>
-// Rcpp::LogicalVector active_index();
+// As get_pointer, but returns 0 rather than stopping for an inactive index
+Himm* find_pointer(const size_t pt_index);
+// Whether each slot used so far currently holds an object
+std::vector<bool> active_pointers();
 
 #endif // POINTER_H_
@@ -1,9 +1,17 @@
 #include <Rcpp.h>
+#include <algorithm>
+#include <cstring>
+#include <vector>
 
 #include "ForwardTemplate.h"
-#include "SimpleForward.h"
+#include "MultiDiseaseForward.h"
+// HerdForward.h also includes SimpleForward.h:
+#include "HerdForward.h"
 #include "HimmTemplate.h"
+#include "HimmRuntime.h"
+#include "himm_api.h"
 #include "pointer_storage.h"
+#include "thread_pool.h"
 
 template <class RcppModuleClassName>
 RcppModuleClassName* invalidate_default_constructor() {
@@ -12,19 +20,370 @@ RcppModuleClassName* invalidate_default_constructor() {
 }
 #define DISABLE_DEFAULT_CONSTRUCTOR() .factory(invalidate_default_constructor)
 
+// Everything but the settings and diagnostics of particular engines goes
+// through the C interface (himm_api.h), with the engine found from the
+// pointer index of the object
+
+template <class T_Himm>
+himm_engine* engine_of(T_Himm* himm)
+{
+  himm_engine* engine = himm_from_index(himm->getIndex());
+  if(!engine) Rcpp::stop("Index inactive");
+  return engine;
+}
+
+// Stops with the reason from the C interface unless status is HIMM_OK
+inline void check_status(const int status)
+{
+  if(status != HIMM_OK) Rcpp::stop(himm_last_error());
+}
+
+template <class T_Himm>
+void add_data(T_Himm* himm, Rcpp::IntegerMatrix data)
+{
+  check_status(himm_set_data(engine_of(himm), data.begin(), data.nrow(), data.ncol()));
+}
+
+template <class T_Himm>
+void add_records(T_Himm* himm, Rcpp::IntegerVector animal, Rcpp::IntegerVector time, Rcpp::IntegerVector result)
+{
+  if(time.size() != animal.size() || result.size() != animal.size()) Rcpp::stop("animal, time and result must have the same length");
+  check_status(himm_set_records(engine_of(himm), animal.begin(), time.begin(), result.begin(), animal.size()));
+}
+
+template <class T_Himm>
+void append_timepoint(T_Himm* himm, Rcpp::IntegerVector results)
+{
+  check_status(himm_append_timepoint(engine_of(himm), results.begin(), results.size()));
+}
+
+template <class T_Himm>
+void set_rates(T_Himm* himm, Rcpp::NumericVector prv1, Rcpp::NumericVector beta_const,
+               Rcpp::NumericVector beta_freq, Rcpp::NumericVector gamm)
+{
+  check_status(himm_set_rates(engine_of(himm), prv1.begin(), prv1.size(), beta_const.begin(), beta_const.size(),
+                              beta_freq.begin(), beta_freq.size(), gamm.begin(), gamm.size()));
+}
+
+template <class T_Himm>
+void set_test_pars(T_Himm* himm, Rcpp::NumericVector test_pars)
+{
+  check_status(himm_set_test_pars(engine_of(himm), test_pars.begin(), test_pars.size()));
+}
+
+// For K-state engines
+template <class T_Himm>
+void set_parameters(T_Himm* himm, Rcpp::NumericVector pi1, Rcpp::NumericMatrix trans, Rcpp::NumericVector test_char)
+{
+  if(trans.nrow() != trans.ncol() || trans.nrow() != pi1.size()) Rcpp::stop("Transition matrix must be K x K");
+
+  himm_engine* engine = engine_of(himm);
+  const double none = 0.0;
+  check_status(himm_set_rates(engine, pi1.begin(), pi1.size(), trans.begin(), trans.size(), &none, 1L, &none, 1L));
+  check_status(himm_set_test_pars(engine, test_char.begin(), test_char.size()));
+}
+
+template <class T_Himm>
+void calculate(T_Himm* himm)
+{
+  check_status(himm_calculate(engine_of(himm), 0L));
+}
+
+template <class T_Himm>
+void calculate_gradient(T_Himm* himm)
+{
+  check_status(himm_calculate_gradient(engine_of(himm), 0L, 0L));
+}
+
+// Log density for p1 with the other parameters fixed, for testing
+template <class T_Himm>
+double test_p1(T_Himm* himm, const double p1)
+{
+  himm_engine* engine = engine_of(himm);
+  const double beta_const = 0.05, beta_freq = 0.0, gamma = 0.08;
+  const double test_pars[2L] = { 0.9, 0.99 };
+  check_status(himm_set_rates(engine, &p1, 1L, &beta_const, 1L, &beta_freq, 1L, &gamma, 1L));
+  check_status(himm_set_test_pars(engine, test_pars, 2L));
+  double logdens;
+  check_status(himm_calculate(engine, &logdens));
+  return logdens;
+}
+
+template <class T_Himm>
+double log_density(T_Himm* himm)
+{
+  double logdens;
+  check_status(himm_log_density(engine_of(himm), &logdens));
+  return logdens;
+}
+
+template <class T_Himm>
+Rcpp::NumericVector gradient(T_Himm* himm)
+{
+  Rcpp::NumericVector rv(HIMM_NPARS);
+  check_status(himm_gradient(engine_of(himm), rv.begin()));
+  return rv;
+}
+
+template <class T_Himm>
+Rcpp::NumericVector animal_loglik(T_Himm* himm)
+{
+  himm_engine* engine = engine_of(himm);
+  Rcpp::NumericVector rv(himm_num_animals(engine));
+  check_status(himm_animal_loglik(engine, 0L, rv.begin()));
+  return rv;
+}
+
+// An nP x nT matrix for two-state engines, and an nP x nT x K array for
+// K-state engines
+template <class T_Himm>
+Rcpp::NumericVector smooth(T_Himm* himm)
+{
+  himm_engine* engine = engine_of(himm);
+  int nP, nT;
+  check_status(himm_dims(engine, &nP, &nT));
+  const int values = himm_smooth_values(engine);
+
+  Rcpp::NumericVector rv(static_cast<size_t>(nP)*nT*values);
+  check_status(himm_smooth(engine, rv.begin(), rv.size()));
+  if(values == 1L) rv.attr("dim") = Rcpp::Dimension(nP, nT);
+  else rv.attr("dim") = Rcpp::Dimension(nP, nT, values);
+  return rv;
+}
+
+template <class T_Himm>
+int get_threads(T_Himm* himm)
+{
+  return himm_threads(engine_of(himm));
+}
+
+template <class T_Himm>
+void set_threads(T_Himm* himm, const int threads)
+{
+  check_status(himm_set_threads(engine_of(himm), threads));
+}
+
+template <class T_Himm>
+int n_patterns(T_Himm* himm)
+{
+  return himm_num_patterns(engine_of(himm));
+}
+
+template <class T_Himm>
+int n_timepoints(T_Himm* himm)
+{
+  int nT;
+  check_status(himm_dims(engine_of(himm), 0L, &nT));
+  return nT;
+}
+
+template <class T_Himm>
+double cache_hits(T_Himm* himm)
+{
+  double hits;
+  check_status(himm_cache_stats(engine_of(himm), &hits, 0L));
+  return hits;
+}
+
+template <class T_Himm>
+double cache_misses(T_Himm* himm)
+{
+  double misses;
+  check_status(himm_cache_stats(engine_of(himm), 0L, &misses));
+  return misses;
+}
+
+template <class T_Himm>
+int pointer_index(T_Himm* himm)
+{
+  return himm->getIndex();
+}
+
+// K-state forward engines share the same interface:
+template <class T_Forward>
+void expose_forward(const char* name)
+{
+  Rcpp::class_<T_Forward>(name)
+    DISABLE_DEFAULT_CONSTRUCTOR()
+    .template constructor<int, int, int>("Constructor with 3 arguments (nP, nT, K)")
+    .method("show", &T_Forward::show, "The show method")
+    .method("addData", &add_data<T_Forward>, "Add an nP x nT matrix of test results")
+    .method("setParameters", &set_parameters<T_Forward>, "Set initial probabilities, transition matrix and test positivity")
+    .method("calculate", &calculate<T_Forward>, "Calculate the log density")
+    .method("smooth", &smooth<T_Forward>, "Get the posterior probability of each state as an nP x nT x K array")
+    .property("smooth_checkpoints", &T_Forward::getSmoothCheckpoints, &T_Forward::setSmoothCheckpoints, "Store forward messages only every sqrt(nT) time points when smoothing, to save memory at the cost of recomputing the messages between them (default FALSE)")
+    .property("K", &T_Forward::getK, "Get the number of latent states")
+    .property("threads", &get_threads<T_Forward>, &set_threads<T_Forward>, "Number of threads (0 uses the module default)")
+    .property("n_patterns", &n_patterns<T_Forward>, "Get the number of unique observation histories")
+    .property("log_density", &log_density<T_Forward>, "Get the log density")
+    .property("animal_loglik", &animal_loglik<T_Forward>, "Get the log-likelihood contribution of each animal")
+    .property("pointer_index", &pointer_index<T_Forward>, "Get the pointer index")
+    ;
+}
+
+// Multi-disease forward engines share the same interface:
+template <class T_MultiDisease>
+void expose_multi_disease(const char* name)
+{
+  Rcpp::class_<T_MultiDisease>(name)
+    DISABLE_DEFAULT_CONSTRUCTOR()
+    .template constructor<int, int, int>("Constructor with 3 arguments (nP, nT, nD)")
+    .method("show", &T_MultiDisease::show, "The show method")
+    .method("addData", &add_data<T_MultiDisease>, "Add an nP x nT matrix of any-positive test results")
+    .method("setRates", &set_rates<T_MultiDisease>, "Set p1, beta_const, beta_freq and gamma (length 1 or nD)")
+    .method("setTestPars", &set_test_pars<T_MultiDisease>, "Set se followed by sp (length 2 or 2*nD)")
+    .method("calculate", &calculate<T_MultiDisease>, "Calculate the log density")
+    .property("nD", &T_MultiDisease::getND, "Get the number of diseases")
+    .property("threads", &get_threads<T_MultiDisease>, &set_threads<T_MultiDisease>, "Number of threads (0 uses the module default)")
+    .property("n_patterns", &n_patterns<T_MultiDisease>, "Get the number of unique observation histories")
+    .property("log_density", &log_density<T_MultiDisease>, "Get the log density")
+    .property("animal_loglik", &animal_loglik<T_MultiDisease>, "Get the log-likelihood contribution of each animal")
+    .property("pointer_index", &pointer_index<T_MultiDisease>, "Get the pointer index")
+    ;
+}
+
+// Log density for each consecutive set of the six dhimm parameters in pars,
+// via the C interface, for the object with the given pointer index
+Rcpp::NumericVector evaluate_index(const int pointer_index, Rcpp::NumericVector pars)
+{
+  if(pars.size() % HIMM_NPARS != 0L) Rcpp::stop("The length of pars must be a multiple of 6");
+  himm_engine* engine = himm_from_index(pointer_index);
+  if(!engine) Rcpp::stop("Index inactive");
+
+  Rcpp::NumericVector rv(pars.size() / HIMM_NPARS);
+  if(himm_evaluate_batch(engine, pars.begin(), rv.size(), rv.begin()) != HIMM_OK)
+  {
+    Rcpp::stop(himm_last_error());
+  }
+  return rv;
+}
+
 //using Himm_1x1 = HimmTemplate<1L, 1L>;
 //RCPP_EXPOSED_CLASS(Himm_1x1)
 
 // TODO: Rcpp derives class to save retyping below???
 
-Rcpp::LogicalVector active_index();
+double r_uniform(void* /* state */)
+{
+  return R::unif_rand();
+}
+
+// Draws of the latent states from the posterior, using the R random number
+// generator, as the packed words of each draw (in native byte order)
+template <class T_Himm>
+Rcpp::RawVector sample_paths(T_Himm* himm, const int n_draws)
+{
+  if(n_draws < 1L) Rcpp::stop("n_draws must be at least 1");
+
+  himm_engine* engine = engine_of(himm);
+  int nP, nT;
+  check_status(himm_dims(engine, &nP, &nT));
+
+  Rcpp::RNGScope scope;
+  std::vector<double> draw(static_cast<size_t>(nP)*nT);
+  PackedObservations paths;
+  paths.resize(nP, nT);
+  const size_t bytes = paths.bytes();
+  Rcpp::RawVector rv(bytes * n_draws);
+  for(int d=0L; d<n_draws; ++d)
+  {
+    check_status(himm_sample_paths(engine, 0L, &r_uniform, 0L, nP, nT, draw.data()));
+    for(int t=0L; t<nT; ++t)
+    {
+      for(int i=0L; i<nP; ++i)
+      {
+        paths.set(t, i, draw[i + static_cast<size_t>(t)*nP] != 0.0);
+      }
+    }
+    std::memcpy(rv.begin() + d*bytes, paths.words(), bytes);
+  }
+  return rv;
+}
+
+// Log density for each row of an M x 6 matrix of the dhimm parameters (p1,
+// beta_const, beta_freq, gamma, se, sp), evaluated together by the engine
+template <class T_Himm>
+Rcpp::NumericVector evaluate_batch(T_Himm* himm, Rcpp::NumericMatrix pars)
+{
+  if(pars.ncol() != HIMM_NPARS) Rcpp::stop("pars must have 6 columns");
+
+  const size_t M = pars.nrow();
+  std::vector<double> sets(M*HIMM_NPARS);
+  for(size_t m=0L; m<M; ++m)
+  {
+    for(size_t k=0L; k<HIMM_NPARS; ++k)
+    {
+      sets[m*HIMM_NPARS + k] = pars(m, k);
+    }
+  }
+
+  Rcpp::NumericVector rv(M);
+  check_status(himm_evaluate_sets(engine_of(himm), sets.data(), M, rv.begin()));
+  return rv;
+}
+
+// Up to date with the parameters, as for log_density:
+std::vector<double> herd_loglik(HerdForward* herds)
+{
+  herds->refresh();
+  return herds->getHerdLogLik();
+}
+
+// HimmTemplate diagnostics as matrices:
+
+template <class T_Himm>
+Rcpp::IntegerMatrix latent_sequences(T_Himm* himm)
+{
+  const std::vector<int> zs = himm->getZs();
+  Rcpp::IntegerMatrix rv(zs.size() / himm->getNumTimepoints(), himm->getNumTimepoints());
+  std::copy(zs.begin(), zs.end(), rv.begin());
+  return rv;
+}
+
+template <class T_Himm>
+Rcpp::NumericMatrix obs_probs(T_Himm* himm)
+{
+  const std::vector<double> probs = himm->getObsProbs();
+  Rcpp::NumericMatrix rv(probs.size() / himm->getNumAnimals(), himm->getNumAnimals());
+  std::copy(probs.begin(), probs.end(), rv.begin());
+  return rv;
+}
+
+// Unpacks draws from samplePaths into an nP x nT x n_draws array of 0/1
+Rcpp::IntegerVector unpack_paths(Rcpp::RawVector packed, const int nP, const int nT)
+{
+  PackedObservations paths;
+  paths.resize(nP, nT);
+  const size_t bytes = paths.bytes();
+  if(bytes == 0L || packed.size() % bytes != 0L) Rcpp::stop("The packed draws do not match nP and nT");
+  const int n_draws = packed.size() / bytes;
+
+  Rcpp::IntegerVector rv(nP * nT * n_draws);
+  for(int d=0L; d<n_draws; ++d)
+  {
+    std::memcpy(paths.words(), packed.begin() + d*bytes, bytes);
+    for(int t=0L; t<nT; ++t)
+    {
+      for(int i=0L; i<nP; ++i)
+      {
+        rv[i + t*nP + d*nP*nT] = paths.get(t, i);
+      }
+    }
+  }
+  rv.attr("dim") = Rcpp::Dimension(nP, nT, n_draws);
+  return rv;
+}
 
 RCPP_MODULE(himm_module){
 
 	using namespace Rcpp;
   
-  function("active_index", &active_index, "Get vector of indexes");
+  function("active_index", &active_pointers, "Get vector of indexes");
   function("show_pointer", &show_pointer, "Show a pointer info");
+  function("get_threads", &get_default_threads, "Get the default number of threads");
+  function("set_threads", &set_default_threads, "Set the default number of threads (including for dhimm)");
+  function("evaluate", &evaluate_index, "Log density for each set of six dhimm parameters, by pointer index");
+  function("unpack_paths", &unpack_paths, "Unpack draws from samplePaths into an nP x nT x n_draws array");
 
 //  using Himm_Nx10 = HimmTemplate<0L, 10L, 1024L>;
   
@@ -34,30 +393,124 @@ RCPP_MODULE(himm_module){
     .constructor<int, int>("Constructor with 2 arguments")
     .method("show", &Himm_Nx5::show, "The show method")
     .method("calculate_zi", &Himm_Nx5::calculateZi, "The show method")
-    .method("addData", &Himm_Nx5::addData, "The show method")
-    .method("calculate", &Himm_Nx5::calculate, "The show method")
-    .method("test", &Himm_Nx5::test, "The show method")
+    .method("addData", &add_data<Himm_Nx5>, "The show method")
+    .method("addRecords", &add_records<Himm_Nx5>, "Add test results in long format (animal, time, result)")
+    .method("calculate", &calculate<Himm_Nx5>, "The show method")
+    .method("calculateWithGradient", &calculate_gradient<Himm_Nx5>, "Calculate the log density and its gradient")
+    .method("setRates", &set_rates<Himm_Nx5>, "Set p1, beta_const, beta_freq and gamma")
+    .method("setTestPars", &set_test_pars<Himm_Nx5>, "Set se and sp")
+    .method("test", &test_p1<Himm_Nx5>, "The show method")
     .method("obsprev", &Himm_Nx5::obsprev, "The show method")
     .method("getZis", &Himm_Nx5::getZis, "The show method")      
-    .method("getObsProbs", &Himm_Nx5::getObsProbs, "The show method")      
-    .property("zs", &Himm_Nx5::getZs, "Get z matrix")
-    .property("log_density", &Himm_Nx5::logDensity, "Get z matrix")
-    .property("pointer_index", &Himm_Nx5::getIndex, "Get z matrix")
+    .method("getObsProbs", &obs_probs<Himm_Nx5>, "The show method")      
+    .property("zs", &latent_sequences<Himm_Nx5>, "Get z matrix")
+    .property("log_density", &log_density<Himm_Nx5>, "Get z matrix")
+    .method("evaluateBatch", &evaluate_batch<Himm_Nx5>, "Get the log density for each row of an M x 6 matrix of parameters")
+    .method("samplePaths", &sample_paths<Himm_Nx5>, "Draw latent states from the posterior (packed, see unpack_paths)")
+    .property("gradient", &gradient<Himm_Nx5>, "Get the gradient from calculateWithGradient")
+    .property("animal_loglik", &animal_loglik<Himm_Nx5>, "Get the log-likelihood contribution of each animal")
+    .property("pointer_index", &pointer_index<Himm_Nx5>, "Get z matrix")
+    .property("threads", &get_threads<Himm_Nx5>, &set_threads<Himm_Nx5>, "Number of threads (0 uses the module default)")
+    .property("n_patterns", &n_patterns<Himm_Nx5>, "Get the number of unique observation histories")
+    .property("pattern_counts", &Himm_Nx5::getPatternCounts, "Get the number of animals with each unique history")
+    .property("cache_hits", &cache_hits<Himm_Nx5>, "Get the number of evaluations served from the cache")
+    .property("cache_misses", &cache_misses<Himm_Nx5>, "Get the number of evaluations not in the cache")
     //    .property("states", &Simulation::GetStates, "Get the total for each state")
     ;
 
+  // Many herds in one object, with animals numbered herd by herd:
+  class_<HerdForward>("HerdForward")
+    DISABLE_DEFAULT_CONSTRUCTOR()
+    .constructor<std::vector<int>, int>("Constructor with 2 arguments (herd sizes, nT)")
+    .method("addData", &add_data<HerdForward>, "Add an nP x nT matrix of test results, with the animals of each herd in consecutive rows")
+    .method("addRecords", &add_records<HerdForward>, "Add test results in long format (animal, time, result)")
+    .method("appendTimepoint", &append_timepoint<HerdForward>, "Add a time point with one test result (or NA) per animal")
+    .method("setRates", &set_rates<HerdForward>, "Set p1, beta_const, beta_freq and gamma, each shared, per herd or per animal")
+    .method("setTestPars", &set_test_pars<HerdForward>, "Set se and sp")
+    .method("calculate", &calculate<HerdForward>, "Calculate the log density")
+    .method("calculateWithGradient", &calculate_gradient<HerdForward>, "Calculate the log density and its gradient")
+    .method("evaluateBatch", &evaluate_batch<HerdForward>, "Get the log density for each row of an M x 6 matrix of parameters")
+    .method("samplePaths", &sample_paths<HerdForward>, "Draw latent states from the posterior (packed, see unpack_paths)")
+    .property("log_density", &log_density<HerdForward>, "Get the log density")
+    .property("herd_loglik", &herd_loglik, "Get the log-likelihood of each herd")
+    .property("animal_loglik", &animal_loglik<HerdForward>, "Get the log-likelihood contribution of each animal")
+    .property("gradient", &gradient<HerdForward>, "Get the gradient from calculateWithGradient")
+    .property("n_herds", &HerdForward::getNumHerds, "Get the number of herds")
+    .property("n_patterns", &n_patterns<HerdForward>, "Get the number of unique observation histories over all herds")
+    .property("threads", &get_threads<HerdForward>, &set_threads<HerdForward>, "Number of threads (0 uses the module default)")
+    .property("pointer_index", &pointer_index<HerdForward>, "Get the pointer index")
+    ;
+
+  // Any nT, with the engine chosen at runtime:
+  class_<HimmRuntime>("Himm_NxT")
+    DISABLE_DEFAULT_CONSTRUCTOR()
+    .constructor<int, int>("Constructor with 2 arguments (nP, nT)")
+    .method("addData", &add_data<HimmRuntime>, "Add an nP x nT matrix of test results")
+    .method("addRecords", &add_records<HimmRuntime>, "Add test results in long format (animal, time, result)")
+    .method("setRates", &set_rates<HimmRuntime>, "Set p1, beta_const, beta_freq and gamma")
+    .method("setTestPars", &set_test_pars<HimmRuntime>, "Set se and sp")
+    .method("calculate", &calculate<HimmRuntime>, "Calculate the log density")
+    .method("calculateWithGradient", &calculate_gradient<HimmRuntime>, "Calculate the log density and its gradient")
+    .method("evaluateBatch", &evaluate_batch<HimmRuntime>, "Get the log density for each row of an M x 6 matrix of parameters")
+    .method("samplePaths", &sample_paths<HimmRuntime>, "Draw latent states from the posterior (packed, see unpack_paths)")
+    .property("log_density", &log_density<HimmRuntime>, "Get the log density")
+    .property("gradient", &gradient<HimmRuntime>, "Get the gradient from calculateWithGradient")
+    .property("animal_loglik", &animal_loglik<HimmRuntime>, "Get the log-likelihood contribution of each animal")
+    .property("n_patterns", &n_patterns<HimmRuntime>, "Get the number of unique observation histories")
+    .property("nT", &HimmRuntime::getNT, "Get the number of time points")
+    .property("engine", &HimmRuntime::getEngine, "Get the name of the engine used for this nT")
+    .property("pointer_index", &HimmRuntime::getIndex, "Get the pointer index (for dhimm)")
+    ;
+
   using SimpleForward = SimpleForward;
   class_<SimpleForward>("SimpleForward")
     DISABLE_DEFAULT_CONSTRUCTOR()
     .constructor<int, int>("Constructor with 2 arguments")
     .method("show", &SimpleForward::show, "The show method")
-    .method("addData", &SimpleForward::addData, "The show method")
-    .method("calculate", &SimpleForward::calculate, "The show method")
-    .method("test", &SimpleForward::test, "The show method")
-    .property("log_density", &SimpleForward::logDensity, "Get z matrix")
-    .property("pointer_index", &SimpleForward::getIndex, "Get z matrix")
+    .method("addData", &add_data<SimpleForward>, "The show method")
+    .method("addRecords", &add_records<SimpleForward>, "Add test results in long format (animal, time, result)")
+    .method("appendTimepoint", &append_timepoint<SimpleForward>, "Add a time point with one test result (or NA) per animal, updating the log density from the last time point where possible")
+    .method("calculate", &calculate<SimpleForward>, "The show method")
+    .method("calculateWithGradient", &calculate_gradient<SimpleForward>, "Calculate the log density and its gradient")
+    .method("setRates", &set_rates<SimpleForward>, "Set p1, beta_const, beta_freq and gamma")
+    .method("setTestPars", &set_test_pars<SimpleForward>, "Set se and sp, or the se then the sp of up to 4 tests per time point")
+    .method("test", &test_p1<SimpleForward>, "The show method")
+    .property("log_density", &log_density<SimpleForward>, "Get z matrix")
+    .method("evaluateBatch", &evaluate_batch<SimpleForward>, "Get the log density for each row of an M x 6 matrix of parameters")
+    .method("samplePaths", &sample_paths<SimpleForward>, "Draw latent states from the posterior (packed, see unpack_paths)")
+    .method("smooth", &smooth<SimpleForward>, "Get the posterior probability of infection as an nP x nT matrix")
+    .property("gradient", &gradient<SimpleForward>, "Get the gradient from calculateWithGradient")
+    .property("animal_loglik", &animal_loglik<SimpleForward>, "Get the log-likelihood contribution of each animal")
+    .property("pointer_index", &pointer_index<SimpleForward>, "Get z matrix")
+    .property("threads", &get_threads<SimpleForward>, &set_threads<SimpleForward>, "Number of threads (0 uses the module default)")
+    .property("n_patterns", &n_patterns<SimpleForward>, "Get the number of unique observation histories")
+    .property("pattern_counts", &SimpleForward::getPatternCounts, "Get the number of animals with each unique history")
+    .property("n_rate_groups", &SimpleForward::getNumRateGroups, "Get the number of distinct sets of per-animal rates")
+    .property("n_tests", &SimpleForward::getNumTests, "Get the number of tests per time point")
+    .property("nT", &n_timepoints<SimpleForward>, "Get the number of time points")
+    .property("cache_hits", &cache_hits<SimpleForward>, "Get the number of evaluations served from the cache")
+    .property("cache_misses", &cache_misses<SimpleForward>, "Get the number of evaluations not in the cache")
+    .property("simd", &SimpleForward::getSimd, &SimpleForward::setSimd, "Use the SIMD kernel where available")
+    .property("simd_lanes", &SimpleForward::getSimdLanes, "Get the number of patterns per SIMD lane group (0 for scalar)")
+    .property("scaled", &SimpleForward::getScaled, &SimpleForward::setScaled, "Use the scaled linear-space kernel where safe")
+    .property("smooth_checkpoints", &SimpleForward::getSmoothCheckpoints, &SimpleForward::setSmoothCheckpoints, "Store forward messages only every sqrt(nT) time points when smoothing, to save memory at the cost of recomputing the messages between them (default FALSE)")
+    .property("scaled_interval", &SimpleForward::getScaledInterval, "Get the renormalisation interval of the scaled kernel (0 for log space)")
     //    .property("states", &Simulation::GetStates, "Get the total for each state")
     ;
 
+  // Fully unrolled for K = 2, 3, 4 with a runtime-K fallback:
+  expose_forward<ForwardTemplate<2L>>("Forward_K2");
+  expose_forward<ForwardTemplate<3L>>("Forward_K3");
+  expose_forward<ForwardTemplate<4L>>("Forward_K4");
+  expose_forward<ForwardTemplate<0L>>("Forward_K");
+
+  // Fully unrolled for 2 to 6 diseases with a runtime-nD fallback:
+  expose_multi_disease<MultiDiseaseForward<2L>>("MultiDisease_D2");
+  expose_multi_disease<MultiDiseaseForward<3L>>("MultiDisease_D3");
+  expose_multi_disease<MultiDiseaseForward<4L>>("MultiDisease_D4");
+  expose_multi_disease<MultiDiseaseForward<5L>>("MultiDisease_D5");
+  expose_multi_disease<MultiDiseaseForward<6L>>("MultiDisease_D6");
+  expose_multi_disease<MultiDiseaseForward<0L>>("MultiDisease_D");
+
 }
 
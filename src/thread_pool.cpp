@@ -0,0 +1,24 @@
+// Module-level thread pool and threading settings
+
+#include <stdexcept>
+
+#include "thread_pool.h"
+
+std::atomic<int> himm_default_threads(1L);
+
+ThreadPool& thread_pool()
+{
+  static ThreadPool pool;
+  return pool;
+}
+
+int get_default_threads()
+{
+  return himm_default_threads;
+}
+
+void set_default_threads(const int threads)
+{
+  if(threads < 1L) throw std::runtime_error("The number of threads must be at least 1");
+  himm_default_threads = threads;
+}
@@ -0,0 +1,232 @@
+#ifndef THREAD_POOL_H_
+#define THREAD_POOL_H_
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Persistent pool of worker threads for the likelihood kernels
+
+class ThreadPool
+{
+  private:
+    std::vector<std::thread> m_workers;
+    std::mutex m_run_mutex;
+    std::mutex m_mutex;
+    std::condition_variable m_start;
+    std::condition_variable m_done;
+
+    std::function<void(size_t)> m_task;
+    std::atomic<size_t> m_next;
+    size_t m_nblocks = 0L;
+    size_t m_participants = 0L;
+    size_t m_running = 0L;
+    size_t m_generation = 0L;
+    bool m_stop = false;
+
+    void work()
+    {
+      size_t block = m_next++;
+      while(block < m_nblocks)
+      {
+        m_task(block);
+        block = m_next++;
+      }
+    }
+
+    void worker(const size_t index)
+    {
+      size_t seen = 0L;
+      while(true)
+      {
+        {
+          std::unique_lock<std::mutex> lock(m_mutex);
+          m_start.wait(lock, [&]{ return m_stop || (m_generation != seen && index < m_participants); });
+          if(m_stop) return;
+          seen = m_generation;
+        }
+
+        work();
+
+        {
+          std::lock_guard<std::mutex> lock(m_mutex);
+          m_running--;
+        }
+        m_done.notify_one();
+      }
+    }
+
+  public:
+    ThreadPool() : m_next(0L)
+    {
+    }
+
+    // Runs task(0) ... task(nblocks-1) using the calling thread plus up to
+    // nthreads-1 workers, and returns once every block is finished
+    void run(const size_t nthreads, const size_t nblocks, const std::function<void(size_t)>& task)
+    {
+      std::lock_guard<std::mutex> run_lock(m_run_mutex);
+
+      const size_t nworkers = std::min(nthreads, nblocks) - 1L;
+      {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        while(m_workers.size() < nworkers)
+        {
+          m_workers.emplace_back(&ThreadPool::worker, this, m_workers.size());
+        }
+
+        m_task = task;
+        m_nblocks = nblocks;
+        m_next = 0L;
+        m_participants = nworkers;
+        m_running = nworkers;
+        m_generation++;
+      }
+      m_start.notify_all();
+
+      work();
+
+      std::unique_lock<std::mutex> lock(m_mutex);
+      m_done.wait(lock, [&]{ return m_running == 0L; });
+      m_participants = 0L;
+    }
+
+    ~ThreadPool()
+    {
+      {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stop = true;
+      }
+      m_start.notify_all();
+      for(auto& thread : m_workers)
+      {
+        thread.join();
+      }
+    }
+};
+
+// Module-level pool and default number of threads (used by objects whose
+// own setting is 0, which includes everything called via dhimm by default)
+ThreadPool& thread_pool();
+int get_default_threads();
+void set_default_threads(const int threads);
+
+// Blocks have a fixed size so that the partial sums, and the order in which
+// they are combined, do not depend on the number of threads
+const size_t parallel_block_size = 256L;
+// Below this many (pattern x time point) units the work is run serially
+const size_t parallel_threshold = 65536L;
+
+inline size_t parallel_num_blocks(const size_t n)
+{
+  return (n + parallel_block_size - 1L) / parallel_block_size;
+}
+
+inline bool parallel_worthwhile(const size_t n, const size_t work_per_item, const int threads)
+{
+  return threads > 1L && parallel_num_blocks(n) > 1L && n * work_per_item >= parallel_threshold;
+}
+
+// Calls task(block, from, to) for consecutive blocks of [0, n), with the
+// blocks shared between threads when the work is large enough
+template<class F>
+void parallel_blocks(const size_t n, const size_t work_per_item, const int threads, F task)
+{
+  const size_t nblocks = parallel_num_blocks(n);
+
+  auto block_task = [&](const size_t block)
+  {
+    const size_t from = block * parallel_block_size;
+    const size_t to = std::min(n, from + parallel_block_size);
+    task(block, from, to);
+  };
+
+  if(parallel_worthwhile(n, work_per_item, threads))
+  {
+    thread_pool().run(threads, nblocks, block_task);
+  }
+  else
+  {
+    for(size_t block=0L; block<nblocks; ++block)
+    {
+      block_task(block);
+    }
+  }
+}
+
+// Sums block_sum(from, to) over consecutive blocks of [0, n)
+template<class F>
+double parallel_block_sum(const size_t n, const size_t work_per_item, const int threads, F block_sum)
+{
+  // Serially the partial sums are added as they are made, which gives the
+  // same result without allocating storage for them:
+  if(!parallel_worthwhile(n, work_per_item, threads))
+  {
+    double total = 0.0;
+    for(size_t from=0L; from<n; from+=parallel_block_size)
+    {
+      total += block_sum(from, std::min(n, from + parallel_block_size));
+    }
+    return total;
+  }
+
+  // The storage for the partial sums is kept by the calling thread and
+  // only grows, so repeated calls do not allocate (the reference is what
+  // the blocks on other threads see):
+  thread_local std::vector<double> partial_storage;
+  std::vector<double>& partial = partial_storage;
+  const size_t nblocks = parallel_num_blocks(n);
+  if(partial.size() < nblocks) partial.resize(nblocks);
+
+  parallel_blocks(n, work_per_item, threads, [&](const size_t block, const size_t from, const size_t to)
+  {
+    partial[block] = block_sum(from, to);
+  });
+
+  double total = 0.0;
+  for(size_t block=0L; block<nblocks; ++block)
+  {
+    total += partial[block];
+  }
+  return total;
+}
+
+// Calls task(k) for each k in [0, n), with the items handed out to the
+// threads one at a time in order, so that items sorted by decreasing cost
+// are scheduled largest first.  The first exception thrown by a task is
+// passed on to the caller once every item has been run.
+template<class F>
+void parallel_items(const size_t n, const int threads, F task)
+{
+  if(threads <= 1L || n <= 1L)
+  {
+    for(size_t k=0L; k<n; ++k)
+    {
+      task(k);
+    }
+    return;
+  }
+
+  std::mutex error_mutex;
+  std::exception_ptr error;
+  thread_pool().run(threads, n, [&](const size_t k)
+  {
+    try
+    {
+      task(k);
+    }
+    catch(...)
+    {
+      std::lock_guard<std::mutex> lock(error_mutex);
+      if(!error) error = std::current_exception();
+    }
+  });
+  if(error) std::rethrow_exception(error);
+}
+
+#endif // THREAD_POOL_H_